@@ -69,6 +69,21 @@ Allocate_VMM_Pages(
 	return (void*) result.start;
 }
 
+static void *
+Allocate_VMM_Pages_Aligned(
+	int			num_pages,
+	unsigned int		alignment
+) 
+{
+	struct pmem_region result;
+  
+	int rc = pmem_alloc_umem( num_pages*PAGE_SIZE, alignment, &result );
+	if( rc )
+		return 0;
+
+	return (void*) result.start;
+}
+
 static void
 Free_VMM_Page(
 	void *			page
@@ -238,6 +253,7 @@ struct v3_os_hooks v3vee_os_hooks = {
 	.print_info		= v3vee_printk,   // serial print ideally
 	.print_trace		= v3vee_printk,  // serial print ideally
 	.allocate_pages		= Allocate_VMM_Pages, // defined in vmm_stubs
+	.allocate_pages_aligned	= Allocate_VMM_Pages_Aligned, // defined in vmm_stubs
 	.free_page		= Free_VMM_Page, // defined in vmm_stubs
 	.malloc			= v3vee_alloc,
 	.free			= v3vee_free,
@@ -50,6 +50,7 @@
 
 #define GENERIC_PRINT_AND_PASSTHROUGH 0
 #define GENERIC_PRINT_AND_IGNORE      1
+#define GENERIC_PASSTHROUGH           2   // no logging, the guest accesses the ports without exiting
 
 
 int v3_generic_add_port_range(struct vm_device * dev, uint_t start, uint_t end, uint_t type);
@@ -37,6 +37,7 @@
 #define CPUID_SVM_REV_AND_FEATURE_IDS 0x8000000a
 #define CPUID_SVM_REV_AND_FEATURE_IDS_edx_svml 0x00000004
 #define CPUID_SVM_REV_AND_FEATURE_IDS_edx_np  0x00000001
+#define CPUID_SVM_REV_AND_FEATURE_IDS_edx_flushbyasid  0x00000040
 
 
 #define EFER_MSR                 0xc0000080
@@ -80,6 +81,19 @@
 #define SVM_HANDLER_HALT      0x2
 
 
+/* VMCB TLB_CONTROL values */
+#define SVM_TLB_FLUSH_NOTHING   0x0
+#define SVM_TLB_FLUSH_ALL       0x1
+#define SVM_TLB_FLUSH_GUEST     0x3   // Only entries tagged with the guest's ASID (FlushByASID)
+
+
+/* ASID 0 is reserved for the host */
+#define SVM_MAX_ASIDS         256
+
+
+int v3_svm_alloc_asid();
+
+
 
 void v3_init_SVM(struct v3_ctrl_ops * vmm_ops);
 int v3_is_svm_capable();
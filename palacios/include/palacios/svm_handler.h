@@ -192,8 +192,49 @@
 /******************************************/
 
 
+/* Exit codes are dense up to VMEXIT_MWAIT_CONDITIONAL, 
+ * the sparse ones are folded in at the end of per-exit tables 
+ */
+#define VMEXIT_NPF_SLOT             (VMEXIT_MWAIT_CONDITIONAL + 1)
+#define VMEXIT_INVALID_VMCB_SLOT    (VMEXIT_MWAIT_CONDITIONAL + 2)
+#define VMEXIT_UNKNOWN_SLOT         (VMEXIT_MWAIT_CONDITIONAL + 3)
+#define VMEXIT_NUM_SLOTS            (VMEXIT_MWAIT_CONDITIONAL + 4)
+
+static inline uint_t v3_svm_exit_slot(uint_t exit_code) {
+  if (exit_code <= VMEXIT_MWAIT_CONDITIONAL) {
+    return exit_code;
+  } else if (exit_code == VMEXIT_NPF) {
+    return VMEXIT_NPF_SLOT;
+  } else if (exit_code == (uint_t)VMEXIT_INVALID_VMCB) {
+    return VMEXIT_INVALID_VMCB_SLOT;
+  }
+
+  return VMEXIT_UNKNOWN_SLOT;
+}
+
+
+struct v3_exit_handler {
+  int (*handler)(struct guest_info * info, void * priv_data);
+  void * priv_data;
+
+  // set if the exit must be intercepted for the handler to run
+  uint_t intercept;
+};
+
+
+int v3_init_svm_exit_handlers(struct guest_info * info);
+void v3_svm_enable_exit_intercepts(struct guest_info * info);
+
+int v3_register_exit_handler(struct guest_info * info, uint_t exit_code, 
+			     int (*handler)(struct guest_info * info, void * priv_data), 
+			     void * priv_data);
+int v3_unregister_exit_handler(struct guest_info * info, uint_t exit_code);
+
+
 int v3_handle_svm_exit(struct guest_info * info);
 
+const uchar_t * vmexit_code_to_str(uint_t exit_code);
+
 #endif // ! __V3VEE__
 
 #endif
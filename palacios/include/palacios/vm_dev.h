@@ -30,6 +30,7 @@ struct guest_info;
 
 
 struct vm_device;
+struct v3_chkpt;
 
 
 struct vm_device_ops {
@@ -43,8 +44,9 @@ struct vm_device_ops {
   int (*stop)(struct vm_device *dev);
 
 
-  //int (*save)(struct vm_device *dev, struct *iostream);
-  //int (*restore)(struct vm_device *dev, struct *iostream);
+  // Stream the device state into a checkpoint and back, NULL if the device has none
+  int (*save)(struct vm_device *dev, struct v3_chkpt * chkpt);
+  int (*restore)(struct vm_device *dev, struct v3_chkpt * chkpt);
 };
 
 
@@ -83,6 +85,21 @@ int v3_dev_hook_io(struct vm_device   *dev,
 		int (*read)(ushort_t port, void * dst, uint_t length, struct vm_device * dev),
 		int (*write)(ushort_t port, void * src, uint_t length, struct vm_device * dev));
 
+int v3_dev_hook_io_range(struct vm_device   *dev,
+			 ushort_t            start,
+			 ushort_t            end,
+			 int (*read)(ushort_t port, void * dst, uint_t length, struct vm_device * dev),
+			 int (*write)(ushort_t port, void * src, uint_t length, struct vm_device * dev));
+
+int v3_dev_passthrough_io_range(struct vm_device   *dev,
+				ushort_t            start,
+				ushort_t            end);
+
+int v3_dev_hook_io_str(struct vm_device   *dev,
+		       ushort_t            port,
+		       int (*read_str)(ushort_t port, void * dst, uint_t length, uint_t count, struct vm_device * dev),
+		       int (*write_str)(ushort_t port, void * src, uint_t length, uint_t count, struct vm_device * dev));
+
 int v3_dev_unhook_io(struct vm_device   *dev,
 		  ushort_t            port);
 
@@ -31,6 +31,10 @@
 #include <palacios/vmm_time.h>
 #include <palacios/vmm_emulator.h>
 #include <palacios/vmm_host_events.h>
+#include <palacios/vmm_exit_stats.h>
+#include <palacios/vmm_dedup.h>
+#include <palacios/vmm_dirty_log.h>
+#include <palacios/vmm_migrate.h>
 
 
 
@@ -102,6 +106,7 @@ struct shadow_map;
 struct vmm_io_map;
 struct emulation_state;
 struct v3_intr_state;
+struct v3_exit_handler;
 
 
 
@@ -139,26 +144,93 @@ struct guest_info {
 
   struct v3_host_events host_event_hooks;
 
+  struct v3_exit_stats exit_stats;
+
+  // Merging of identical guest pages
+  struct v3_dedup_state dedup;
+
+  // Guest pages written since the host last read the log
+  struct v3_dirty_log_state dirty_log;
+
+  // Outgoing live migration
+  struct v3_migration_state migration;
+
+  // Exit handler table, indexed by (folded) exit code
+  struct v3_exit_handler * exit_handlers;
+
   v3_vm_cpu_mode_t cpu_mode;
   v3_vm_mem_mode_t mem_mode;
 
 
   struct v3_gprs vm_regs;
+
+  /* These are synchronized with the VMCB lazily, 
+   * they must only be accessed through the v3_get_*()/v3_mod_*() functions below 
+   */
   struct v3_ctrl_regs ctrl_regs;
   struct v3_dbg_regs dbg_regs;
   struct v3_segments segments;
 
+  uint_t state_valid;
+  uint_t state_dirty;
+
   struct emulation_state emulator;
 
   v3_vm_operating_mode_t run_state;
   void * vmm_data;
 
+  // Address space ID tagging the guest's TLB entries
+  uint_t asid;
+
   /* TEMP */
   //ullong_t exit_tsc;
 
 };
 
 
+/* Lazily synchronized state groups */
+#define V3_STATE_CTRL_REGS   0x1
+#define V3_STATE_DBG_REGS    0x2
+#define V3_STATE_SEGMENTS    0x4
+
+
+// Pull a state group in from the hardware state
+void v3_load_guest_state(struct guest_info * info, uint_t group);
+// Push all modified state groups back out, and invalidate the cached copies
+void v3_flush_guest_state(struct guest_info * info);
+
+
+static inline void * __v3_get_state(struct guest_info * info, uint_t group, void * state) {
+  if (!(info->state_valid & group)) {
+    v3_load_guest_state(info, group);
+  }
+  return state;
+}
+
+static inline void * __v3_mod_state(struct guest_info * info, uint_t group, void * state) {
+  __v3_get_state(info, group, state);
+  info->state_dirty |= group;
+  return state;
+}
+
+
+// v3_get_*() is for reading, v3_mod_*() must be used if the state is going to be changed
+#define v3_get_ctrl_regs(info) ((struct v3_ctrl_regs *)__v3_get_state(info, V3_STATE_CTRL_REGS, &((info)->ctrl_regs)))
+#define v3_mod_ctrl_regs(info) ((struct v3_ctrl_regs *)__v3_mod_state(info, V3_STATE_CTRL_REGS, &((info)->ctrl_regs)))
+
+#define v3_get_dbg_regs(info) ((struct v3_dbg_regs *)__v3_get_state(info, V3_STATE_DBG_REGS, &((info)->dbg_regs)))
+#define v3_mod_dbg_regs(info) ((struct v3_dbg_regs *)__v3_mod_state(info, V3_STATE_DBG_REGS, &((info)->dbg_regs)))
+
+#define v3_get_segments(info) ((struct v3_segments *)__v3_get_state(info, V3_STATE_SEGMENTS, &((info)->segments)))
+#define v3_mod_segments(info) ((struct v3_segments *)__v3_mod_state(info, V3_STATE_SEGMENTS, &((info)->segments)))
+
+
+
+// Invalidate cached guest translations (all of them, or a single page)
+void v3_flush_guest_tlb(struct guest_info * info);
+void v3_flush_guest_tlb_page(struct guest_info * info, addr_t va);
+
+
 v3_vm_cpu_mode_t v3_get_cpu_mode(struct guest_info * info);
 v3_vm_mem_mode_t v3_get_mem_mode(struct guest_info * info);
 
@@ -92,6 +92,10 @@ int host_pa_to_guest_va(struct guest_info * guest_info, addr_t host_pa, addr_t *
 // guest_va -> guest_pa -> host_pa -> host_va
 int guest_va_to_host_va(struct guest_info * guest_info, addr_t guest_va, addr_t * host_va);
 
+// As above, for VMM writes to guest memory: the page is marked in the dirty log
+int guest_pa_to_host_va_for_write(struct guest_info * guest_info, addr_t guest_pa, addr_t * host_va);
+int guest_va_to_host_va_for_write(struct guest_info * guest_info, addr_t guest_va, addr_t * host_va);
+
 
 /* !! Currently not implemented !! */
 // host_va -> host_pa -> guest_pa -> guest_va
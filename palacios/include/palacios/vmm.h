@@ -95,6 +95,20 @@
   })							\
 
 
+// Falls back to plain allocate_pages if the host can't align, so callers must check the alignment
+#define V3_AllocPagesAligned(num_pages, align)				\
+  ({									\
+    extern struct v3_os_hooks * os_hooks;				\
+    void * ptr = 0;							\
+    if ((os_hooks) && (os_hooks)->allocate_pages_aligned) {		\
+      ptr = (os_hooks)->allocate_pages_aligned(num_pages, align);	\
+    } else if ((os_hooks) && (os_hooks)->allocate_pages) {		\
+      ptr = (os_hooks)->allocate_pages(num_pages);			\
+    }									\
+    ptr;								\
+  })									\
+
+
 #define V3_FreePage(page)			\
   do {						\
     extern struct v3_os_hooks * os_hooks;	\
@@ -219,6 +233,8 @@ struct v3_os_hooks {
   	__attribute__ ((format (printf, 1, 2)));
   
   void *(*allocate_pages)(int numPages);
+  // Optional: contiguous pages starting at a multiple of alignment bytes
+  void *(*allocate_pages_aligned)(int numPages, unsigned int alignment);
   void (*free_page)(void * page);
 
   void *(*malloc)(unsigned int size);
@@ -254,6 +270,16 @@ struct v3_vm_config {
   int use_ramdisk;
   void * ramdisk;
   int ramdisk_size;
+
+  // Back guest RAM with one contiguous chunk aligned to this many bytes (2MB or 4MB), 
+  // so it can be mapped with large pages. 0 keeps the default layout
+  unsigned int mem_align;
+
+  // Only allocate guest RAM when the guest first touches it
+  int mem_on_demand;
+
+  // Merge identical pages of demand allocated guest RAM while the guest is idle
+  int mem_dedup;
 };
 
 
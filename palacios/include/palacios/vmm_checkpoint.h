@@ -0,0 +1,95 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#ifndef __VMM_CHECKPOINT_H__
+#define __VMM_CHECKPOINT_H__
+
+
+#ifdef __V3VEE__
+
+#include <palacios/vmm_types.h>
+
+
+// A checkpoint or migration stream
+struct v3_chkpt {
+  struct v3_chkpt_ops * ops;
+  void * priv_data;
+};
+
+
+// Writes or reads exactly len bytes, returns -1 if the host stream came up short
+int v3_chkpt_save(struct v3_chkpt * chkpt, void * buf, uint_t len);
+int v3_chkpt_load(struct v3_chkpt * chkpt, void * buf, uint_t len);
+
+#define V3_CHKPT_SAVE(chkpt, var) v3_chkpt_save(chkpt, &(var), sizeof(var))
+#define V3_CHKPT_LOAD(chkpt, var) v3_chkpt_load(chkpt, &(var), sizeof(var))
+
+
+// What follows the header of a stream
+#define V3_CHKPT_IMAGE     0
+#define V3_CHKPT_MIGRATION 1
+
+struct guest_info;
+struct shadow_region;
+
+// The header carries the memory map layout, which the receiving guest must match
+int v3_chkpt_save_header(struct guest_info * info, struct v3_chkpt * chkpt, uint_t stream_type);
+int v3_chkpt_check_header(struct guest_info * info, struct v3_chkpt * chkpt, uint_t stream_type);
+
+// Regions whose pages are part of a checkpoint
+int v3_chkpt_is_guest_ram(struct shadow_region * reg);
+
+// A single RAM page, zero pages are sent without their contents
+int v3_chkpt_save_page(struct v3_chkpt * chkpt, struct shadow_region * reg, addr_t guest_pa);
+int v3_chkpt_load_page(struct guest_info * info, struct v3_chkpt * chkpt, 
+		       struct shadow_region * reg, addr_t guest_pa);
+
+ulong_t v3_chkpt_ram_checksum(struct guest_info * info);
+
+// CPU and device state, loading it also reinstalls the guest's paging state
+int v3_chkpt_save_state(struct guest_info * info, struct v3_chkpt * chkpt);
+int v3_chkpt_load_state(struct guest_info * info, struct v3_chkpt * chkpt);
+
+#endif // ! __V3VEE__
+
+
+struct guest_info;
+
+
+/* Host stream a checkpoint is written to or read back from
+ * Both return the number of bytes transferred, anything short of len aborts the checkpoint
+ */
+struct v3_chkpt_ops {
+  int (*write)(void * priv_data, void * buf, unsigned int len);
+  int (*read)(void * priv_data, void * buf, unsigned int len);
+};
+
+
+/* Streams the guest's memory map layout, RAM, CPU and device state through ops->write
+ * The guest must be stopped between exits, nothing is staged in VMM memory
+ */
+int v3_save_vm(struct guest_info * info, struct v3_chkpt_ops * ops, void * priv_data);
+
+/* Loads a checkpoint into a guest that was configured the same way and has not been started yet
+ * Shadow and passthrough page tables are rebuilt on demand once the guest runs
+ */
+int v3_restore_vm(struct guest_info * info, struct v3_chkpt_ops * ops, void * priv_data);
+
+
+#endif
@@ -206,6 +206,8 @@ int v3_handle_cr0_read(struct guest_info * info);
 int v3_handle_cr3_write(struct guest_info * info);
 int v3_handle_cr3_read(struct guest_info * info);
 
+int v3_handle_cr4_write(struct guest_info * info);
+
 
 #endif // ! __V3VEE__
 
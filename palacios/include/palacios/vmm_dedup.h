@@ -0,0 +1,93 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#ifndef __VMM_DEDUP_H__
+#define __VMM_DEDUP_H__
+
+
+/* Per VM page merging counters */
+struct v3_dedup_stats {
+  unsigned long long pages_scanned;
+  unsigned int full_scans;
+
+  // Guest pages currently backed by a shared page
+  unsigned int pages_shared;
+
+  // Host pages currently saved on behalf of this VM
+  // Copies made when another VM's merge is undone here are charged to this VM, so it can go negative
+  int pages_saved;
+
+  unsigned int pages_merged;
+  unsigned int pages_unshared;
+  unsigned int pages_zeroed;
+};
+
+
+#ifdef __V3VEE__
+
+#include <palacios/vmm_types.h>
+
+struct guest_info;
+
+
+// Guest pages scanned each time the guest halts
+#define DEDUP_SCAN_BATCH 256
+
+
+/* A host page holding contents that identical guest pages were merged into, mapped read only
+ * Shared pages are global, so VMs booted from the same image share them
+ */
+struct shared_page {
+  addr_t host_addr;
+  ulong_t hash;
+  uint_t ref_count;
+};
+
+
+struct v3_dedup_state {
+  int enabled;
+
+  // Next guest physical address to scan
+  addr_t scan_addr;
+
+  struct v3_dedup_stats stats;
+};
+
+
+void v3_init_dedup(struct guest_info * info, int enabled);
+
+// Scans up to max_pages guest pages of demand allocated memory, merging pages with identical contents
+int v3_dedup_scan(struct guest_info * info, uint_t max_pages);
+
+// Drops a guest page's reference to a shared page, returns the host page that is now its own (0 on error)
+addr_t v3_unshare_page(struct guest_info * info, struct shared_page * shared);
+
+// Drops a guest page's reference to a shared page whose contents are no longer needed
+void v3_put_shared_page(struct guest_info * info, struct shared_page * shared);
+
+#endif // ! __V3VEE__
+
+
+struct guest_info;
+
+void v3_get_dedup_stats(struct guest_info * info, struct v3_dedup_stats * stats);
+void v3_print_dedup_stats(struct guest_info * info);
+
+
+#endif
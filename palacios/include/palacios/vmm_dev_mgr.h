@@ -25,6 +25,7 @@
 #include <palacios/vmm_types.h>
 #include <palacios/vmm_list.h>
 #include <palacios/vmm_string.h>
+#include <palacios/vmm_io.h>
 
 struct vm_device;
 struct guest_info;
@@ -35,7 +36,7 @@ struct vmm_dev_mgr {
   struct list_head dev_list;
 
   uint_t num_io_hooks;
-  struct list_head io_hooks;
+  struct v3_port_table io_hooks;
   
   uint_t num_mem_hooks;
   struct list_head mem_hooks;
@@ -61,6 +62,7 @@ int v3_unattach_device(struct vm_device *dev);
 
 struct dev_io_hook {
   ushort_t port;
+  ushort_t end_port;
   
   int (*read)(ushort_t port, void * dst, uint_t length, struct vm_device * dev);
   int (*write)(ushort_t port, void * src, uint_t length, struct vm_device * dev);
@@ -70,7 +72,6 @@ struct dev_io_hook {
   // Do not touch anything below this  
 
   struct list_head dev_list;
-  struct list_head mgr_list;
 };
 
 struct dev_mem_hook {
@@ -0,0 +1,85 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#ifndef __VMM_DIRTY_LOG_H__
+#define __VMM_DIRTY_LOG_H__
+
+
+#ifdef __V3VEE__
+
+#include <palacios/vmm_types.h>
+
+struct guest_info;
+struct shadow_region;
+
+
+/* Pages of a RAM region written since the log was last read, one bit per guest page
+ * Bits are indexed from guest_base, so both halves of a split region keep using the same bitmap
+ */
+struct dirty_bitmap {
+  addr_t guest_base;
+  uint_t num_pages;
+
+  // Regions using the bitmap
+  uint_t ref_count;
+
+  uchar_t * bits;
+};
+
+
+struct v3_dirty_log_state {
+  int enabled;
+
+  // Pages marked since the log was last read
+  uint_t num_dirty;
+};
+
+
+void v3_init_dirty_log(struct guest_info * info);
+
+// Returns 1 if guest_pa may be mapped writable: the log is off, the page is not RAM, or it is already dirty
+int v3_dirty_log_writable(struct guest_info * info, addr_t guest_pa);
+
+// Records a write to guest_pa, called before a logged page is mapped writable
+int v3_mark_page_dirty(struct guest_info * info, addr_t guest_pa);
+
+// A write to a page whose passthrough entry is only write protected for the log
+int v3_handle_dirty_log_fault(struct guest_info * info, addr_t guest_pa);
+
+// Drops a region's reference to its bitmap
+void v3_put_dirty_bitmap(struct shadow_region * region);
+
+#endif // ! __V3VEE__
+
+
+struct guest_info;
+
+// Write protects guest RAM and starts recording the pages the guest writes
+int v3_enable_dirty_log(struct guest_info * info);
+int v3_disable_dirty_log(struct guest_info * info);
+
+/* Copies the dirty bits of num_pages guest pages starting at guest_start into bitmap and clears them,
+ * only the reported pages are write protected again.
+ * Returns the number of dirty pages, or -1 on error
+ */
+int v3_get_and_clear_dirty_log(struct guest_info * info, unsigned long guest_start, 
+			       unsigned int num_pages, unsigned char * bitmap);
+
+
+#endif
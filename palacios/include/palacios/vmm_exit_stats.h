@@ -0,0 +1,73 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#ifndef __VMM_EXIT_STATS_H__
+#define __VMM_EXIT_STATS_H__
+
+
+// Latencies are bucketed by log2(cycles)
+#define V3_EXIT_HIST_BUCKETS 32
+
+
+/* Per exit reason counters, as seen by the host */
+struct v3_exit_stat {
+  unsigned long long count;
+
+  // Cycles from VMRUN to #VMEXIT (guest execution + world switch)
+  unsigned long long hw_cycles;
+  // Cycles spent by the VMM handling the exit
+  unsigned long long vmm_cycles;
+
+  unsigned long long max_hw_cycles;
+  unsigned long long max_vmm_cycles;
+
+  unsigned int hw_hist[V3_EXIT_HIST_BUCKETS];
+  unsigned int vmm_hist[V3_EXIT_HIST_BUCKETS];
+};
+
+
+#ifdef __V3VEE__
+
+#include <palacios/vmm_types.h>
+
+struct guest_info;
+
+
+struct v3_exit_stats {
+  uint_t num_slots;
+  struct v3_exit_stat * slots;
+};
+
+
+int v3_init_exit_stats(struct guest_info * info);
+
+void v3_record_exit(struct guest_info * info, uint_t exit_code, 
+		    ullong_t hw_cycles, ullong_t vmm_cycles);
+
+#endif // ! __V3VEE__
+
+
+struct guest_info;
+
+int v3_get_exit_stats(struct guest_info * info, unsigned int exit_code, struct v3_exit_stat * stat);
+void v3_reset_exit_stats(struct guest_info * info);
+void v3_print_exit_stats(struct guest_info * info);
+
+
+#endif
@@ -38,28 +38,94 @@ int v3_hook_io_port(struct guest_info * info, uint_t port,
 		    int (*write)(ushort_t port, void * src, uint_t length, void * priv_data), 
 		    void * priv_data);
 
+/* Hooks every port in [start, end] (inclusive) with a single hook entry
+ * The handlers receive the absolute port number, so the offset into the range is (port - start)
+ * The range is removed by calling v3_unhook_io_port() on its start port
+ */
+int v3_hook_io_port_range(struct guest_info * info, uint_t start, uint_t end, 
+			  int (*read)(ushort_t port, void * dst, uint_t length, void * priv_data),
+			  int (*write)(ushort_t port, void * src, uint_t length, void * priv_data), 
+			  void * priv_data);
+
+/* Hands [start, end] directly to the guest: the ports are reserved in the IO map
+ * but their IO bitmap bits are cleared, so guest accesses never exit
+ */
+int v3_passthrough_io_port_range(struct guest_info * info, uint_t start, uint_t end, void * priv_data);
+
+/* Optional string handlers for REP INS/OUTS on an already hooked port
+ * These transfer count elements of length bytes each to/from a host contiguous buffer
+ * and return the number of elements transferred
+ */
+int v3_hook_io_port_str(struct guest_info * info, uint_t port, 
+			int (*read_str)(ushort_t port, void * dst, uint_t length, uint_t count, void * priv_data),
+			int (*write_str)(ushort_t port, void * src, uint_t length, uint_t count, void * priv_data));
+
+
 
 
 
 
+/* Two level radix table covering the 16 bit port space
+ * The leaves are only allocated when a port in their range is hooked
+ */
+#define IO_PORT_DIR_BITS      8
+#define IO_PORT_LEAF_BITS     8
+#define IO_PORT_DIR_ENTRIES   (1 << IO_PORT_DIR_BITS)
+#define IO_PORT_LEAF_ENTRIES  (1 << IO_PORT_LEAF_BITS)
+
+#define IO_PORT_DIR_INDEX(port)  (((port) >> IO_PORT_LEAF_BITS) & (IO_PORT_DIR_ENTRIES - 1))
+#define IO_PORT_LEAF_INDEX(port) ((port) & (IO_PORT_LEAF_ENTRIES - 1))
+
+
+struct v3_port_table {
+  void ** dir[IO_PORT_DIR_ENTRIES];
+};
+
+
+int v3_port_table_insert(struct v3_port_table * table, ushort_t port, void * entry);
+void * v3_port_table_remove(struct v3_port_table * table, ushort_t port);
+int v3_port_table_insert_range(struct v3_port_table * table, ushort_t start, ushort_t end, void * entry);
+int v3_port_table_remove_range(struct v3_port_table * table, ushort_t start, ushort_t end, void * entry);
+void v3_port_table_free(struct v3_port_table * table);
+
+static inline void * v3_port_table_lookup(struct v3_port_table * table, ushort_t port) {
+  void ** leaf = table->dir[IO_PORT_DIR_INDEX(port)];
+
+  if (leaf == NULL) {
+    return NULL;
+  }
+
+  return leaf[IO_PORT_LEAF_INDEX(port)];
+}
+
+
+
 
 struct vmm_io_hook;
 
+/* One bit per port, set if accesses to that port exit to the VMM
+ * This is laid out so SVM can use it directly as the IOPM (12KB)
+ */
+#define IO_BITMAP_PAGES 3
+
 struct vmm_io_map {
   uint_t num_ports;
-  struct vmm_io_hook * head;
+  struct v3_port_table ports;
 
+  uchar_t * io_bitmap;
 };
 
 
-void v3_init_vmm_io_map(struct guest_info * info);
+int v3_init_vmm_io_map(struct guest_info * info);
 
-// FOREACH_IO_HOOK(vmm_io_map_t * io_map, vmm_io_hook_t * io_hook)
-#define FOREACH_IO_HOOK(io_map, io_hook) for (io_hook = (io_map).head; io_hook != NULL; io_hook = (io_hook)->next)
 
+#define V3_IO_HOOK_TRAP         0
+#define V3_IO_HOOK_PASSTHROUGH  1
 
 struct vmm_io_hook {
   ushort_t port;
+  ushort_t end_port;   // == port for single port hooks
+  uint_t type;
 
   // Reads data into the IO port (IN, INS)
   int (*read)(ushort_t port, void * dst, uint_t length, void * priv_data);
@@ -67,16 +133,24 @@ struct vmm_io_hook {
   // Writes data from the IO port (OUT, OUTS)
   int (*write)(ushort_t port, void * src, uint_t length, void * priv_data);
 
-  void * priv_data;
-
-  struct vmm_io_hook * next;
-  struct vmm_io_hook * prev;
+  // String variants (REP INS/OUTS), NULL if the hook handles one element at a time
+  int (*read_str)(ushort_t port, void * dst, uint_t length, uint_t count, void * priv_data);
+  int (*write_str)(ushort_t port, void * src, uint_t length, uint_t count, void * priv_data);
 
+  void * priv_data;
 };
 
 
-struct vmm_io_hook * v3_get_io_hook(struct vmm_io_map * io_map, uint_t port);
+static inline struct vmm_io_hook * v3_get_io_hook(struct vmm_io_map * io_map, uint_t port) {
+  return (struct vmm_io_hook *)v3_port_table_lookup(&(io_map->ports), port);
+}
+
 
+/* Dispatch an exiting IN/OUT of length bytes starting at port to its hooks
+ * Return length on success, -1 on failure
+ */
+int v3_io_write(struct vmm_io_map * io_map, ushort_t port, void * src, uint_t length);
+int v3_io_read(struct vmm_io_map * io_map, ushort_t port, void * dst, uint_t length);
 
 void v3_print_io_map(struct vmm_io_map * io_map);
 
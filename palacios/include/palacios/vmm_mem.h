@@ -30,6 +30,7 @@
 #include <palacios/vmm_paging.h>
 
 struct guest_info;
+struct dirty_bitmap;
 
 
 /*
@@ -75,15 +76,47 @@ struct shadow_region {
   addr_t                  host_addr; // This either points to a host address mapping, 
                                      // or a structure holding the map info 
 
-  struct shadow_region *next, *prev;
+  // Pages written while dirty logging is on, NULL until the first write
+  struct dirty_bitmap *   dirty_log;
 };
 
 
 
+// Pages of host memory allocated at once when the guest first writes a demand allocated region
+#define DEMAND_MEM_CHUNK_PAGES 16
+
+// Set in a demand page entry that points to a struct shared_page instead of a page of its own
+#define DEMAND_PAGE_SHARED 0x1
+
+/* host_addr of a HOST_REGION_UNALLOCATED region points to one of these
+ * Pages are indexed from the chunk aligned guest address below the region start,
+ * so both halves of a split region can keep using the same table
+ */
+struct demand_mem {
+  addr_t guest_base;
+  uint_t num_pages;
+
+  // Per guest page: 0 until it is written (reads see the zero page), 
+  // the host physical address of its own page, or a shared page | DEMAND_PAGE_SHARED
+  addr_t * pages;
+
+  // Regions using this table, a split region shares it with its tail
+  uint_t ref_count;
+};
+
+
+
+/* The regions are kept in an array sorted by guest_start, 
+ * so lookups are a binary search.
+ * Most lookups hit the same region as the previous one, so we check that first
+ */
 struct shadow_map {
   uint_t num_regions;
+  uint_t max_regions;
 
-  struct shadow_region * head;
+  struct shadow_region ** regions;
+
+  struct shadow_region * last_hit;
 };
 
 
@@ -107,6 +140,25 @@ int add_shadow_region_passthrough(struct guest_info * guest_info,
 				  addr_t guest_addr_end,
 				  addr_t host_addr);
 
+// Adds guest memory that is only backed with host memory once the guest touches it
+int add_shadow_region_demand(struct guest_info * guest_info, 
+			     addr_t guest_addr_start,
+			     addr_t guest_addr_end);
+
+addr_t * get_demand_page_entry(struct shadow_region * region, addr_t guest_addr);
+
+// Host address of the page guest_addr owns in a demand region, 0 if it has none
+addr_t get_demand_mem_addr(struct shadow_region * region, addr_t guest_addr);
+
+// Host address to map read only for a page without one of its own (the zero page or a shared page)
+addr_t get_demand_mem_readonly_addr(struct shadow_region * region, addr_t guest_addr);
+
+// Gives guest_addr a page of its own: allocates its chunk, or copies a shared page
+int alloc_demand_mem(struct guest_info * info, addr_t guest_addr);
+
+// Host physical address of the read only page that stands in for unwritten demand memory
+addr_t get_zero_page();
+
 void init_shadow_map(struct guest_info * info);
 void free_shadow_map(struct shadow_map * map);
 
@@ -114,11 +166,17 @@ struct shadow_region * get_shadow_region_by_addr(struct shadow_map * map, addr_t
 
 struct shadow_region * get_shadow_region_by_index(struct shadow_map * map, uint_t index);
 
+// Returns the region containing guest_addr, or else the first region after it
+struct shadow_region * get_next_shadow_region(struct shadow_map * map, addr_t guest_addr);
+
 host_region_type_t lookup_shadow_map_addr(struct shadow_map * map, addr_t guest_addr, addr_t * host_addr);
 
 host_region_type_t get_shadow_addr_type(struct guest_info * info, addr_t guest_addr);
 addr_t get_shadow_addr(struct guest_info * info, addr_t guest_addr);
 
+// Returns 1 if the page_size bytes at guest_addr can be mapped with one large page
+int get_large_page_backing(struct shadow_map * map, addr_t guest_addr, addr_t page_size, addr_t * host_addr);
+
 // Semantics:
 // Adding a region that overlaps with an existing region results is undefined
 // and will probably fail
@@ -126,7 +184,8 @@ int add_shadow_region(struct shadow_map * map, struct shadow_region * entry);
 
 // Semantics:
 // Deletions result in splitting
-int delete_shadow_region(struct shadow_map * map,
+// Demand pages in the deleted range are returned to the host, callers must update the passthrough tables
+int delete_shadow_region(struct guest_info * info,
 			     addr_t guest_start, 
 			     addr_t guest_end);
 
@@ -0,0 +1,104 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#ifndef __VMM_MIGRATE_H__
+#define __VMM_MIGRATE_H__
+
+
+/* Counters of the last outgoing migration */
+struct v3_migration_stats {
+  // Pre-copy passes over guest RAM, the first one sends every page
+  unsigned int rounds;
+  unsigned long long pages_sent;
+
+  // Pages left dirty when the guest was stopped
+  unsigned int final_pages;
+
+  // Cycles the guest was stopped for, and from the start of the migration to the end
+  unsigned long long downtime_cycles;
+  unsigned long long total_cycles;
+};
+
+
+#ifdef __V3VEE__
+
+#include <palacios/vmm_types.h>
+#include <palacios/vmm_checkpoint.h>
+
+struct guest_info;
+
+
+// Guest pages sent after each VM exit during a pre-copy round
+#define MIGRATE_BATCH_PAGES 256
+
+// The guest is stopped once a round leaves no more than this many dirty pages,
+// or after MIGRATE_MAX_ROUNDS rounds if the dirty set does not converge
+#define MIGRATE_STOP_PAGES  64
+#define MIGRATE_MAX_ROUNDS  30
+
+
+typedef enum {MIGRATE_IDLE, MIGRATE_PRECOPY, MIGRATE_DONE, MIGRATE_FAILED} v3_migrate_state_t;
+
+
+struct v3_migration_state {
+  v3_migrate_state_t state;
+
+  struct v3_chkpt stream;
+
+  // Next guest physical address to send in the current round
+  addr_t send_addr;
+
+  uint_t round_pages;
+  uint_t last_round_pages;
+
+  ullong_t start_tsc;
+
+  struct v3_migration_stats stats;
+};
+
+
+void v3_init_migration(struct guest_info * info);
+
+/* Sends the next batch of the current pre-copy round, called after each VM exit is handled
+ * Returns 1 once the guest has been stopped and its final state sent, 0 otherwise
+ */
+int v3_migration_step(struct guest_info * info);
+
+#endif // ! __V3VEE__
+
+
+struct guest_info;
+struct v3_chkpt_ops;
+
+
+/* Starts migrating a guest through ops->write, which may be a pipe or shared memory stand-in for a network link
+ * Memory is sent while the guest keeps running, start_guest() returns once the guest has moved to the receiver
+ */
+int v3_start_migration(struct guest_info * info, struct v3_chkpt_ops * ops, void * priv_data);
+
+/* Loads an incoming migration stream into a guest that was configured the same way and has not been started yet
+ * The guest resumes where the sender stopped it once start_guest() is called
+ */
+int v3_receive_migration(struct guest_info * info, struct v3_chkpt_ops * ops, void * priv_data);
+
+void v3_get_migration_stats(struct guest_info * info, struct v3_migration_stats * stats);
+void v3_print_migration_stats(struct guest_info * info);
+
+
+#endif
@@ -105,6 +105,11 @@ the host state in the vmcs before entering the guest.
 #define PDE32_INDEX(x)  ((((uint_t)x) >> 22) & 0x3ff)
 #define PTE32_INDEX(x)  ((((uint_t)x) >> 12) & 0x3ff)
 
+#define PML4E64_INDEX(x) ((((ullong_t)x) >> 39) & 0x1ff)
+#define PDPE64_INDEX(x)  ((((ullong_t)x) >> 30) & 0x1ff)
+#define PDE64_INDEX(x)   ((((ullong_t)x) >> 21) & 0x1ff)
+#define PTE64_INDEX(x)   ((((ullong_t)x) >> 12) & 0x1ff)
+
 /* Gets the base address needed for a Page Table entry */
 #define PD32_BASE_ADDR(x) (((uint_t)x) >> 12)
 #define PT32_BASE_ADDR(x) (((uint_t)x) >> 12)
@@ -124,6 +129,9 @@ the host state in the vmcs before entering the guest.
 #define PD32_4MB_PAGE_OFFSET(x) (((uint_t)x) & 0x003fffff)
 #define PAGE_SIZE_4MB (4096 * 1024)
 
+#define PDE64_2MB_BASE_ADDR(x) (((ullong_t)x) >> 21)
+#define PAGE_SIZE_2MB (2048 * 1024)
+
 /* The following should be phased out */
 #define PAGE_OFFSET(x)  ((((uint_t)x) & 0xfff))
 #define PAGE_ALIGNED_ADDR(x)   (((uint_t) (x)) >> 12)
@@ -265,6 +273,24 @@ typedef struct pde64 {
   uint_t no_execute      : 1;
 } pde64_t;
 
+typedef struct pde64_2MB {
+  uint_t present         : 1;
+  uint_t writable        : 1;
+  uint_t user_page       : 1;
+  uint_t write_through   : 1;
+  uint_t cache_disable   : 1;
+  uint_t accessed        : 1;
+  uint_t dirty           : 1;
+  uint_t large_page      : 1;
+  uint_t global_page     : 1;
+  uint_t vmm_info        : 3;
+  uint_t pat             : 1;
+  uint_t rsvd            : 8;
+  ullong_t page_base_addr : 31;
+  uint_t available       : 11;
+  uint_t no_execute      : 1;
+} pde64_2MB_t;
+
 typedef struct pte64 {
   uint_t present         : 1;
   uint_t writable        : 1;
@@ -319,6 +345,17 @@ struct guest_info;
 pde32_t * create_passthrough_pts_32(struct guest_info * guest_info);
 pml4e64_t * create_passthrough_pts_64(struct guest_info * info);
 
+// Rebuild the passthrough entries covering [guest_start, guest_end) after the memory map changed
+int v3_patch_passthrough_pts_32(struct guest_info * info, pde32_t * pde, addr_t guest_start, addr_t guest_end);
+int v3_patch_passthrough_pts_64(struct guest_info * info, pml4e64_t * pml, addr_t guest_start, addr_t guest_end);
+int v3_update_passthrough_pts(struct guest_info * info, addr_t guest_start, addr_t guest_end);
+int v3_rebuild_passthrough_pts(struct guest_info * info);
+
+// Make a page writable in the direct map after the dirty log recorded a write to it
+int v3_unprotect_passthrough_page(struct guest_info * info, addr_t guest_pa);
+// Make the direct map entries of a range read only, so the dirty log sees their next write
+int v3_protect_passthrough_pages(struct guest_info * info, addr_t guest_start, addr_t guest_end);
+
 
 
 
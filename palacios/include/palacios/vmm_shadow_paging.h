@@ -26,6 +26,111 @@
 #include <palacios/vmm_util.h>
 #include <palacios/vmm_paging.h>
 #include <palacios/vmm_hashtable.h>
+#include <palacios/vmm_list.h>
+
+
+// Number of guest address spaces we keep shadow page tables for
+#define SHADOW_CR3_CACHE_SIZE 16
+
+// Aligned group of shadow PTEs filled together on a page fault (1 disables prefetching)
+#define SHADOW_PTE_PREFETCH_WINDOW 8
+
+// Free shadow table pages each guest keeps around
+#define SHADOW_POOL_LOW_WATERMARK  16
+#define SHADOW_POOL_HIGH_WATERMARK 64
+
+// Page tables of retired shadow roots freed per VM exit
+#define SHADOW_RECLAIM_BATCH 4
+#define SHADOW_RECLAIM_ALL   ((uint_t)-1)
+
+
+/* Pages for shadow tables, so faults don't call into the host allocator
+ * The list links are stored in the free pages themselves
+ */
+struct shadow_page_pool {
+  // Free pages that are ready to use
+  struct list_head zeroed;
+  uint_t num_zeroed;
+
+  // Freed pages that still have to be cleared
+  struct list_head dirty;
+  uint_t num_dirty;
+
+  // Below low_watermark zeroed pages the pool is refilled up to high_watermark,
+  // free pages beyond high_watermark go back to the host
+  uint_t low_watermark;
+  uint_t high_watermark;
+};
+
+
+/* Reverse map entry for a shadow PTE that maps a guest page, 
+ * or for a 4MB shadow PDE that maps a whole large guest page
+ */
+struct shadow_pte_map {
+  pte32_t * shadow_pte;
+  struct shadow_table * table;
+  uint_t index;
+
+  struct guest_frame * frame;
+
+  struct list_head link;
+};
+
+
+/* A guest physical page referenced by the shadow page tables, 
+ * either as the source of shadow tables or as the target of shadow PTEs
+ * 4MB shadow mappings are tracked by a separate frame for the 4MB guest page (guest_pa | 0x2)
+ */
+struct guest_frame {
+  addr_t guest_pa;
+
+  // Shadow tables that are in sync with this page
+  // The page is write protected while this list is non-empty
+  struct list_head tables;
+  uint_t num_tables;
+
+  // Shadow PTEs mapping this page (struct shadow_pte_map)
+  struct list_head mappings;
+};
+
+
+/* A shadow page directory or page table */
+struct shadow_table {
+  addr_t page;               // host virtual address of the shadow table
+  int is_pd;
+
+  // Shadow PTs built for 4MB guest pages have no source page, 
+  // guest_pa is then the base of the large guest page
+  int has_source;
+  addr_t guest_pa;
+
+  // Set while the table is in sync with its source page
+  struct guest_frame * frame;
+  struct list_head frame_link;
+
+  // The source page was written after the table was built
+  int unsynced;
+  struct list_head unsync_link;
+
+  // The reverse map entry of each shadow PTE (or 4MB shadow PDE)
+  struct shadow_pte_map ** maps;
+
+  // Page tables are shared by every shadow PD whose guest PD points at the same guest PT,
+  // this counts the shadow PDEs referencing the table
+  uint_t num_parents;
+
+  // Retired page directories waiting to be freed
+  struct list_head reclaim_link;
+};
+
+
+/* A set of shadow page tables built for one guest CR3 */
+struct shadow_cr3_entry {
+  addr_t guest_cr3;          // guest physical address of the guest page directory
+  addr_t shadow_pd;          // host virtual address of the shadow page directory
+
+  struct list_head lru_link;
+};
 
 
 struct shadow_page_state {
@@ -42,12 +147,29 @@ struct shadow_page_state {
   v3_reg_t                shadow_cr3;
 
 
-  // Hash table that ties a CR3 value to a hash table pointer for the PT entries
+  // Hash table that ties a guest CR3 value to its shadow_cr3_entry
   struct hashtable *  cr3_cache;
-  // Hash table that contains a mapping of guest pte addresses to host pte addresses
-  struct hashtable *  cached_ptes;
-  addr_t cached_cr3;
+  // Most recently used first
+  struct list_head cr3_lru;
+  uint_t num_cached_cr3s;
+  struct shadow_cr3_entry * current_cr3;
+
+  // guest physical page address -> struct guest_frame
+  struct hashtable * guest_frames;
+  // shadow table host virtual address -> struct shadow_table
+  struct hashtable * shadow_tables;
+  // guest page table address (or 4MB page base | 1) -> shared shadow page table
+  struct hashtable * shared_pts;
+
+  // Tables whose source page has been written since they were synced
+  struct list_head unsynced_tables;
+
+  uint_t prefetch_window;
+
+  struct shadow_page_pool page_pool;
 
+  // Page directories of evicted CR3s, freed a few page tables at a time
+  struct list_head reclaim_list;
 };
 
 
@@ -56,7 +178,7 @@ struct guest_info;
 
 
 
-int v3_cache_page_tables32(struct guest_info * info, addr_t  pde);
+int v3_activate_shadow_pt32(struct guest_info * info, addr_t guest_pd);
 
 int v3_init_shadow_page_state(struct guest_info * info);
 
@@ -65,6 +187,21 @@ addr_t v3_create_new_shadow_pt32();
 int v3_handle_shadow_pagefault(struct guest_info * info, addr_t fault_addr, pf_error_t error_code);
 int v3_handle_shadow_invlpg(struct guest_info * info);
 
+// Zero freed pages and bring the pool back within its watermarks, called when the guest is idle
+void v3_refill_shadow_page_pool(struct guest_info * info);
+
+// Free up to max_pts page tables of retired shadow roots
+void v3_reclaim_shadow_tables(struct guest_info * info, uint_t max_pts);
+
+// Drop the shadow mappings of guest pages whose host backing has changed
+void v3_zap_shadow_mappings(struct guest_info * info, addr_t guest_start, addr_t guest_end);
+
+// Make the shadow mappings of guest pages read only, so the dirty log sees their next write
+void v3_write_protect_shadow_mappings(struct guest_info * info, addr_t guest_start, addr_t guest_end);
+
+// Drop all 4MB shadow mappings, called when the guest turns off CR4.PSE
+void v3_drop_large_shadow_pdes(struct guest_info * info);
+
 
 
 
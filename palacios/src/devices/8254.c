@@ -22,6 +22,7 @@
 #include <palacios/vmm_time.h>
 #include <palacios/vmm_util.h>
 #include <palacios/vmm_intr.h>
+#include <palacios/vmm_checkpoint.h>
 
 
 
@@ -606,12 +607,28 @@ static int pit_deinit(struct vm_device * dev) {
 }
 
 
+static int pit_save(struct vm_device * dev, struct v3_chkpt * chkpt) {
+  struct pit * state = (struct pit *)(dev->private_data);
+
+  return v3_chkpt_save(chkpt, state, sizeof(struct pit));
+}
+
+
+static int pit_restore(struct vm_device * dev, struct v3_chkpt * chkpt) {
+  struct pit * state = (struct pit *)(dev->private_data);
+
+  return v3_chkpt_load(chkpt, state, sizeof(struct pit));
+}
+
+
 static struct vm_device_ops dev_ops = {
   .init = pit_init,
   .deinit = pit_deinit,
   .reset = NULL,
   .start = NULL,
   .stop = NULL,
+  .save = pit_save,
+  .restore = pit_restore,
 
 };
 
@@ -22,6 +22,7 @@
 #include <palacios/vmm_intr.h>
 #include <palacios/vmm_types.h>
 #include <palacios/vmm.h>
+#include <palacios/vmm_checkpoint.h>
 
 #ifndef DEBUG_PIC
 #undef PrintDebug
@@ -682,12 +683,28 @@ static int pic_deinit(struct vm_device * dev) {
 
 
 
+static int pic_save(struct vm_device * dev, struct v3_chkpt * chkpt) {
+  struct pic_internal * state = (struct pic_internal *)(dev->private_data);
+
+  return v3_chkpt_save(chkpt, state, sizeof(struct pic_internal));
+}
+
+
+static int pic_restore(struct vm_device * dev, struct v3_chkpt * chkpt) {
+  struct pic_internal * state = (struct pic_internal *)(dev->private_data);
+
+  return v3_chkpt_load(chkpt, state, sizeof(struct pic_internal));
+}
+
+
 static struct vm_device_ops dev_ops = {
   .init = pic_init,
   .deinit = pic_deinit,
   .reset = NULL,
   .start = NULL,
   .stop = NULL,
+  .save = pic_save,
+  .restore = pic_restore,
 };
 
 
@@ -51,6 +51,7 @@ struct port_range {
   uint_t start;
   uint_t end;
   uint_t type;
+  uint_t single_hook;   // hooked as one range entry, otherwise port by port
   struct list_head range_link;
 };
 
@@ -218,25 +219,45 @@ static int generic_init_device(struct vm_device * dev) {
     struct port_range * tmp = NULL;
 
     list_for_each_entry(tmp, &(state->port_list), range_link) {
+      int (*read)(ushort_t, void *, uint_t, struct vm_device *) = NULL;
+      int (*write)(ushort_t, void *, uint_t, struct vm_device *) = NULL;
       uint_t i = 0;
       
-      PrintDebug("generic: hooking ports 0x%x to 0x%x as %x\n", 
+      PrintDebug("generic: hooking ports 0x%x to 0x%x as %s\n", 
 		 tmp->start, tmp->end, 
-		 (tmp->type == GENERIC_PRINT_AND_PASSTHROUGH) ? "print-and-passthrough" : "print-and-ignore");
+		 (tmp->type == GENERIC_PRINT_AND_PASSTHROUGH) ? "print-and-passthrough" : 
+		 (tmp->type == GENERIC_PASSTHROUGH) ? "passthrough" : "print-and-ignore");
+
+      if (tmp->type == GENERIC_PASSTHROUGH) {
+	if (v3_dev_passthrough_io_range(dev, tmp->start, tmp->end) == 0) {
+	  tmp->single_hook = 1;
+	} else {
+	  PrintDebug("generic: can't pass through ports 0x%x to 0x%x (already hooked?)\n", 
+		     tmp->start, tmp->end);
+	}
+	continue;
+      } else if (tmp->type == GENERIC_PRINT_AND_PASSTHROUGH) { 
+	read = &generic_read_port_passthrough;
+	write = &generic_write_port_passthrough;
+      } else if (tmp->type == GENERIC_PRINT_AND_IGNORE) { 
+	read = &generic_read_port_ignore;
+	write = &generic_write_port_ignore;
+      } else {
+	continue;
+      }
+
+      if (v3_dev_hook_io_range(dev, tmp->start, tmp->end, read, write) == 0) {
+	tmp->single_hook = 1;
+	continue;
+      }
+
+      // Some port in the range is already taken, so hook whatever is left one port at a time
+      tmp->single_hook = 0;
       
       for (i = tmp->start; i <= tmp->end; i++) { 
-	if (tmp->type == GENERIC_PRINT_AND_PASSTHROUGH) { 
-	  
-	  if (v3_dev_hook_io(dev, i, &generic_read_port_passthrough, &generic_write_port_passthrough)) { 
-	    PrintDebug("generic: can't hook port 0x%x (already hooked?)\n", i);
-	  }
-	  
-	} else if (tmp->type == GENERIC_PRINT_AND_IGNORE) { 
-	  
-	  if (v3_dev_hook_io(dev, i, &generic_read_port_ignore, &generic_write_port_ignore)) { 
-	    PrintDebug("generic: can't hook port 0x%x (already hooked?)\n", i);
-	  }
-	} 
+	if (v3_dev_hook_io(dev, i, read, write)) { 
+	  PrintDebug("generic: can't hook port 0x%x (already hooked?)\n", i);
+	}
       }
 
     }
@@ -357,10 +378,16 @@ static int generic_deinit_device(struct vm_device * dev) {
 
       PrintDebug("generic: unhooking ports 0x%x to 0x%x\n",
 		   cur->start, cur->end);
-		
-      for (i = cur->start; i <= cur->end; i++) {
-	if (v3_dev_unhook_io(dev, i)) {
-	  PrintDebug("generic: can't unhook port 0x%x (already unhooked?)\n", i);
+
+      if (cur->single_hook) {
+	if (v3_dev_unhook_io(dev, cur->start)) {
+	  PrintDebug("generic: can't unhook ports 0x%x to 0x%x\n", cur->start, cur->end);
+	}
+      } else {
+	for (i = cur->start; i <= cur->end; i++) {
+	  if (v3_dev_unhook_io(dev, i)) {
+	    PrintDebug("generic: can't unhook port 0x%x (already unhooked?)\n", i);
+	  }
 	}
       }
 
@@ -402,11 +429,13 @@ int v3_generic_add_port_range(struct vm_device * dev, uint_t start, uint_t end,
     range->start = start;
     range->end = end;
     range->type = type;
+    range->single_hook = 0;
     
       
-    PrintDebug("generic: Adding Port Range: 0x%x to 0x%x as %x\n", 
+    PrintDebug("generic: Adding Port Range: 0x%x to 0x%x as %s\n", 
 	       range->start, range->end, 
-	       (range->type == GENERIC_PRINT_AND_PASSTHROUGH) ? "print-and-passthrough" : "print-and-ignore");
+	       (range->type == GENERIC_PRINT_AND_PASSTHROUGH) ? "print-and-passthrough" : 
+	       (range->type == GENERIC_PASSTHROUGH) ? "passthrough" : "print-and-ignore");
     
     list_add(&(range->range_link), &(state->port_list));
     state->num_port_ranges++;
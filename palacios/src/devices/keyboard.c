@@ -20,6 +20,7 @@
 #include <devices/keyboard.h>
 #include <palacios/vmm.h>
 #include <palacios/vmm_types.h>
+#include <palacios/vmm_checkpoint.h>
 
 
 #ifndef DEBUG_KEYBOARD
@@ -1195,12 +1196,28 @@ static int keyboard_deinit_device(struct vm_device *dev)
 
 
 
+static int keyboard_save_device(struct vm_device * dev, struct v3_chkpt * chkpt) {
+  struct keyboard_internal * state = (struct keyboard_internal *)(dev->private_data);
+
+  return v3_chkpt_save(chkpt, state, sizeof(struct keyboard_internal));
+}
+
+
+static int keyboard_restore_device(struct vm_device * dev, struct v3_chkpt * chkpt) {
+  struct keyboard_internal * state = (struct keyboard_internal *)(dev->private_data);
+
+  return v3_chkpt_load(chkpt, state, sizeof(struct keyboard_internal));
+}
+
+
 static struct vm_device_ops dev_ops = { 
   .init = keyboard_init_device, 
   .deinit = keyboard_deinit_device,
   .reset = keyboard_reset_device,
   .start = keyboard_start_device,
   .stop = keyboard_stop_device,
+  .save = keyboard_save_device,
+  .restore = keyboard_restore_device,
 };
 
 
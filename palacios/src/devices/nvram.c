@@ -21,6 +21,7 @@
 #include <devices/nvram.h>
 #include <palacios/vmm.h>
 #include <palacios/vmm_types.h>
+#include <palacios/vmm_checkpoint.h>
 
 
 #ifndef DEBUG_NVRAM
@@ -626,12 +627,28 @@ static int nvram_deinit_device(struct vm_device * dev) {
 
 
 
+static int nvram_save_device(struct vm_device * dev, struct v3_chkpt * chkpt) {
+  struct nvram_internal * state = (struct nvram_internal *)(dev->private_data);
+
+  return v3_chkpt_save(chkpt, state, sizeof(struct nvram_internal));
+}
+
+
+static int nvram_restore_device(struct vm_device * dev, struct v3_chkpt * chkpt) {
+  struct nvram_internal * state = (struct nvram_internal *)(dev->private_data);
+
+  return v3_chkpt_load(chkpt, state, sizeof(struct nvram_internal));
+}
+
+
 static struct vm_device_ops dev_ops = { 
   .init = nvram_init_device, 
   .deinit = nvram_deinit_device,
   .reset = nvram_reset_device,
   .start = nvram_start_device,
   .stop = nvram_stop_device,
+  .save = nvram_save_device,
+  .restore = nvram_restore_device,
 };
 
 
@@ -40,6 +40,7 @@
 #include <palacios/vmm.h>
 #include <devices/cdrom.h>
 #include <devices/ide.h>
+#include <palacios/vmm_checkpoint.h>
 
 
 #ifndef TRACE_RAMDISK
@@ -675,6 +676,74 @@ static int read_data_port(ushort_t port, void * dst, uint_t length, struct vm_de
 
 
 
+/* REP INSW/INSD from the data port
+ * We split the transfer so that no single read_data_port() call crosses a
+ * buffer reload or DRQ boundary, which keeps the state machine identical
+ * to doing it one element at a time
+ */
+static int read_data_port_str(ushort_t port, void * dst, uint_t length, uint_t count, struct vm_device * dev) {
+  struct ramdisk_t * ramdisk  = (struct ramdisk_t *)(dev->private_data);
+  struct channel_t * channel = NULL;
+  struct drive_t * drive = NULL;
+  struct controller_t * controller = NULL;
+  uchar_t * buf = (uchar_t *)dst;
+  uint_t bytes = length * count;
+
+  if (is_primary_port(ramdisk, port)) {
+    channel = &(ramdisk->channels[0]);
+  } else if (is_secondary_port(ramdisk, port)) {
+    channel = &(ramdisk->channels[1]);
+  } else {
+    PrintError("Invalid Port: %d\n", port);
+    return -1;
+  }
+  
+  drive = get_selected_drive(channel);
+  controller = &(drive->controller);
+
+  while (bytes > 0) {
+    uint_t avail = length;
+    uint_t chunk = 0;
+
+    switch (controller->current_command) {
+    case 0xec:    // IDENTIFY DEVICE
+    case 0xa1:
+      if (controller->buffer_index < 512) {
+	avail = 512 - controller->buffer_index;
+      }
+      break;
+    case 0xa0: 
+      {
+	uint_t index = (controller->buffer_index >= 2048) ? 0 : controller->buffer_index;
+	uint_t drq_left = (unsigned)drive->atapi.drq_bytes - controller->drq_index;
+
+	avail = (2048 - index < drq_left) ? (2048 - index) : drq_left;
+	break;
+      }
+    default:
+      break;
+    }
+
+    chunk = (avail < bytes) ? avail : bytes;
+    chunk -= chunk % length;
+
+    if (chunk == 0) {
+      chunk = length;
+    }
+
+    if (read_data_port(port, buf, chunk, dev) != (int)chunk) {
+      return -1;
+    }
+
+    buf += chunk;
+    bytes -= chunk;
+  }
+
+  return count;
+}
+
+
+
 
 static int write_data_port(ushort_t port, void * src, uint_t length, struct vm_device * dev) {
   struct ramdisk_t * ramdisk  = (struct ramdisk_t *)(dev->private_data);
@@ -2327,6 +2396,8 @@ static int ramdisk_init_device(struct vm_device *dev) {
 
   v3_dev_hook_io(dev, PRI_DATA_PORT, 
 		 &read_data_port, &write_data_port);
+  v3_dev_hook_io_str(dev, PRI_DATA_PORT, 
+		     &read_data_port_str, NULL);
   v3_dev_hook_io(dev, PRI_FEATURES_PORT, 
 		 &read_general_port, &write_general_port);
   v3_dev_hook_io(dev, PRI_SECT_CNT_PORT, 
@@ -2348,6 +2419,8 @@ static int ramdisk_init_device(struct vm_device *dev) {
 
   v3_dev_hook_io(dev, SEC_DATA_PORT, 
 		 &read_data_port, &write_data_port);
+  v3_dev_hook_io_str(dev, SEC_DATA_PORT, 
+		     &read_data_port_str, NULL);
   v3_dev_hook_io(dev, SEC_FEATURES_PORT, 
 		 &read_general_port, &write_general_port);
   v3_dev_hook_io(dev, SEC_SECT_CNT_PORT, 
@@ -2384,12 +2457,82 @@ static int ramdisk_deinit_device(struct vm_device *dev) {
   return 0;
 }
 
+/* The drive geometry, identity and CD-ROM backend come from the configuration,
+ * so only the controller and command state of each drive goes into a checkpoint
+ */
+static int ramdisk_save_device(struct vm_device * dev, struct v3_chkpt * chkpt) {
+  struct ramdisk_t * ramdisk = (struct ramdisk_t *)(dev->private_data);
+  uint_t channel_no = 0;
+  uint_t drive_no = 0;
+
+  for (channel_no = 0; channel_no < MAX_ATA_CHANNEL; channel_no++) {
+    struct channel_t * channel = &(ramdisk->channels[channel_no]);
+
+    if (V3_CHKPT_SAVE(chkpt, channel->drive_select) == -1) {
+      return -1;
+    }
+
+    for (drive_no = 0; drive_no < 2; drive_no++) {
+      struct drive_t * drive = &(channel->drives[drive_no]);
+
+      if ((V3_CHKPT_SAVE(chkpt, drive->controller) == -1) ||
+	  (V3_CHKPT_SAVE(chkpt, drive->sense) == -1) ||
+	  (V3_CHKPT_SAVE(chkpt, drive->atapi) == -1) ||
+	  (V3_CHKPT_SAVE(chkpt, drive->cdrom.ready) == -1) ||
+	  (V3_CHKPT_SAVE(chkpt, drive->cdrom.locked) == -1) ||
+	  (V3_CHKPT_SAVE(chkpt, drive->cdrom.capacity) == -1) ||
+	  (V3_CHKPT_SAVE(chkpt, drive->cdrom.next_lba) == -1) ||
+	  (V3_CHKPT_SAVE(chkpt, drive->cdrom.remaining_blocks) == -1) ||
+	  (V3_CHKPT_SAVE(chkpt, drive->cdrom.current) == -1)) {
+	return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+static int ramdisk_restore_device(struct vm_device * dev, struct v3_chkpt * chkpt) {
+  struct ramdisk_t * ramdisk = (struct ramdisk_t *)(dev->private_data);
+  uint_t channel_no = 0;
+  uint_t drive_no = 0;
+
+  for (channel_no = 0; channel_no < MAX_ATA_CHANNEL; channel_no++) {
+    struct channel_t * channel = &(ramdisk->channels[channel_no]);
+
+    if (V3_CHKPT_LOAD(chkpt, channel->drive_select) == -1) {
+      return -1;
+    }
+
+    for (drive_no = 0; drive_no < 2; drive_no++) {
+      struct drive_t * drive = &(channel->drives[drive_no]);
+
+      if ((V3_CHKPT_LOAD(chkpt, drive->controller) == -1) ||
+	  (V3_CHKPT_LOAD(chkpt, drive->sense) == -1) ||
+	  (V3_CHKPT_LOAD(chkpt, drive->atapi) == -1) ||
+	  (V3_CHKPT_LOAD(chkpt, drive->cdrom.ready) == -1) ||
+	  (V3_CHKPT_LOAD(chkpt, drive->cdrom.locked) == -1) ||
+	  (V3_CHKPT_LOAD(chkpt, drive->cdrom.capacity) == -1) ||
+	  (V3_CHKPT_LOAD(chkpt, drive->cdrom.next_lba) == -1) ||
+	  (V3_CHKPT_LOAD(chkpt, drive->cdrom.remaining_blocks) == -1) ||
+	  (V3_CHKPT_LOAD(chkpt, drive->cdrom.current) == -1)) {
+	return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
 static struct vm_device_ops dev_ops = {
   .init = ramdisk_init_device,
   .deinit = ramdisk_deinit_device,
   .reset = NULL,
   .start = NULL,
   .stop = NULL,
+  .save = ramdisk_save_device,
+  .restore = ramdisk_restore_device,
 };
 
 
@@ -19,6 +19,7 @@
 
 #include <devices/serial.h>
 #include <palacios/vmm.h>
+#include <palacios/vmm_checkpoint.h>
 
 
 #define COM1_DATA_PORT           0x3f8
@@ -583,12 +584,28 @@ static int serial_deinit(struct vm_device * dev) {
 
 
 
+static int serial_save(struct vm_device * dev, struct v3_chkpt * chkpt) {
+  struct serial_state * state = (struct serial_state *)(dev->private_data);
+
+  return v3_chkpt_save(chkpt, state, sizeof(struct serial_state));
+}
+
+
+static int serial_restore(struct vm_device * dev, struct v3_chkpt * chkpt) {
+  struct serial_state * state = (struct serial_state *)(dev->private_data);
+
+  return v3_chkpt_load(chkpt, state, sizeof(struct serial_state));
+}
+
+
 static struct vm_device_ops dev_ops = {
   .init = serial_init,
   .deinit = serial_deinit,
   .reset = NULL,
   .start = NULL,
   .stop = NULL,
+  .save = serial_save,
+  .restore = serial_restore,
 };
 
 
@@ -43,6 +43,64 @@ extern void v3_clgi();
 extern int v3_svm_launch(vmcb_t * vmcb, struct v3_gprs * vm_regs);
 
 
+static uchar_t asid_bitmap[SVM_MAX_ASIDS / 8];
+static uint_t num_asids = 0;
+static int flush_by_asid = 0;
+
+
+static void init_asids() {
+  addr_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+  v3_cpuid(CPUID_SVM_REV_AND_FEATURE_IDS, &eax, &ebx, &ecx, &edx);
+
+  num_asids = (ebx < SVM_MAX_ASIDS) ? ebx : SVM_MAX_ASIDS;
+  flush_by_asid = ((edx & CPUID_SVM_REV_AND_FEATURE_IDS_edx_flushbyasid) != 0);
+
+  memset(asid_bitmap, 0, sizeof(asid_bitmap));
+
+  // The host runs with ASID 0
+  asid_bitmap[0] |= 0x1;
+
+  PrintDebug("SVM: %d ASIDs available (FlushByASID=%d)\n", num_asids, flush_by_asid);
+}
+
+
+/* Guests are never torn down, so ASIDs are never reclaimed */
+int v3_svm_alloc_asid() {
+  uint_t i = 0;
+
+  for (i = 1; i < num_asids; i++) {
+    if ((asid_bitmap[i / 8] & (1 << (i % 8))) == 0) {
+      asid_bitmap[i / 8] |= (1 << (i % 8));
+      return i;
+    }
+  }
+
+  PrintError("Out of ASIDs\n");
+  return -1;
+}
+
+
+
+/* The flush is carried out on the next VMRUN */
+void v3_flush_guest_tlb(struct guest_info * info) {
+  vmcb_ctrl_t * ctrl_area = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
+
+  ctrl_area->TLB_CONTROL = (flush_by_asid) ? SVM_TLB_FLUSH_GUEST : SVM_TLB_FLUSH_ALL;
+}
+
+
+void v3_flush_guest_tlb_page(struct guest_info * info, addr_t va) {
+  vmcb_ctrl_t * ctrl_area = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
+
+  // INVLPGA: rAX = virtual address, ECX = ASID
+  __asm__ __volatile__ ("invlpga" 
+			: 
+			: "a" (va), "c" (ctrl_area->guest_ASID)
+			);
+}
+
+
 
 
 static vmcb_t * Allocate_VMCB() {
@@ -108,7 +166,10 @@ static void Init_VMCB_BIOS(vmcb_t * vmcb, struct guest_info *vm_info) {
 
   ctrl_area->instrs.HLT = 1;
   // guest_state->cr0 = 0x00000001;    // PE 
-  ctrl_area->guest_ASID = 1;
+
+  // The previous owner of the ASID may have left entries behind
+  ctrl_area->guest_ASID = vm_info->asid;
+  v3_flush_guest_tlb(vm_info);
 
   
   /*
@@ -176,31 +237,10 @@ static void Init_VMCB_BIOS(vmcb_t * vmcb, struct guest_info *vm_info) {
   guest_state->dr6 = 0x00000000ffff0ff0LL;
   guest_state->dr7 = 0x0000000000000400LL;
 
-  if (vm_info->io_map.num_ports > 0) {
-    struct vmm_io_hook * iter;
-    addr_t io_port_bitmap;
-    
-    io_port_bitmap = (addr_t)V3_VAddr(V3_AllocPages(3));
-    memset((uchar_t*)io_port_bitmap, 0, PAGE_SIZE * 3);
-    
-    ctrl_area->IOPM_BASE_PA = (addr_t)V3_PAddr((void *)io_port_bitmap);
-
-    //PrintDebug("Setting up IO Map at 0x%x\n", io_port_bitmap);
-
-    FOREACH_IO_HOOK(vm_info->io_map, iter) {
-      ushort_t port = iter->port;
-      uchar_t * bitmap = (uchar_t *)io_port_bitmap;
-
-      bitmap += (port / 8);
-      //      PrintDebug("Setting Bit for port 0x%x\n", port);
-      *bitmap |= 1 << (port % 8);
-    }
-
-
-    //PrintDebugMemDump((uchar_t*)io_port_bitmap, PAGE_SIZE *2);
-
-    ctrl_area->instrs.IOIO_PROT = 1;
-  }
+  // The IO map keeps the bitmap up to date as ports are hooked and unhooked
+  // Guest setup fails without it, so port accesses are always checked
+  ctrl_area->IOPM_BASE_PA = (addr_t)V3_PAddr((void *)(vm_info->io_map.io_bitmap));
+  ctrl_area->instrs.IOIO_PROT = 1;
 
 
 
@@ -234,33 +274,28 @@ static void Init_VMCB_BIOS(vmcb_t * vmcb, struct guest_info *vm_info) {
     ctrl_area->cr_reads.cr3 = 1;
     ctrl_area->cr_writes.cr3 = 1;
 
+    // 4MB shadow and passthrough PDEs depend on CR4.PSE
+    ctrl_area->cr_writes.cr4 = 1;
+
 
     ctrl_area->instrs.INVLPG = 1;
     ctrl_area->instrs.INVLPGA = 1;
 
     ctrl_area->exceptions.pf = 1;
 
-    /* JRL: This is a performance killer, and a simplistic solution */
-    /* We need to fix this */
-    ctrl_area->TLB_CONTROL = 1;
-    
-
 
     guest_state->g_pat = 0x7040600070406ULL;
 
     guest_state->cr0 |= 0x80000000;
 
   } else if (vm_info->shdw_pg_mode == NESTED_PAGING) {
-    // Flush the TLB on entries/exits
-    ctrl_area->TLB_CONTROL = 1;
-
     // Enable Nested Paging
     ctrl_area->NP_ENABLE = 1;
 
     PrintDebug("NP_Enable at 0x%p\n", (void *)&(ctrl_area->NP_ENABLE));
 
     // Set the Nested Page Table pointer
-    vm_info->direct_map_pt = ((addr_t)create_passthrough_pts_32(vm_info) & ~0xfff);
+    vm_info->direct_map_pt = (addr_t)V3_PAddr(create_passthrough_pts_32(vm_info));
     ctrl_area->N_CR3 = vm_info->direct_map_pt;
 
     //   ctrl_area->N_CR3 = Get_CR3();
@@ -270,12 +305,21 @@ static void Init_VMCB_BIOS(vmcb_t * vmcb, struct guest_info *vm_info) {
   }
 
 
-
+  // Turn on intercepts for any exit handlers registered during configuration
+  v3_svm_enable_exit_intercepts(vm_info);
 }
 
 
 static int init_svm_guest(struct guest_info *info) {
- 
+  int asid = v3_svm_alloc_asid();
+
+  if (asid == -1) {
+    PrintError("Could not allocate an ASID for the guest\n");
+    return -1;
+  }
+
+  info->asid = asid;
+
   PrintDebug("Allocating VMCB\n");
   info->vmm_data = (void*)Allocate_VMCB();
 
@@ -324,6 +368,8 @@ static int start_svm_guest(struct guest_info *info) {
 
   while (1) {
     ullong_t tmp_tsc;
+    ullong_t handled_tsc;
+    uint_t exit_code = 0;
     uint_t vm_cr_low = 0, vm_cr_high = 0;
 
 
@@ -342,6 +388,9 @@ static int start_svm_guest(struct guest_info *info) {
     v3_svm_launch((vmcb_t*)V3_PAddr(info->vmm_data), &(info->vm_regs));
     rdtscll(tmp_tsc);
 
+    // Any requested flush has been done now
+    guest_ctrl->TLB_CONTROL = SVM_TLB_FLUSH_NOTHING;
+
     v3_set_msr(0xc0000101, vm_cr_high, vm_cr_low);
     //PrintDebug("SVM Returned\n");
 
@@ -363,7 +412,8 @@ static int start_svm_guest(struct guest_info *info) {
 
     //PrintDebug("SVM Exit number %d\n", num_exits);
 
-
+    // Latch the exit code for the exit statistics before the handler runs
+    exit_code = guest_ctrl->exit_code;
      
     if (v3_handle_svm_exit(info) != 0) {
 
@@ -377,7 +427,7 @@ static int start_svm_guest(struct guest_info *info) {
       PrintDebug("RIP: %p\n", (void *)(addr_t)(guest_state->rip));
 
 
-      linear_addr = get_addr_linear(info, guest_state->rip, &(info->segments.cs));
+      linear_addr = get_addr_linear(info, guest_state->rip, &(v3_get_segments(info)->cs));
 
 
       PrintDebug("RIP Linear: %p\n", (void *)linear_addr);
@@ -397,6 +447,22 @@ static int start_svm_guest(struct guest_info *info) {
       PrintDebug("Instr (15 bytes) at %p:\n", (void *)host_addr);
       PrintTraceMemDump((uchar_t *)host_addr, 15);
 
+      v3_print_exit_stats(info);
+      v3_print_dedup_stats(info);
+
+      break;
+    }
+
+    rdtscll(handled_tsc);
+
+    v3_record_exit(info, exit_code, 
+		   tmp_tsc - info->time_state.cached_host_tsc, 
+		   handled_tsc - tmp_tsc);
+
+    if (v3_migration_step(info) == 1) {
+      // The guest carries on at the receiver
+      info->run_state = VM_STOPPED;
+      v3_print_migration_stats(info);
       break;
     }
   }
@@ -549,6 +615,8 @@ void v3_init_SVM(struct v3_ctrl_ops * vmm_ops) {
 
 
 
+  init_asids();
+
   // Setup the SVM specific vmm operations
   vmm_ops->init_guest = &init_svm_guest;
   vmm_ops->start_guest = &start_svm_guest;
@@ -56,6 +56,15 @@ int v3_handle_svm_halt(struct guest_info * info)
     
     PrintDebug("GeekOS Yield\n");
     
+    // Nothing else to do, so catch up on memory housekeeping
+    v3_reclaim_shadow_tables(info, SHADOW_RECLAIM_ALL);
+    v3_refill_shadow_page_pool(info);
+
+    if (v3_dedup_scan(info, DEDUP_SCAN_BATCH) == -1) {
+      PrintError("Page merging failed\n");
+      return -1;
+    }
+
     rdtscll(yield_start);
     V3_Yield();
     rdtscll(yield_stop);
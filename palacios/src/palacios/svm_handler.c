@@ -33,364 +33,489 @@
 
 
 
-static const uchar_t * vmexit_code_to_str(uint_t exit_code);
-
-
-int v3_handle_svm_exit(struct guest_info * info) {
-  vmcb_ctrl_t * guest_ctrl = 0;
-  vmcb_saved_state_t * guest_state = 0;
-  ulong_t exit_code = 0;
-  
-  guest_ctrl = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
-  guest_state = GET_VMCB_SAVE_STATE_AREA((vmcb_t*)(info->vmm_data));
-  
-
-  // Update the high level state 
-  info->rip = guest_state->rip;
-  info->vm_regs.rsp = guest_state->rsp;
-  info->vm_regs.rax = guest_state->rax;
+void v3_load_guest_state(struct guest_info * info, uint_t group) {
+  vmcb_ctrl_t * guest_ctrl = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
+  vmcb_saved_state_t * guest_state = GET_VMCB_SAVE_STATE_AREA((vmcb_t*)(info->vmm_data));
+
+  switch (group) {
+  case V3_STATE_CTRL_REGS:
+    info->ctrl_regs.cr0 = guest_state->cr0;
+    info->ctrl_regs.cr2 = guest_state->cr2;
+    info->ctrl_regs.cr3 = guest_state->cr3;
+    info->ctrl_regs.cr4 = guest_state->cr4;
+    info->ctrl_regs.cr8 = guest_ctrl->guest_ctrl.V_TPR;
+    info->ctrl_regs.rflags = guest_state->rflags;
+    info->ctrl_regs.efer = guest_state->efer;
+    break;
+  case V3_STATE_DBG_REGS:
+    info->dbg_regs.dr6 = guest_state->dr6;
+    info->dbg_regs.dr7 = guest_state->dr7;
+    break;
+  case V3_STATE_SEGMENTS:
+    get_vmcb_segments((vmcb_t*)(info->vmm_data), &(info->segments));
+    break;
+  default:
+    PrintError("Invalid guest state group (%d)\n", group);
+    return;
+  }
 
-  info->cpl = guest_state->cpl;
+  info->state_valid |= group;
+}
 
 
-  info->ctrl_regs.cr0 = guest_state->cr0;
-  info->ctrl_regs.cr2 = guest_state->cr2;
-  info->ctrl_regs.cr3 = guest_state->cr3;
-  info->ctrl_regs.cr4 = guest_state->cr4;
-  info->dbg_regs.dr6 = guest_state->dr6;
-  info->dbg_regs.dr7 = guest_state->dr7;
-  info->ctrl_regs.cr8 = guest_ctrl->guest_ctrl.V_TPR;
-  info->ctrl_regs.rflags = guest_state->rflags;
-  info->ctrl_regs.efer = guest_state->efer;
+void v3_flush_guest_state(struct guest_info * info) {
+  vmcb_ctrl_t * guest_ctrl = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
+  vmcb_saved_state_t * guest_state = GET_VMCB_SAVE_STATE_AREA((vmcb_t*)(info->vmm_data));
 
-  get_vmcb_segments((vmcb_t*)(info->vmm_data), &(info->segments));
-  info->cpu_mode = v3_get_cpu_mode(info);
-  info->mem_mode = v3_get_mem_mode(info);
+  if (info->state_dirty & V3_STATE_CTRL_REGS) {
+    guest_state->cr0 = info->ctrl_regs.cr0;
+    guest_state->cr2 = info->ctrl_regs.cr2;
+    guest_state->cr3 = info->ctrl_regs.cr3;
+    guest_state->cr4 = info->ctrl_regs.cr4;
+    guest_ctrl->guest_ctrl.V_TPR = info->ctrl_regs.cr8 & 0xff;
+    guest_state->rflags = info->ctrl_regs.rflags;
+    guest_state->efer = info->ctrl_regs.efer;
+  }
 
+  if (info->state_dirty & V3_STATE_DBG_REGS) {
+    guest_state->dr6 = info->dbg_regs.dr6;
+    guest_state->dr7 = info->dbg_regs.dr7;
+  }
 
-  exit_code = guest_ctrl->exit_code;
- 
+  if (info->state_dirty & V3_STATE_SEGMENTS) {
+    set_vmcb_segments((vmcb_t*)(info->vmm_data), &(info->segments));
+  }
 
-  // Disable printing io exits due to bochs debug messages
-  //if (!((exit_code == VMEXIT_IOIO) && ((ushort_t)(guest_ctrl->exit_info1 >> 16) == 0x402))) {
+  info->state_dirty = 0;
+  info->state_valid = 0;
+}
 
 
-  //  PrintDebug("SVM Returned: Exit Code: 0x%x \t\t(tsc=%ul)\n",exit_code, (uint_t)info->time_state.guest_tsc); 
-  
-  if ((0) && (exit_code < 0x4f)) {
-    uchar_t instr[32];
-    int ret;
-    // Dump out the instr stream
 
-    //PrintDebug("RIP: %x\n", guest_state->rip);
-    PrintDebug("RIP Linear: %p\n", (void *)get_addr_linear(info, info->rip, &(info->segments.cs)));
+/* Default exit handlers */
 
-    // OK, now we will read the instruction
-    // The only difference between PROTECTED and PROTECTED_PG is whether we read
-    // from guest_pa or guest_va
-    if (info->mem_mode == PHYSICAL_MEM) { 
-      // The real rip address is actually a combination of the rip + CS base 
-      ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 32, instr);
-    } else { 
-      ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 32, instr);
-    }
+static int handle_ioio_exit(struct guest_info * info, void * priv_data) {
+  vmcb_ctrl_t * guest_ctrl = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
+  struct svm_io_info * io_info = (struct svm_io_info *)&(guest_ctrl->exit_info1);
     
-    if (ret != 32) {
-      // I think we should inject a GPF into the guest
-      PrintDebug("Could not read instruction (ret=%d)\n", ret);
+  if (io_info->type == 0) {
+    if (io_info->str) {
+      return v3_handle_svm_io_outs(info);
     } else {
-
-      PrintDebug("Instr Stream:\n");
-      PrintTraceMemDump(instr, 32);
+      return v3_handle_svm_io_out(info);
     }
-  }
-
-
-    //  }
-  // PrintDebugVMCB((vmcb_t*)(info->vmm_data));
-
-
-  // PrintDebug("SVM Returned:(VMCB=%x)\n", info->vmm_data); 
-  //PrintDebug("RIP: %x\n", guest_state->rip);
-
-  
-  //PrintDebug("SVM Returned: Exit Code: %x\n",exit_code); 
-
-  switch (exit_code) {
-
-  case VMEXIT_IOIO: {
-    struct svm_io_info * io_info = (struct svm_io_info *)&(guest_ctrl->exit_info1);
-    
-    if (io_info->type == 0) {
-      if (io_info->str) {
-	if (v3_handle_svm_io_outs(info) == -1 ) {
-	  return -1;
-	}
-      } else {
-	if (v3_handle_svm_io_out(info) == -1) {
-	  return -1;
-	}
-      }
+  } else {
+    if (io_info->str) {
+      return v3_handle_svm_io_ins(info);
     } else {
-      if (io_info->str) {
-	if (v3_handle_svm_io_ins(info) == -1) {
-	  return -1;
-	}
-      } else {
-	if (v3_handle_svm_io_in(info) == -1) {
-	  return -1;
-	}
-      }
+      return v3_handle_svm_io_in(info);
     }
   }
-    break;
+}
 
 
-  case  VMEXIT_CR0_WRITE: {
+static int handle_cr0_write_exit(struct guest_info * info, void * priv_data) {
 #ifdef DEBUG_CTRL_REGS
-    PrintDebug("CR0 Write\n");
+  PrintDebug("CR0 Write\n");
 #endif
-    if (v3_handle_cr0_write(info) == -1) {
-      return -1;
-    }
-  } 
-    break;
+  return v3_handle_cr0_write(info);
+}
 
-  case VMEXIT_CR0_READ: {
+static int handle_cr0_read_exit(struct guest_info * info, void * priv_data) {
 #ifdef DEBUG_CTRL_REGS
-    PrintDebug("CR0 Read\n");
+  PrintDebug("CR0 Read\n");
 #endif
-    if (v3_handle_cr0_read(info) == -1) {
-      return -1;
-    }
-  } 
-    break;
+  return v3_handle_cr0_read(info);
+}
 
-  case VMEXIT_CR3_WRITE: {
+static int handle_cr3_write_exit(struct guest_info * info, void * priv_data) {
 #ifdef DEBUG_CTRL_REGS
-    PrintDebug("CR3 Write\n");
+  PrintDebug("CR3 Write\n");
 #endif
-    if (v3_handle_cr3_write(info) == -1) {
-      return -1;
-    }    
-  } 
-    break;
+  return v3_handle_cr3_write(info);
+}
 
-  case  VMEXIT_CR3_READ: {
+static int handle_cr3_read_exit(struct guest_info * info, void * priv_data) {
 #ifdef DEBUG_CTRL_REGS
-    PrintDebug("CR3 Read\n");
+  PrintDebug("CR3 Read\n");
 #endif
-    if (v3_handle_cr3_read(info) == -1) {
-      return -1;
-    }
-  }
-    break;
+  return v3_handle_cr3_read(info);
+}
+
+static int handle_cr4_write_exit(struct guest_info * info, void * priv_data) {
+#ifdef DEBUG_CTRL_REGS
+  PrintDebug("CR4 Write\n");
+#endif
+  return v3_handle_cr4_write(info);
+}
+
+
+static int handle_pf_exit(struct guest_info * info, void * priv_data) {
+  vmcb_ctrl_t * guest_ctrl = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
+  addr_t fault_addr = guest_ctrl->exit_info2;
+  pf_error_t * error_code = (pf_error_t *)&(guest_ctrl->exit_info1);
 
-  case VMEXIT_EXCP14: {
-    addr_t fault_addr = guest_ctrl->exit_info2;
-    pf_error_t * error_code = (pf_error_t *)&(guest_ctrl->exit_info1);
 #ifdef DEBUG_SHADOW_PAGING
-    PrintDebug("PageFault at %p (error=%d)\n", 
-	       (void *)fault_addr, *(uint_t *)error_code);
+  PrintDebug("PageFault at %p (error=%d)\n", 
+	     (void *)fault_addr, *(uint_t *)error_code);
 #endif
-    if (info->shdw_pg_mode == SHADOW_PAGING) {
-      if (v3_handle_shadow_pagefault(info, fault_addr, *error_code) == -1) {
-	return -1;
-      }
-    } else {
-      PrintError("Page fault in un implemented paging mode\n");
-      return -1;
-    }
-  } 
-    break;
 
-  case VMEXIT_NPF: {
-    PrintError("Currently unhandled Nested Page Fault\n");
+  if (info->shdw_pg_mode != SHADOW_PAGING) {
+    PrintError("Page fault in un implemented paging mode\n");
     return -1;
-    
-  } 
+  }
+
+  return v3_handle_shadow_pagefault(info, fault_addr, *error_code);
+}
+
+
+static int handle_npf_exit(struct guest_info * info, void * priv_data) {
+  vmcb_ctrl_t * guest_ctrl = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
+  addr_t fault_gpa = guest_ctrl->exit_info2;
+
+  switch (get_shadow_addr_type(info, fault_gpa)) {
+  case HOST_REGION_UNALLOCATED:
+    // A write to guest memory that is still backed by the zero page
+    return alloc_demand_mem(info, fault_gpa);
+  case HOST_REGION_PHYSICAL_MEMORY:
+    // A write to a page that is write protected for the dirty log
+    return v3_handle_dirty_log_fault(info, fault_gpa);
+  default:
     break;
+  }
+
+  PrintError("Currently unhandled Nested Page Fault\n");
+  return -1;
+}
+
 
-  case VMEXIT_INVLPG: {
-    if (info->shdw_pg_mode == SHADOW_PAGING) {
+static int handle_invlpg_exit(struct guest_info * info, void * priv_data) {
+  if (info->shdw_pg_mode == SHADOW_PAGING) {
 #ifdef DEBUG_SHADOW_PAGING
-      PrintDebug("Invlpg\n");
+    PrintDebug("Invlpg\n");
 #endif
-      if (v3_handle_shadow_invlpg(info) == -1) {
-	return -1;
-      }
-    }
+    return v3_handle_shadow_invlpg(info);
+  }
    
-    /*
-      (exit_code == VMEXIT_INVLPGA)   || 
-    */
-    
-  } 
-    break;
+  /*
+    (exit_code == VMEXIT_INVLPGA)   || 
+  */
+  return 0;
+}
 
-  case VMEXIT_INTR: { 
-    
-    // handled by interrupt dispatch earlier
 
-  } 
-    break;
-    
-  case VMEXIT_SMI: {
-    
-    //   handle_svm_smi(info); // ignored for now
+// INTR: handled by interrupt dispatch earlier
+// SMI: ignored for now
+static int handle_nop_exit(struct guest_info * info, void * priv_data) {
+  return 0;
+}
 
-  } 
-    break;
 
-  case VMEXIT_HLT: {
+static int handle_hlt_exit(struct guest_info * info, void * priv_data) {
 #ifdef DEBUG_HALT
-    PrintDebug("Guest halted\n");
+  PrintDebug("Guest halted\n");
 #endif
-    if (v3_handle_svm_halt(info) == -1) {
-      return -1;
-    }
-  } 
-    break;
+  return v3_handle_svm_halt(info);
+}
 
-  case VMEXIT_PAUSE: {
-    //PrintDebug("Guest paused\n");
-    if (v3_handle_svm_pause(info) == -1) { 
-      return -1;
-    }
-  } 
-    break;
 
-  case VMEXIT_EXCP1: 
-    {
-#ifdef DEBUG_EMULATOR
-      PrintDebug("DEBUG EXCEPTION\n");
-#endif
-      if (info->run_state == VM_EMULATING) {
-	if (v3_emulation_exit_handler(info) == -1) {
-	  return -1;
-	}
-      } else {
-	PrintError("VMMCALL with not emulator...\n");
-	return -1;
-      }
-      break;
-    } 
+static int handle_pause_exit(struct guest_info * info, void * priv_data) {
+  //PrintDebug("Guest paused\n");
+  return v3_handle_svm_pause(info);
+}
 
 
-  case VMEXIT_VMMCALL: 
-    {
+// Both the debug exception and VMMCALL are used to return from the emulator
+static int handle_emulator_exit(struct guest_info * info, void * priv_data) {
 #ifdef DEBUG_EMULATOR
-      PrintDebug("VMMCALL\n");
+  PrintDebug("Emulator exit (DEBUG EXCEPTION/VMMCALL)\n");
 #endif
-      if (info->run_state == VM_EMULATING) {
-	if (v3_emulation_exit_handler(info) == -1) {
-	  return -1;
-	}
-      } else {
-	/*
-	ulong_t tsc_spread = 0;
-	ullong_t exit_tsc = 0;
-
-	ulong_t rax = (ulong_t)info->vm_regs.rbx;
-	ulong_t rdx = (ulong_t)info->vm_regs.rcx;
 
-	*(ulong_t *)(&exit_tsc) = rax;
-	*(((ulong_t *)(&exit_tsc)) + 1) = rdx; 
-
-	tsc_spread = info->exit_tsc - exit_tsc;
+  if (info->run_state != VM_EMULATING) {
+    PrintError("VMMCALL with not emulator...\n");
+    return -1;
+  }
 
-	PrintError("VMMCALL tsc diff = %lu\n",tsc_spread); 
-	info->rip += 3;
-	*/
-	PrintError("VMMCALL with not emulator...\n");
-	return -1;
-      }
-      break;
-    } 
-    
+  return v3_emulation_exit_handler(info);
+}
 
 
-  case VMEXIT_WBINVD: 
-    {
+static int handle_wbinvd_exit(struct guest_info * info, void * priv_data) {
 #ifdef DEBUG_EMULATOR
-      PrintDebug("WBINVD\n");
+  PrintDebug("WBINVD\n");
 #endif
-      if (!v3_handle_svm_wbinvd(info)) { 
-	return -1;
-      }
-      break;
-    }
-
-
-
+  return v3_handle_svm_wbinvd(info);
+}
 
-    /* Exits Following this line are NOT HANDLED */
-    /*=======================================================================*/
 
-  default: {
 
-    addr_t rip_addr;
-    uchar_t buf[15];
-    addr_t host_addr;
+/* Exits without a registered handler end up here */
+static int handle_unhandled_exit(struct guest_info * info, void * priv_data) {
+  vmcb_ctrl_t * guest_ctrl = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
+  vmcb_saved_state_t * guest_state = GET_VMCB_SAVE_STATE_AREA((vmcb_t*)(info->vmm_data));
+  ulong_t exit_code = guest_ctrl->exit_code;
+  addr_t rip_addr;
+  uchar_t buf[15];
+  addr_t host_addr;
 
-    PrintDebug("Unhandled SVM Exit: %s\n", vmexit_code_to_str(exit_code));
+  PrintDebug("Unhandled SVM Exit: %s\n", vmexit_code_to_str(exit_code));
 
-    rip_addr = get_addr_linear(info, guest_state->rip, &(info->segments.cs));
+  rip_addr = get_addr_linear(info, guest_state->rip, &(v3_get_segments(info)->cs));
 
 
-    PrintError("SVM Returned:(VMCB=%p)\n", (void *)(info->vmm_data)); 
-    PrintError("RIP: %p\n", (void *)(addr_t)(guest_state->rip));
-    PrintError("RIP Linear: %p\n", (void *)(addr_t)(rip_addr));
+  PrintError("SVM Returned:(VMCB=%p)\n", (void *)(info->vmm_data)); 
+  PrintError("RIP: %p\n", (void *)(addr_t)(guest_state->rip));
+  PrintError("RIP Linear: %p\n", (void *)(addr_t)(rip_addr));
     
-    PrintError("SVM Returned: Exit Code: %p\n", (void *)(addr_t)exit_code); 
+  PrintError("SVM Returned: Exit Code: %p\n", (void *)(addr_t)exit_code); 
     
-    PrintError("io_info1 low = 0x%.8x\n", *(uint_t*)&(guest_ctrl->exit_info1));
-    PrintError("io_info1 high = 0x%.8x\n", *(uint_t *)(((uchar_t *)&(guest_ctrl->exit_info1)) + 4));
+  PrintError("io_info1 low = 0x%.8x\n", *(uint_t*)&(guest_ctrl->exit_info1));
+  PrintError("io_info1 high = 0x%.8x\n", *(uint_t *)(((uchar_t *)&(guest_ctrl->exit_info1)) + 4));
     
-    PrintError("io_info2 low = 0x%.8x\n", *(uint_t*)&(guest_ctrl->exit_info2));
-    PrintError("io_info2 high = 0x%.8x\n", *(uint_t *)(((uchar_t *)&(guest_ctrl->exit_info2)) + 4));
+  PrintError("io_info2 low = 0x%.8x\n", *(uint_t*)&(guest_ctrl->exit_info2));
+  PrintError("io_info2 high = 0x%.8x\n", *(uint_t *)(((uchar_t *)&(guest_ctrl->exit_info2)) + 4));
 
     
 
-    if (info->mem_mode == PHYSICAL_MEM) {
-      if (guest_pa_to_host_va(info, guest_state->rip, &host_addr) == -1) {
-	PrintError("Could not translate guest_state->rip to host address\n");
-	return -1;
-      }
-    } else if (info->mem_mode == VIRTUAL_MEM) {
-      if (guest_va_to_host_va(info, guest_state->rip, &host_addr) == -1) {
-	PrintError("Could not translate guest_state->rip to host address\n");
-	return -1;
-      }
-    } else {
-      PrintError("Invalid memory mode\n");
+  if (info->mem_mode == PHYSICAL_MEM) {
+    if (guest_pa_to_host_va(info, guest_state->rip, &host_addr) == -1) {
+      PrintError("Could not translate guest_state->rip to host address\n");
       return -1;
     }
+  } else if (info->mem_mode == VIRTUAL_MEM) {
+    if (guest_va_to_host_va(info, guest_state->rip, &host_addr) == -1) {
+      PrintError("Could not translate guest_state->rip to host address\n");
+      return -1;
+    }
+  } else {
+    PrintError("Invalid memory mode\n");
+    return -1;
+  }
     
-    PrintError("Host Address of rip = 0x%p\n", (void *)host_addr);
+  PrintError("Host Address of rip = 0x%p\n", (void *)host_addr);
     
-    memset(buf, 0, 32);
+  memset(buf, 0, 32);
     
-    PrintError("Reading instruction stream in guest (addr=%p)\n", (void *)rip_addr);
+  PrintError("Reading instruction stream in guest (addr=%p)\n", (void *)rip_addr);
     
-    if (info->mem_mode == PHYSICAL_MEM) {
-      read_guest_pa_memory(info, rip_addr - 16, 32, buf);
-    } else {
-      read_guest_va_memory(info, rip_addr - 16, 32, buf);
-    }
+  if (info->mem_mode == PHYSICAL_MEM) {
+    read_guest_pa_memory(info, rip_addr - 16, 32, buf);
+  } else {
+    read_guest_va_memory(info, rip_addr - 16, 32, buf);
+  }
     
-    PrintDebug("16 bytes before Rip\n");
-    PrintTraceMemDump(buf, 16);
-    PrintDebug("Rip onward\n");
-    PrintTraceMemDump(buf+16, 16);
+  PrintDebug("16 bytes before Rip\n");
+  PrintTraceMemDump(buf, 16);
+  PrintDebug("Rip onward\n");
+  PrintTraceMemDump(buf+16, 16);
     
+  return -1;
+}
+
+
+
+static void set_exit_handler(struct guest_info * info, uint_t slot,
+			     int (*handler)(struct guest_info * info, void * priv_data), 
+			     void * priv_data) {
+  info->exit_handlers[slot].handler = handler;
+  info->exit_handlers[slot].priv_data = priv_data;
+}
+
+
+int v3_init_svm_exit_handlers(struct guest_info * info) {
+  uint_t i = 0;
+
+  info->exit_handlers = (struct v3_exit_handler *)V3_Malloc(sizeof(struct v3_exit_handler) * VMEXIT_NUM_SLOTS);
+
+  if (info->exit_handlers == NULL) {
+    PrintError("Could not allocate exit handler table\n");
     return -1;
+  }
 
+  memset(info->exit_handlers, 0, sizeof(struct v3_exit_handler) * VMEXIT_NUM_SLOTS);
+
+  for (i = 0; i < VMEXIT_NUM_SLOTS; i++) {
+    set_exit_handler(info, i, handle_unhandled_exit, NULL);
   }
-    break;
 
+  set_exit_handler(info, VMEXIT_IOIO, handle_ioio_exit, NULL);
+  set_exit_handler(info, VMEXIT_CR0_WRITE, handle_cr0_write_exit, NULL);
+  set_exit_handler(info, VMEXIT_CR0_READ, handle_cr0_read_exit, NULL);
+  set_exit_handler(info, VMEXIT_CR3_WRITE, handle_cr3_write_exit, NULL);
+  set_exit_handler(info, VMEXIT_CR3_READ, handle_cr3_read_exit, NULL);
+  set_exit_handler(info, VMEXIT_CR4_WRITE, handle_cr4_write_exit, NULL);
+  set_exit_handler(info, VMEXIT_EXCP14, handle_pf_exit, NULL);
+  set_exit_handler(info, VMEXIT_NPF_SLOT, handle_npf_exit, NULL);
+  set_exit_handler(info, VMEXIT_INVLPG, handle_invlpg_exit, NULL);
+  set_exit_handler(info, VMEXIT_INTR, handle_nop_exit, NULL);
+  set_exit_handler(info, VMEXIT_SMI, handle_nop_exit, NULL);
+  set_exit_handler(info, VMEXIT_HLT, handle_hlt_exit, NULL);
+  set_exit_handler(info, VMEXIT_PAUSE, handle_pause_exit, NULL);
+  set_exit_handler(info, VMEXIT_EXCP1, handle_emulator_exit, NULL);
+  set_exit_handler(info, VMEXIT_VMMCALL, handle_emulator_exit, NULL);
+  set_exit_handler(info, VMEXIT_WBINVD, handle_wbinvd_exit, NULL);
+
+  return 0;
+}
+
+
+
+/* The intercept vectors at the start of the VMCB control area form a bitmap 
+ * indexed by exit code, so turning on the intercept for an exit is a single bit
+ * IOIO and MSR exits also need their permission maps, so they are left alone here
+ */
+static void enable_exit_intercept(struct guest_info * info, uint_t exit_code) {
+  uint_t * intercepts = (uint_t *)GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
+
+  if ((exit_code > VMEXIT_MWAIT_CONDITIONAL) ||
+      (exit_code == VMEXIT_IOIO) || 
+      (exit_code == VMEXIT_MSR)) {
+    return;
+  }
+
+  intercepts[exit_code / 32] |= (1 << (exit_code % 32));
+}
+
+
+int v3_register_exit_handler(struct guest_info * info, uint_t exit_code, 
+			     int (*handler)(struct guest_info * info, void * priv_data), 
+			     void * priv_data) {
+  uint_t slot = v3_svm_exit_slot(exit_code);
+
+  if (info->exit_handlers == NULL) {
+    PrintError("Exit handler table is not initialized\n");
+    return -1;
+  }
+
+  if (slot == VMEXIT_UNKNOWN_SLOT) {
+    PrintError("Cannot register a handler for unknown exit code (0x%x)\n", exit_code);
+    return -1;
+  }
+
+  if (info->exit_handlers[slot].handler != handle_unhandled_exit) {
+    PrintDebug("Overriding handler for %s\n", vmexit_code_to_str(exit_code));
+  }
+
+  set_exit_handler(info, slot, handler, priv_data);
+  info->exit_handlers[slot].intercept = 1;
+
+  if (info->vmm_data) {
+    enable_exit_intercept(info, exit_code);
+  }
+
+  return 0;
+}
+
+
+int v3_unregister_exit_handler(struct guest_info * info, uint_t exit_code) {
+  uint_t slot = v3_svm_exit_slot(exit_code);
+
+  if (info->exit_handlers == NULL) {
+    PrintError("Exit handler table is not initialized\n");
+    return -1;
+  }
+
+  // The intercept is left enabled, the exit will just be reported as unhandled
+  set_exit_handler(info, slot, handle_unhandled_exit, NULL);
+
+  return 0;
+}
+
+
+// Called once the VMCB exists, for handlers registered before it was created
+void v3_svm_enable_exit_intercepts(struct guest_info * info) {
+  uint_t i = 0;
+
+  for (i = 0; i <= VMEXIT_MWAIT_CONDITIONAL; i++) {
+    if (info->exit_handlers[i].intercept) {
+      enable_exit_intercept(info, i);
+    }
+  }
+}
+
+
+
+int v3_handle_svm_exit(struct guest_info * info) {
+  vmcb_ctrl_t * guest_ctrl = 0;
+  vmcb_saved_state_t * guest_state = 0;
+  ulong_t exit_code = 0;
+  struct v3_exit_handler * handler = NULL;
+  
+  guest_ctrl = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
+  guest_state = GET_VMCB_SAVE_STATE_AREA((vmcb_t*)(info->vmm_data));
+  
+
+  // Update the high level state 
+  info->rip = guest_state->rip;
+  info->vm_regs.rsp = guest_state->rsp;
+  info->vm_regs.rax = guest_state->rax;
+
+  info->cpl = guest_state->cpl;
+
+  // Everything else is pulled in from the VMCB on demand
+  info->state_valid = 0;
+  info->state_dirty = 0;
+
+  info->cpu_mode = v3_get_cpu_mode(info);
+  info->mem_mode = v3_get_mem_mode(info);
+
+
+  exit_code = guest_ctrl->exit_code;
+ 
+
+  // Disable printing io exits due to bochs debug messages
+  //if (!((exit_code == VMEXIT_IOIO) && ((ushort_t)(guest_ctrl->exit_info1 >> 16) == 0x402))) {
+
+
+  //  PrintDebug("SVM Returned: Exit Code: 0x%x \t\t(tsc=%ul)\n",exit_code, (uint_t)info->time_state.guest_tsc); 
+  
+  if ((0) && (exit_code < 0x4f)) {
+    uchar_t instr[32];
+    int ret;
+    // Dump out the instr stream
+
+    //PrintDebug("RIP: %x\n", guest_state->rip);
+    PrintDebug("RIP Linear: %p\n", (void *)get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)));
+
+    // OK, now we will read the instruction
+    // The only difference between PROTECTED and PROTECTED_PG is whether we read
+    // from guest_pa or guest_va
+    if (info->mem_mode == PHYSICAL_MEM) { 
+      // The real rip address is actually a combination of the rip + CS base 
+      ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 32, instr);
+    } else { 
+      ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 32, instr);
+    }
+    
+    if (ret != 32) {
+      // I think we should inject a GPF into the guest
+      PrintDebug("Could not read instruction (ret=%d)\n", ret);
+    } else {
+
+      PrintDebug("Instr Stream:\n");
+      PrintTraceMemDump(instr, 32);
+    }
+  }
+
+
+    //  }
+  // PrintDebugVMCB((vmcb_t*)(info->vmm_data));
+
+
+  // PrintDebug("SVM Returned:(VMCB=%x)\n", info->vmm_data); 
+  //PrintDebug("RIP: %x\n", guest_state->rip);
+
+  
+  //PrintDebug("SVM Returned: Exit Code: %x\n",exit_code); 
+
+  handler = &(info->exit_handlers[v3_svm_exit_slot(exit_code)]);
+
+  if (handler->handler(info, handler->priv_data) == -1) {
+    return -1;
   }
-  // END OF SWITCH (EXIT_CODE)
+
+  // Spread the teardown of evicted shadow page tables over exits
+  v3_reclaim_shadow_tables(info, SHADOW_RECLAIM_BATCH);
 
 
   // Update the low level state
@@ -470,15 +595,7 @@ int v3_handle_svm_exit(struct guest_info * info) {
 #endif
   }
 
-  guest_state->cr0 = info->ctrl_regs.cr0;
-  guest_state->cr2 = info->ctrl_regs.cr2;
-  guest_state->cr3 = info->ctrl_regs.cr3;
-  guest_state->cr4 = info->ctrl_regs.cr4;
-  guest_state->dr6 = info->dbg_regs.dr6;
-  guest_state->dr7 = info->dbg_regs.dr7;
-  guest_ctrl->guest_ctrl.V_TPR = info->ctrl_regs.cr8 & 0xff;
-  guest_state->rflags = info->ctrl_regs.rflags;
-  guest_state->efer = info->ctrl_regs.efer;
+  v3_flush_guest_state(info);
 
   guest_state->cpl = info->cpl;
 
@@ -487,8 +604,6 @@ int v3_handle_svm_exit(struct guest_info * info) {
   guest_state->rsp = info->vm_regs.rsp;
 
 
-  set_vmcb_segments((vmcb_t*)(info->vmm_data), &(info->segments));
-
   if (exit_code == VMEXIT_INTR) {
     //PrintDebug("INTR ret IP = %x\n", guest_state->rip);
   }
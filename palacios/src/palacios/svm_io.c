@@ -32,6 +32,27 @@
 #endif
 
 
+/* Number of string elements we can hand to a hook in one call, starting at guest_va
+ * A chunk never crosses a guest page, so the host buffer is contiguous
+ * An element that straddles a page boundary is done by itself
+ */
+static uint_t get_str_chunk(int str_op, addr_t guest_va, 
+			    uint_t elem_size, uint_t rep_num, int direction) {
+  uint_t chunk = 0;
+
+  if ((str_op == 0) || (direction != 1)) {
+    return 1;
+  }
+
+  chunk = (PAGE_SIZE - PAGE_OFFSET(guest_va)) / elem_size;
+
+  if (chunk > rep_num) {
+    chunk = rep_num;
+  }
+
+  return (chunk == 0) ? 1 : chunk;
+}
+
 
 
 
@@ -61,7 +82,7 @@ int v3_handle_svm_io_in(struct guest_info * info) {
 
   PrintDebug("IN of %d bytes on port %d (0x%x)\n", read_size, io_info->port, io_info->port);
 
-  if (hook->read(io_info->port, &(info->vm_regs.rax), read_size, hook->priv_data) != read_size) {
+  if (v3_io_read(&(info->io_map), io_info->port, &(info->vm_regs.rax), read_size) != read_size) {
     // not sure how we handle errors.....
     PrintError("Read Failure for in on port %x\n", io_info->port);
     return -1;
@@ -110,11 +131,11 @@ int v3_handle_svm_io_ins(struct guest_info * info) {
     return -1;
   }
 
-   struct v3_segment *theseg = &(info->segments.es); // default is ES
+   struct v3_segment *theseg = &(v3_get_segments(info)->es); // default is ES
   
   addr_t inst_ptr;
 
-  if (guest_va_to_host_va(info, get_addr_linear(info, info->rip, &(info->segments.cs)), &inst_ptr) == -1) {
+  if (guest_va_to_host_va(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), &inst_ptr) == -1) {
     PrintError("Can't access instruction\n");
     return -1;
   }
@@ -122,22 +143,22 @@ int v3_handle_svm_io_ins(struct guest_info * info) {
   while (is_prefix_byte(*((char*)inst_ptr))) {
     switch (*((char*)inst_ptr)) { 
     case PREFIX_CS_OVERRIDE:
-      theseg = &(info->segments.cs);
+      theseg = &(v3_get_segments(info)->cs);
       break;
     case PREFIX_SS_OVERRIDE:
-      theseg = &(info->segments.ss);
+      theseg = &(v3_get_segments(info)->ss);
       break;
     case PREFIX_DS_OVERRIDE:
-      theseg = &(info->segments.ds);
+      theseg = &(v3_get_segments(info)->ds);
       break;
     case PREFIX_ES_OVERRIDE:
-      theseg = &(info->segments.es);
+      theseg = &(v3_get_segments(info)->es);
       break;
     case PREFIX_FS_OVERRIDE:
-      theseg = &(info->segments.fs);
+      theseg = &(v3_get_segments(info)->fs);
       break;
     case PREFIX_GS_OVERRIDE:
-      theseg = &(info->segments.gs);
+      theseg = &(v3_get_segments(info)->gs);
       break;
     default:
       break;
@@ -186,28 +207,37 @@ int v3_handle_svm_io_ins(struct guest_info * info) {
 
   while (rep_num > 0) {
     addr_t host_addr;
+    uint_t chunk = 1;
+
     dst_addr = get_addr_linear(info, info->vm_regs.rdi & mask, theseg);
     
     PrintDebug("Writing 0x%p\n", (void *)dst_addr);
 
-    if (guest_va_to_host_va(info, dst_addr, &host_addr) == -1) {
+    if (guest_va_to_host_va_for_write(info, dst_addr, &host_addr) == -1) {
       // either page fault or gpf...
       PrintError("Could not convert Guest VA to host VA\n");
       return -1;
     }
 
-    if (hook->read(io_info->port, (char*)host_addr, read_size, hook->priv_data) != read_size) {
+    chunk = get_str_chunk((hook->read_str != NULL), dst_addr, read_size, rep_num, direction);
+
+    if (hook->read_str) {
+      if (hook->read_str(io_info->port, (char*)host_addr, read_size, chunk, hook->priv_data) != (int)chunk) {
+	PrintError("Read Failure for ins on port %x\n", io_info->port);
+	return -1;
+      }
+    } else if (v3_io_read(&(info->io_map), io_info->port, (char*)host_addr, read_size) != read_size) {
       // not sure how we handle errors.....
       PrintError("Read Failure for ins on port %x\n", io_info->port);
       return -1;
     }
 
-    info->vm_regs.rdi += read_size * direction;
+    info->vm_regs.rdi += read_size * chunk * direction;
 
     if (io_info->rep)
-      info->vm_regs.rcx--;
+      info->vm_regs.rcx -= chunk;
     
-    rep_num--;
+    rep_num -= chunk;
   }
 
 
@@ -241,7 +271,7 @@ int v3_handle_svm_io_out(struct guest_info * info) {
 
   PrintDebug("OUT of %d bytes on  port %d (0x%x)\n", write_size, io_info->port, io_info->port);
 
-  if (hook->write(io_info->port, &(info->vm_regs.rax), write_size, hook->priv_data) != write_size) {
+  if (v3_io_write(&(info->io_map), io_info->port, &(info->vm_regs.rax), write_size) != write_size) {
     // not sure how we handle errors.....
     PrintError("Write Failure for out on port %x\n", io_info->port);
     return -1;
@@ -323,11 +353,11 @@ int v3_handle_svm_io_outs(struct guest_info * info) {
     rep_num = info->vm_regs.rcx & mask;
   }
 
-  struct v3_segment *theseg = &(info->segments.es); // default is ES
+  struct v3_segment *theseg = &(v3_get_segments(info)->es); // default is ES
   
   addr_t inst_ptr;
 
-  if (guest_va_to_host_va(info,get_addr_linear(info,info->rip,&(info->segments.cs)),&inst_ptr)==-1) {
+  if (guest_va_to_host_va(info,get_addr_linear(info,info->rip,&(v3_get_segments(info)->cs)),&inst_ptr)==-1) {
     PrintError("Can't access instruction\n");
     return -1;
   }
@@ -335,22 +365,22 @@ int v3_handle_svm_io_outs(struct guest_info * info) {
   while (is_prefix_byte(*((char*)inst_ptr))) {
     switch (*((char*)inst_ptr)) { 
     case PREFIX_CS_OVERRIDE:
-      theseg = &(info->segments.cs);
+      theseg = &(v3_get_segments(info)->cs);
       break;
     case PREFIX_SS_OVERRIDE:
-      theseg = &(info->segments.ss);
+      theseg = &(v3_get_segments(info)->ss);
       break;
     case PREFIX_DS_OVERRIDE:
-      theseg = &(info->segments.ds);
+      theseg = &(v3_get_segments(info)->ds);
       break;
     case PREFIX_ES_OVERRIDE:
-      theseg = &(info->segments.es);
+      theseg = &(v3_get_segments(info)->es);
       break;
     case PREFIX_FS_OVERRIDE:
-      theseg = &(info->segments.fs);
+      theseg = &(v3_get_segments(info)->fs);
       break;
     case PREFIX_GS_OVERRIDE:
-      theseg = &(info->segments.gs);
+      theseg = &(v3_get_segments(info)->gs);
       break;
     default:
       break;
@@ -362,27 +392,35 @@ int v3_handle_svm_io_outs(struct guest_info * info) {
 
   while (rep_num > 0) {
     addr_t host_addr;
-
-
+    uint_t chunk = 1;
 
     dst_addr = get_addr_linear(info, (info->vm_regs.rsi & mask), theseg);
     
     if (guest_va_to_host_va(info, dst_addr, &host_addr) == -1) {
       // either page fault or gpf...
+      PrintError("Could not convert Guest VA to host VA\n");
+      return -1;
     }
 
-    if (hook->write(io_info->port, (char*)host_addr, write_size, hook->priv_data) != write_size) {
+    chunk = get_str_chunk((hook->write_str != NULL), dst_addr, write_size, rep_num, direction);
+
+    if (hook->write_str) {
+      if (hook->write_str(io_info->port, (char*)host_addr, write_size, chunk, hook->priv_data) != (int)chunk) {
+	PrintError("Write Failure for outs on port %x\n", io_info->port);
+	return -1;
+      }
+    } else if (v3_io_write(&(info->io_map), io_info->port, (char*)host_addr, write_size) != write_size) {
       // not sure how we handle errors.....
       PrintError("Write Failure for outs on port %x\n", io_info->port);
       return -1;
     }
 
-    info->vm_regs.rsi += write_size * direction;
+    info->vm_regs.rsi += write_size * chunk * direction;
 
     if (io_info->rep)
-      info->vm_regs.rcx--;
+      info->vm_regs.rcx -= chunk;
     
-    rep_num--;
+    rep_num -= chunk;
   }
 
 
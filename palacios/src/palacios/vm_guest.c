@@ -27,15 +27,15 @@
 
 
 v3_vm_cpu_mode_t v3_get_cpu_mode(struct guest_info * info) {
+  struct v3_ctrl_regs * ctrl_regs = v3_get_ctrl_regs(info);
   struct cr0_32 * cr0;
-  struct cr4_32 * cr4 = (struct cr4_32 *)&(info->ctrl_regs.cr4);
-  struct efer_64 * efer = (struct efer_64 *)&(info->ctrl_regs.efer);
-  struct v3_segment * cs = &(info->segments.cs);
+  struct cr4_32 * cr4 = (struct cr4_32 *)&(ctrl_regs->cr4);
+  struct efer_64 * efer = (struct efer_64 *)&(ctrl_regs->efer);
 
   if (info->shdw_pg_mode == SHADOW_PAGING) {
     cr0 = (struct cr0_32 *)&(info->shdw_pg_state.guest_cr0);
   } else if (info->shdw_pg_mode == NESTED_PAGING) {
-    cr0 = (struct cr0_32 *)&(info->ctrl_regs.cr0);
+    cr0 = (struct cr0_32 *)&(ctrl_regs->cr0);
   } else {
     PrintError("Invalid Paging Mode...\n");
     V3_ASSERT(0);
@@ -48,7 +48,7 @@ v3_vm_cpu_mode_t v3_get_cpu_mode(struct guest_info * info) {
     return PROTECTED;
   } else if (efer->lma == 0) {
     return PROTECTED_PAE;
-  } else if ((efer->lma == 1) && (cs->long_mode == 1)) {
+  } else if ((efer->lma == 1) && (v3_get_segments(info)->cs.long_mode == 1)) {
     return LONG;
   } else {
     return LONG_32_COMPAT;
@@ -61,7 +61,7 @@ v3_vm_mem_mode_t v3_get_mem_mode(struct guest_info * info) {
   if (info->shdw_pg_mode == SHADOW_PAGING) {
     cr0 = (struct cr0_32 *)&(info->shdw_pg_state.guest_cr0);
   } else if (info->shdw_pg_mode == NESTED_PAGING) {
-    cr0 = (struct cr0_32 *)&(info->ctrl_regs.cr0);
+    cr0 = (struct cr0_32 *)&(v3_get_ctrl_regs(info)->cr0);
   } else {
     PrintError("Invalid Paging Mode...\n");
     V3_ASSERT(0);
@@ -79,7 +79,7 @@ v3_vm_mem_mode_t v3_get_mem_mode(struct guest_info * info) {
 
 
 void v3_print_segments(struct guest_info * info) {
-  struct v3_segments * segs = &(info->segments);
+  struct v3_segments * segs = v3_get_segments(info);
   int i = 0;
   struct v3_segment * seg_ptr;
 
@@ -99,7 +99,7 @@ void v3_print_segments(struct guest_info * info) {
 
 
 void v3_print_ctrl_regs(struct guest_info * info) {
-  struct v3_ctrl_regs * regs = &(info->ctrl_regs);
+  struct v3_ctrl_regs * regs = v3_get_ctrl_regs(info);
   int i = 0;
   v3_reg_t * reg_ptr;
   char * reg_names[] = {"CR0", "CR2", "CR3", "CR4", "CR8", "FLAGS", NULL};
@@ -69,6 +69,15 @@ int guest_pa_to_host_pa(struct guest_info * guest_info, addr_t guest_pa, addr_t
   // we use the shadow map here...
   host_region_type_t reg_type = lookup_shadow_map_addr(&(guest_info->mem_map), guest_pa, host_pa);
 
+  if (reg_type == HOST_REGION_UNALLOCATED) {
+    // The VMM is touching guest memory before the guest has, so back it now
+    if (alloc_demand_mem(guest_info, guest_pa) == -1) {
+      return -1;
+    }
+
+    reg_type = lookup_shadow_map_addr(&(guest_info->mem_map), guest_pa, host_pa);
+  }
+
   if (reg_type != HOST_REGION_PHYSICAL_MEMORY) {
     PrintError("In GPA->HPA: Could not find address in shadow map (addr=%p) (reg_type=%d)\n", 
 	        (void *)guest_pa, reg_type);
@@ -162,7 +171,7 @@ int guest_va_to_guest_pa(struct guest_info * guest_info, addr_t guest_va, addr_t
       if (guest_info->shdw_pg_mode == SHADOW_PAGING) {
 	guest_pde = (addr_t)V3_PAddr((void *)(addr_t)CR3_TO_PDE32((void *)(addr_t)(guest_info->shdw_pg_state.guest_cr3)));
       } else if (guest_info->shdw_pg_mode == NESTED_PAGING) {
-	guest_pde = (addr_t)V3_PAddr((void *)(addr_t)CR3_TO_PDE32((void *)(addr_t)(guest_info->ctrl_regs.cr3)));
+	guest_pde = (addr_t)V3_PAddr((void *)(addr_t)CR3_TO_PDE32((void *)(addr_t)(v3_get_ctrl_regs(guest_info)->cr3)));
       }
       
       if (guest_pa_to_host_va(guest_info, guest_pde, (addr_t *)&pde) == -1) {
@@ -313,6 +322,33 @@ int guest_va_to_host_va(struct guest_info * guest_info, addr_t guest_va, addr_t
 }
 
 
+/* For the VMM writing guest memory through the returned pointer, which is only good to the end of the page
+ * Such writes bypass the write protection the dirty log relies on, so the page is logged here
+ */
+int guest_pa_to_host_va_for_write(struct guest_info * guest_info, addr_t guest_pa, addr_t * host_va) {
+  if (guest_pa_to_host_va(guest_info, guest_pa, host_va) != 0) {
+    return -1;
+  }
+
+  return v3_mark_page_dirty(guest_info, guest_pa);
+}
+
+
+int guest_va_to_host_va_for_write(struct guest_info * guest_info, addr_t guest_va, addr_t * host_va) {
+  addr_t guest_pa = 0;
+
+  *host_va = 0;
+
+  if (guest_va_to_guest_pa(guest_info, guest_va, &guest_pa) != 0) {
+    PrintError("In GVA->HVA: Invalid GVA(%p)->GPA lookup\n", 
+	        (void *)guest_va);
+    return -1;
+  }
+
+  return guest_pa_to_host_va_for_write(guest_info, guest_pa, host_va);
+}
+
+
 /* !! Currently not implemented !! */
 int host_va_to_guest_va(struct guest_info * guest_info, addr_t host_va, addr_t * guest_va) {
   addr_t host_pa = 0;
@@ -431,11 +467,10 @@ int write_guest_pa_memory(struct guest_info * guest_info, addr_t guest_pa, int c
     int bytes_to_copy = (dist_to_pg_edge > count) ? count : dist_to_pg_edge;
     addr_t host_addr;
 
-    if (guest_pa_to_host_va(guest_info, cursor, &host_addr) != 0) {
+    if (guest_pa_to_host_va_for_write(guest_info, cursor, &host_addr) != 0) {
       return bytes_written;
     }
 
-
     memcpy((void*)host_addr, src + bytes_written, bytes_to_copy);
 
     bytes_written += bytes_to_copy;
@@ -0,0 +1,588 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#include <palacios/vmm_checkpoint.h>
+#include <palacios/vmm.h>
+#include <palacios/vm_guest.h>
+#include <palacios/vm_guest_mem.h>
+#include <palacios/vm_dev.h>
+#include <palacios/vmm_mem.h>
+#include <palacios/vmm_string.h>
+#include <palacios/vmm_shadow_paging.h>
+#include <palacios/vmm_hashtable.h>
+#include <palacios/vmm_ctrl_regs.h>
+#include <palacios/vmcb.h>
+
+
+/* 
+ * Checkpoint format
+ *
+ * A header and the memory map layout, the pages of every RAM region in map order, the CPU state,
+ * then a record for each device with state: its name followed by whatever its save op wrote.
+ * An empty device name ends the checkpoint.
+ * Migration streams share the header, page and state encodings (see vmm_migrate.c).
+ * Everything goes straight to the host stream as it is produced, so the image is never staged in VMM memory.
+ */
+
+
+#define V3_CHKPT_MAGIC   0x50433356   // "V3CP"
+#define V3_CHKPT_VERSION 1
+
+// Each page is preceded by its type, so zero pages only cost a byte
+#define CHKPT_PAGE_ZERO 0
+#define CHKPT_PAGE_DATA 1
+
+#define CHKPT_DEV_NAME_LEN 32
+
+
+struct chkpt_header {
+  uint_t magic;
+  uint_t version;
+  uint_t stream_type;
+  uint_t shdw_pg_mode;
+  uint_t num_regions;
+};
+
+
+struct chkpt_cpu_state {
+  struct v3_gprs vm_regs;
+
+  v3_reg_t guest_cr0;
+  v3_reg_t guest_cr3;
+
+  ullong_t guest_tsc;
+
+  uint_t excp_pending;
+  uint_t excp_num;
+  uint_t excp_error_code_valid;
+  uint_t excp_error_code;
+
+  // The whole VMCB state save area, and the pending interrupt state of the control area
+  vmcb_saved_state_t vmcb_state;
+  struct Guest_Control vmcb_guest_ctrl;
+  struct Interrupt_Info vmcb_eventinj;
+  uint_t vmcb_interrupt_shadow;
+};
+
+
+struct chkpt_region {
+  addr_t guest_start;
+  addr_t guest_end;
+  uint_t guest_type;
+  uint_t host_type;
+};
+
+
+
+int v3_chkpt_save(struct v3_chkpt * chkpt, void * buf, uint_t len) {
+  if (chkpt->ops->write(chkpt->priv_data, buf, len) != (int)len) {
+    PrintError("Checkpoint stream write failed (len=%d)\n", len);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int v3_chkpt_load(struct v3_chkpt * chkpt, void * buf, uint_t len) {
+  if (chkpt->ops->read(chkpt->priv_data, buf, len) != (int)len) {
+    PrintError("Checkpoint stream read failed (len=%d)\n", len);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+
+
+static int save_cpu_state(struct guest_info * info, struct v3_chkpt * chkpt) {
+  vmcb_ctrl_t * guest_ctrl = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
+  vmcb_saved_state_t * guest_state = GET_VMCB_SAVE_STATE_AREA((vmcb_t*)(info->vmm_data));
+  struct chkpt_cpu_state cpu;
+
+  // Lazily cached registers go back to the VMCB, so it holds the complete state
+  v3_flush_guest_state(info);
+
+  memset(&cpu, 0, sizeof(struct chkpt_cpu_state));
+
+  cpu.vm_regs = info->vm_regs;
+  cpu.vm_regs.rsp = guest_state->rsp;
+  cpu.vm_regs.rax = guest_state->rax;
+
+  cpu.guest_cr0 = info->shdw_pg_state.guest_cr0;
+  cpu.guest_cr3 = info->shdw_pg_state.guest_cr3;
+
+  cpu.guest_tsc = info->time_state.guest_tsc;
+
+  cpu.excp_pending = info->intr_state.excp_pending;
+  cpu.excp_num = info->intr_state.excp_num;
+  cpu.excp_error_code_valid = info->intr_state.excp_error_code_valid;
+  cpu.excp_error_code = info->intr_state.excp_error_code;
+
+  cpu.vmcb_state = *guest_state;
+  cpu.vmcb_guest_ctrl = guest_ctrl->guest_ctrl;
+  cpu.vmcb_eventinj = guest_ctrl->EVENTINJ;
+  cpu.vmcb_interrupt_shadow = guest_ctrl->interrupt_shadow;
+
+  return V3_CHKPT_SAVE(chkpt, cpu);
+}
+
+
+// The hardware CR3 is left alone, restore_paging() points it at this host's tables
+static void restore_cpu_state(struct guest_info * info, struct chkpt_cpu_state * cpu) {
+  vmcb_ctrl_t * guest_ctrl = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
+  vmcb_saved_state_t * guest_state = GET_VMCB_SAVE_STATE_AREA((vmcb_t*)(info->vmm_data));
+  ullong_t cr3 = guest_state->cr3;
+
+  *guest_state = cpu->vmcb_state;
+  guest_ctrl->guest_ctrl = cpu->vmcb_guest_ctrl;
+  guest_ctrl->EVENTINJ = cpu->vmcb_eventinj;
+  guest_ctrl->interrupt_shadow = cpu->vmcb_interrupt_shadow;
+
+  if (info->shdw_pg_mode == SHADOW_PAGING) {
+    guest_state->cr3 = cr3;
+  }
+
+  info->vm_regs = cpu->vm_regs;
+  info->rip = guest_state->rip;
+  info->cpl = guest_state->cpl;
+
+  info->shdw_pg_state.guest_cr0 = cpu->guest_cr0;
+  info->shdw_pg_state.guest_cr3 = cpu->guest_cr3;
+
+  info->time_state.guest_tsc = cpu->guest_tsc;
+
+  info->intr_state.excp_pending = cpu->excp_pending;
+  info->intr_state.excp_num = cpu->excp_num;
+  info->intr_state.excp_error_code_valid = cpu->excp_error_code_valid;
+  info->intr_state.excp_error_code = cpu->excp_error_code;
+
+  info->state_valid = 0;
+  info->state_dirty = 0;
+
+  info->cpu_mode = v3_get_cpu_mode(info);
+  info->mem_mode = v3_get_mem_mode(info);
+}
+
+
+/* Only the root the hardware starts from is set up, 
+ * the shadow page tables fill in on page faults as they do after a CR3 load
+ */
+static int restore_paging(struct guest_info * info) {
+  vmcb_saved_state_t * guest_state = GET_VMCB_SAVE_STATE_AREA((vmcb_t*)(info->vmm_data));
+
+  if (info->shdw_pg_mode == SHADOW_PAGING) {
+    struct cr3_32 * guest_cr3 = (struct cr3_32 *)&(info->shdw_pg_state.guest_cr3);
+    struct cr3_32 * shadow_cr3 = (struct cr3_32 *)&(info->shdw_pg_state.shadow_cr3);
+
+    // The guest may have loaded CR3 before turning paging on
+    if (info->shdw_pg_state.guest_cr3 != 0) {
+      if (v3_activate_shadow_pt32(info, (addr_t)V3_PAddr((void *)(addr_t)CR3_TO_PDE32(*(addr_t *)guest_cr3))) == -1) {
+	PrintError("Could not activate shadow page tables for restored CR3\n");
+	return -1;
+      }
+
+      shadow_cr3->pwt = guest_cr3->pwt;
+      shadow_cr3->pcd = guest_cr3->pcd;
+    }
+
+    if (info->mem_mode == VIRTUAL_MEM) {
+      guest_state->cr3 = *(addr_t *)shadow_cr3;
+    } else {
+      guest_state->cr3 = info->direct_map_pt;
+    }
+  }
+
+  v3_flush_guest_tlb(info);
+
+  return 0;
+}
+
+
+
+
+int v3_chkpt_save_header(struct guest_info * info, struct v3_chkpt * chkpt, uint_t stream_type) {
+  struct shadow_map * map = &(info->mem_map);
+  struct chkpt_header header;
+  uint_t i = 0;
+
+  header.magic = V3_CHKPT_MAGIC;
+  header.version = V3_CHKPT_VERSION;
+  header.stream_type = stream_type;
+  header.shdw_pg_mode = info->shdw_pg_mode;
+  header.num_regions = map->num_regions;
+
+  if (V3_CHKPT_SAVE(chkpt, header) == -1) {
+    return -1;
+  }
+
+  for (i = 0; i < map->num_regions; i++) {
+    struct shadow_region * reg = map->regions[i];
+    struct chkpt_region region;
+
+    region.guest_start = reg->guest_start;
+    region.guest_end = reg->guest_end;
+    region.guest_type = reg->guest_type;
+    region.host_type = reg->host_type;
+
+    if (V3_CHKPT_SAVE(chkpt, region) == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+// Host backing can't be carried over, so the guest must have been configured with the same map
+int v3_chkpt_check_header(struct guest_info * info, struct v3_chkpt * chkpt, uint_t stream_type) {
+  struct shadow_map * map = &(info->mem_map);
+  struct chkpt_header header;
+  uint_t i = 0;
+
+  if (V3_CHKPT_LOAD(chkpt, header) == -1) {
+    return -1;
+  }
+
+  if ((header.magic != V3_CHKPT_MAGIC) || (header.version != V3_CHKPT_VERSION) || 
+      (header.stream_type != stream_type)) {
+    PrintError("Invalid checkpoint stream (magic=%x, version=%d, type=%d)\n", 
+	       header.magic, header.version, header.stream_type);
+    return -1;
+  }
+
+  if (header.shdw_pg_mode != info->shdw_pg_mode) {
+    PrintError("Checkpoint was taken with a different paging mode\n");
+    return -1;
+  }
+
+  if (header.num_regions != map->num_regions) {
+    PrintError("Checkpoint has %d memory regions, the guest has %d\n", header.num_regions, map->num_regions);
+    return -1;
+  }
+
+  for (i = 0; i < map->num_regions; i++) {
+    struct shadow_region * reg = map->regions[i];
+    struct chkpt_region region;
+
+    if (V3_CHKPT_LOAD(chkpt, region) == -1) {
+      return -1;
+    }
+
+    if ((region.guest_start != reg->guest_start) || (region.guest_end != reg->guest_end) ||
+	(region.guest_type != reg->guest_type) || (region.host_type != reg->host_type)) {
+      PrintError("Checkpoint region %p-%p does not match guest region %p-%p\n", 
+		 (void *)region.guest_start, (void *)region.guest_end, 
+		 (void *)(reg->guest_start), (void *)(reg->guest_end));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+
+
+// Identity mapped regions pass host devices through (VGA, PCI), they are not guest memory
+int v3_chkpt_is_guest_ram(struct shadow_region * reg) {
+  if (reg->host_type == HOST_REGION_UNALLOCATED) {
+    return 1;
+  }
+
+  return ((reg->host_type == HOST_REGION_PHYSICAL_MEMORY) && (reg->host_addr != reg->guest_start));
+}
+
+
+// Current contents of a guest page, without giving demand memory a page of its own
+static uchar_t * get_page_contents(struct shadow_region * reg, addr_t guest_pa) {
+  if (reg->host_type == HOST_REGION_UNALLOCATED) {
+    return V3_VAddr((void *)get_demand_mem_readonly_addr(reg, guest_pa));
+  }
+
+  return V3_VAddr((void *)(reg->host_addr + (guest_pa - reg->guest_start)));
+}
+
+
+static int is_zero_page(uchar_t * page) {
+  ulong_t * words = (ulong_t *)page;
+  uint_t i = 0;
+
+  for (i = 0; i < (PAGE_SIZE / sizeof(ulong_t)); i++) {
+    if (words[i] != 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+// Hash over the contents of every RAM page, for checking that a migrated guest arrived intact
+ulong_t v3_chkpt_ram_checksum(struct guest_info * info) {
+  struct shadow_map * map = &(info->mem_map);
+  ulong_t checksum = 0;
+  uint_t i = 0;
+
+  for (i = 0; i < map->num_regions; i++) {
+    struct shadow_region * reg = map->regions[i];
+    addr_t guest_pa = 0;
+
+    if (v3_chkpt_is_guest_ram(reg) == 0) {
+      continue;
+    }
+
+    for (guest_pa = reg->guest_start; guest_pa < reg->guest_end; guest_pa += PAGE_SIZE) {
+      checksum = (checksum * 31) + hash_buffer(get_page_contents(reg, guest_pa), PAGE_SIZE);
+    }
+  }
+
+  return checksum;
+}
+
+
+int v3_chkpt_save_page(struct v3_chkpt * chkpt, struct shadow_region * reg, addr_t guest_pa) {
+  uchar_t * page = get_page_contents(reg, guest_pa);
+  uchar_t type = (is_zero_page(page)) ? CHKPT_PAGE_ZERO : CHKPT_PAGE_DATA;
+
+  if (V3_CHKPT_SAVE(chkpt, type) == -1) {
+    return -1;
+  }
+
+  if (type == CHKPT_PAGE_DATA) {
+    return v3_chkpt_save(chkpt, page, PAGE_SIZE);
+  }
+
+  return 0;
+}
+
+
+// Pages are read straight into guest memory
+int v3_chkpt_load_page(struct guest_info * info, struct v3_chkpt * chkpt, 
+		       struct shadow_region * reg, addr_t guest_pa) {
+  addr_t host_addr = 0;
+  uchar_t type = 0;
+
+  if (V3_CHKPT_LOAD(chkpt, type) == -1) {
+    return -1;
+  }
+
+  if (type == CHKPT_PAGE_ZERO) {
+    // Unwritten demand memory reads as zeroes already, and stays unallocated
+    if ((reg->host_type == HOST_REGION_UNALLOCATED) && 
+	(get_demand_mem_readonly_addr(reg, guest_pa) == get_zero_page())) {
+      return 0;
+    }
+  } else if (type != CHKPT_PAGE_DATA) {
+    PrintError("Invalid checkpoint page type (%d) for %p\n", type, (void *)guest_pa);
+    return -1;
+  }
+
+  if (guest_pa_to_host_va_for_write(info, guest_pa, &host_addr) == -1) {
+    PrintError("Could not map guest page %p\n", (void *)guest_pa);
+    return -1;
+  }
+
+  if (type == CHKPT_PAGE_ZERO) {
+    memset((void *)host_addr, 0, PAGE_SIZE);
+    return 0;
+  }
+
+  return v3_chkpt_load(chkpt, (void *)host_addr, PAGE_SIZE);
+}
+
+
+static int save_ram(struct guest_info * info, struct v3_chkpt * chkpt) {
+  struct shadow_map * map = &(info->mem_map);
+  uint_t i = 0;
+
+  for (i = 0; i < map->num_regions; i++) {
+    struct shadow_region * reg = map->regions[i];
+    addr_t guest_pa = 0;
+
+    if (v3_chkpt_is_guest_ram(reg) == 0) {
+      continue;
+    }
+
+    for (guest_pa = reg->guest_start; guest_pa < reg->guest_end; guest_pa += PAGE_SIZE) {
+      if (v3_chkpt_save_page(chkpt, reg, guest_pa) == -1) {
+	return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+static int restore_ram(struct guest_info * info, struct v3_chkpt * chkpt) {
+  struct shadow_map * map = &(info->mem_map);
+  uint_t i = 0;
+
+  for (i = 0; i < map->num_regions; i++) {
+    struct shadow_region * reg = map->regions[i];
+    addr_t guest_pa = 0;
+
+    if (v3_chkpt_is_guest_ram(reg) == 0) {
+      continue;
+    }
+
+    for (guest_pa = reg->guest_start; guest_pa < reg->guest_end; guest_pa += PAGE_SIZE) {
+      if (v3_chkpt_load_page(info, chkpt, reg, guest_pa) == -1) {
+	return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+
+
+static int save_devices(struct guest_info * info, struct v3_chkpt * chkpt) {
+  struct vm_device * dev = NULL;
+  char name[CHKPT_DEV_NAME_LEN];
+
+  list_for_each_entry(dev, &(info->dev_mgr.dev_list), dev_link) {
+    if (dev->ops->save == NULL) {
+      continue;
+    }
+
+    memset(name, 0, CHKPT_DEV_NAME_LEN);
+    strncpy(name, dev->name, CHKPT_DEV_NAME_LEN - 1);
+
+    if ((V3_CHKPT_SAVE(chkpt, name) == -1) || (dev->ops->save(dev, chkpt) == -1)) {
+      PrintError("Could not save device %s\n", dev->name);
+      return -1;
+    }
+  }
+
+  memset(name, 0, CHKPT_DEV_NAME_LEN);
+
+  return V3_CHKPT_SAVE(chkpt, name);
+}
+
+
+static int restore_devices(struct guest_info * info, struct v3_chkpt * chkpt) {
+  char name[CHKPT_DEV_NAME_LEN];
+
+  while (1) {
+    struct vm_device * dev = NULL;
+    struct vm_device * tmp = NULL;
+
+    if (V3_CHKPT_LOAD(chkpt, name) == -1) {
+      return -1;
+    }
+
+    name[CHKPT_DEV_NAME_LEN - 1] = 0;
+
+    if (name[0] == 0) {
+      return 0;
+    }
+
+    list_for_each_entry(tmp, &(info->dev_mgr.dev_list), dev_link) {
+      if (strncmp(tmp->name, name, CHKPT_DEV_NAME_LEN - 1) == 0) {
+	dev = tmp;
+	break;
+      }
+    }
+
+    if ((dev == NULL) || (dev->ops->restore == NULL)) {
+      PrintError("Checkpoint has state for device %s, which the guest can't restore\n", name);
+      return -1;
+    }
+
+    if (dev->ops->restore(dev, chkpt) == -1) {
+      PrintError("Could not restore device %s\n", name);
+      return -1;
+    }
+  }
+}
+
+
+
+
+int v3_chkpt_save_state(struct guest_info * info, struct v3_chkpt * chkpt) {
+  if ((save_cpu_state(info, chkpt) == -1) || (save_devices(info, chkpt) == -1)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int v3_chkpt_load_state(struct guest_info * info, struct v3_chkpt * chkpt) {
+  struct chkpt_cpu_state cpu;
+
+  if ((V3_CHKPT_LOAD(chkpt, cpu) == -1) || (restore_devices(info, chkpt) == -1)) {
+    return -1;
+  }
+
+  restore_cpu_state(info, &cpu);
+
+  return restore_paging(info);
+}
+
+
+
+
+int v3_save_vm(struct guest_info * info, struct v3_chkpt_ops * ops, void * priv_data) {
+  struct v3_chkpt chkpt;
+
+  if (info->run_state == VM_EMULATING) {
+    PrintError("Cannot checkpoint a guest in the middle of emulating an instruction\n");
+    return -1;
+  }
+
+  chkpt.ops = ops;
+  chkpt.priv_data = priv_data;
+
+  if ((v3_chkpt_save_header(info, &chkpt, V3_CHKPT_IMAGE) == -1) ||
+      (save_ram(info, &chkpt) == -1) ||
+      (v3_chkpt_save_state(info, &chkpt) == -1)) {
+    PrintError("Could not checkpoint guest\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int v3_restore_vm(struct guest_info * info, struct v3_chkpt_ops * ops, void * priv_data) {
+  struct v3_chkpt chkpt;
+
+  if (info->run_state != VM_STOPPED) {
+    PrintError("Checkpoints can only be restored into a guest that has not been started\n");
+    return -1;
+  }
+
+  chkpt.ops = ops;
+  chkpt.priv_data = priv_data;
+
+  if ((v3_chkpt_check_header(info, &chkpt, V3_CHKPT_IMAGE) == -1) ||
+      (restore_ram(info, &chkpt) == -1) ||
+      (v3_chkpt_load_state(info, &chkpt) == -1)) {
+    PrintError("Could not restore guest\n");
+    return -1;
+  }
+
+  return 0;
+}
@@ -21,6 +21,7 @@
 #include <palacios/vmm_config.h>
 #include <palacios/vmm.h>
 #include <palacios/vmm_debug.h>
+#include <palacios/svm_handler.h>
 
 
 #include <devices/serial.h>
@@ -89,7 +90,10 @@ int v3_config_guest(struct guest_info * info, struct v3_vm_config * config_ptr)
   info->mem_mode = PHYSICAL_MEM;
   
  
-  v3_init_vmm_io_map(info);
+  if (v3_init_vmm_io_map(info) == -1) {
+    return -1;
+  }
+
   v3_init_interrupt_state(info);
   
   v3_init_dev_mgr(info);
@@ -98,6 +102,15 @@ int v3_config_guest(struct guest_info * info, struct v3_vm_config * config_ptr)
   
   v3_init_host_events(info);
 
+  if (v3_init_exit_stats(info) == -1) {
+    return -1;
+  }
+
+  v3_init_dedup(info, config_ptr->mem_dedup);
+  v3_init_dirty_log(info);
+  v3_init_migration(info);
+  v3_init_svm_exit_handlers(info);
+
  
 
   /* layout rombios */
@@ -156,16 +169,37 @@ int v3_config_guest(struct guest_info * info, struct v3_vm_config * config_ptr)
   }
   
   
-  if (1) {
-  add_shadow_region_passthrough(info, 0x100000, 0x1000000, (addr_t)V3_AllocPages(4096));
+  if (config_ptr->mem_on_demand) {
+    if (add_shadow_region_demand(info, 0x100000, 0x8000000) == -1) {
+      PrintError("Could not add demand allocated guest memory\n");
+      return -1;
+    }
+  } else if (config_ptr->mem_align > PAGE_SIZE) {
+    /* Large page layout: RAM from 1MB to 128MB is one chunk, placed so guest and host
+     * addresses line up modulo the alignment. The first 1MB of the chunk is left unused.
+     */
+    addr_t host_mem = (addr_t)V3_AllocPagesAligned(0x8000000 / PAGE_SIZE, config_ptr->mem_align);
+
+    if (host_mem == 0) {
+      PrintError("Could not allocate guest memory\n");
+      return -1;
+    }
+
+    if ((host_mem & (config_ptr->mem_align - 1)) != 0) {
+      PrintError("Guest memory is not %d byte aligned, large pages will not be used\n", config_ptr->mem_align);
+    }
+
+    add_shadow_region_passthrough(info, 0x100000, 0x8000000, host_mem + 0x100000);
+  } else if (1) {
+    add_shadow_region_passthrough(info, 0x100000, 0x1000000, (addr_t)V3_AllocPages(4096));
+    add_shadow_region_passthrough(info, 0x1000000, 0x8000000, (addr_t)V3_AllocPages(32768));
   } else {
     /* MEMORY HOOK TEST */
     add_shadow_region_passthrough(info, 0x100000, 0xa00000, (addr_t)V3_AllocPages(2304));
     hook_guest_mem(info, 0xa00000, 0xa01000, mem_test_read, passthrough_mem_write, NULL); 
     add_shadow_region_passthrough(info, 0xa01000, 0x1000000, (addr_t)V3_AllocPages(1791));
-  }
-
     add_shadow_region_passthrough(info, 0x1000000, 0x8000000, (addr_t)V3_AllocPages(32768));
+  }
  
   // test - give linux accesss to PCI space - PAD
   add_shadow_region_passthrough(info, 0xc0000000,0xffffffff,0xc0000000);
@@ -240,14 +274,14 @@ int v3_config_guest(struct guest_info * info, struct v3_vm_config * config_ptr)
       
 #if 0
       if (!use_ramdisk) {
-	// Monitor the IDE controllers (very slow)
-	v3_generic_add_port_range(generic, 0x170, 0x178, GENERIC_PRINT_AND_PASSTHROUGH); // IDE 1
-	v3_generic_add_port_range(generic, 0x376, 0x377, GENERIC_PRINT_AND_PASSTHROUGH); // IDE 1
+	// Pass the IDE controllers through to the guest
+	v3_generic_add_port_range(generic, 0x170, 0x178, GENERIC_PASSTHROUGH); // IDE 1
+	v3_generic_add_port_range(generic, 0x376, 0x377, GENERIC_PASSTHROUGH); // IDE 1
       }
       
 
-      v3_generic_add_port_range(generic, 0x1f0, 0x1f8, GENERIC_PRINT_AND_PASSTHROUGH); // IDE 0
-      v3_generic_add_port_range(generic, 0x3f6, 0x3f7, GENERIC_PRINT_AND_PASSTHROUGH); // IDE 0
+      v3_generic_add_port_range(generic, 0x1f0, 0x1f8, GENERIC_PASSTHROUGH); // IDE 0
+      v3_generic_add_port_range(generic, 0x3f6, 0x3f7, GENERIC_PASSTHROUGH); // IDE 0
 #endif
       
       
@@ -292,8 +326,8 @@ int v3_config_guest(struct guest_info * info, struct v3_vm_config * config_ptr)
 
 
 #if 1
-      // Monitor any network card (realtek ne2000) operations 
-      v3_generic_add_port_range(generic, 0xc100, 0xc1ff, GENERIC_PRINT_AND_PASSTHROUGH);
+      // Give any network card (realtek ne2000) straight to the guest
+      v3_generic_add_port_range(generic, 0xc100, 0xc1ff, GENERIC_PASSTHROUGH);
 #endif
 
 
@@ -47,9 +47,9 @@ int v3_handle_cr0_write(struct guest_info * info) {
   struct x86_instr dec_instr;
 
   if (info->mem_mode == PHYSICAL_MEM) { 
-    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
   } else { 
-    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
   }
 
   /* The IFetch will already have faulted in the necessary bytes for the full instruction
@@ -67,7 +67,7 @@ int v3_handle_cr0_write(struct guest_info * info) {
 
 
   if (v3_opcode_cmp(V3_OPCODE_LMSW, (const uchar_t *)(dec_instr.opcode)) == 0) {
-    struct cr0_real *real_cr0  = (struct cr0_real*)&(info->ctrl_regs.cr0);
+    struct cr0_real *real_cr0  = (struct cr0_real*)&(v3_mod_ctrl_regs(info)->cr0);
     struct cr0_real *new_cr0 = (struct cr0_real *)(dec_instr.src_operand.operand);	
     uchar_t new_cr0_val;
 
@@ -98,7 +98,7 @@ int v3_handle_cr0_write(struct guest_info * info) {
       // 64 bit registers
     } else {
       // 32 bit registers
-	struct cr0_32 *real_cr0 = (struct cr0_32*)&(info->ctrl_regs.cr0);
+	struct cr0_32 *real_cr0 = (struct cr0_32*)&(v3_mod_ctrl_regs(info)->cr0);
 	struct cr0_32 *new_cr0= (struct cr0_32 *)(dec_instr.src_operand.operand);
 
 	PrintDebug("OperandVal = %x, length=%d\n", *(uint_t *)new_cr0, dec_instr.src_operand.size);
@@ -121,12 +121,15 @@ int v3_handle_cr0_write(struct guest_info * info) {
 	  if (v3_get_mem_mode(info) == VIRTUAL_MEM) {
 	    struct cr3_32 * shadow_cr3 = (struct cr3_32 *)&(info->shdw_pg_state.shadow_cr3);
 	    PrintDebug("Setting up Shadow Page Table\n");
-	    info->ctrl_regs.cr3 = *(addr_t*)shadow_cr3;
+	    v3_mod_ctrl_regs(info)->cr3 = *(addr_t*)shadow_cr3;
 	  } else  {
-	    info->ctrl_regs.cr3 = *(addr_t*)&(info->direct_map_pt);
+	    v3_mod_ctrl_regs(info)->cr3 = *(addr_t*)&(info->direct_map_pt);
 	    real_cr0->pg = 1;
 	  }
 	  
+	  // The hardware CR3 just switched between the passthrough and shadow tables
+	  v3_flush_guest_tlb(info);
+
 	  PrintDebug("New Shadow CR0=%x\n",*(uint_t *)shadow_cr0);
  	}
 	PrintDebug("New CR0=%x\n", *(uint_t *)real_cr0);
@@ -134,7 +137,7 @@ int v3_handle_cr0_write(struct guest_info * info) {
 
   } else if (v3_opcode_cmp(V3_OPCODE_CLTS, (const uchar_t *)(dec_instr.opcode)) == 0) {
     // CLTS
-    struct cr0_32 *real_cr0 = (struct cr0_32*)&(info->ctrl_regs.cr0);
+    struct cr0_32 *real_cr0 = (struct cr0_32*)&(v3_mod_ctrl_regs(info)->cr0);
 	
     real_cr0->ts = 0;
 
@@ -161,9 +164,9 @@ int v3_handle_cr0_read(struct guest_info * info) {
   struct x86_instr dec_instr;
 
   if (info->mem_mode == PHYSICAL_MEM) { 
-    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
   } else { 
-    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
   }
 
   /* The IFetch will already have faulted in the necessary bytes for the full instruction
@@ -181,7 +184,7 @@ int v3_handle_cr0_read(struct guest_info * info) {
   
   if (v3_opcode_cmp(V3_OPCODE_MOVCR2, (const uchar_t *)(dec_instr.opcode)) == 0) {
     struct cr0_32 * virt_cr0 = (struct cr0_32 *)(dec_instr.dst_operand.operand);
-    struct cr0_32 * real_cr0 = (struct cr0_32 *)&(info->ctrl_regs.cr0);
+    struct cr0_32 * real_cr0 = (struct cr0_32 *)&(v3_get_ctrl_regs(info)->cr0);
     
     PrintDebug("MOVCR2\n");
     PrintDebug("CR0 at 0x%p\n", (void *)real_cr0);
@@ -195,7 +198,7 @@ int v3_handle_cr0_read(struct guest_info * info) {
     PrintDebug("real CR0: %x\n", *(uint_t*)real_cr0);
     PrintDebug("returned CR0: %x\n", *(uint_t*)virt_cr0);
   } else if (v3_opcode_cmp(V3_OPCODE_SMSW, (const uchar_t *)(dec_instr.opcode)) == 0) {
-    struct cr0_real *real_cr0= (struct cr0_real*)&(info->ctrl_regs.cr0);
+    struct cr0_real *real_cr0= (struct cr0_real*)&(v3_get_ctrl_regs(info)->cr0);
     struct cr0_real *virt_cr0 = (struct cr0_real *)(dec_instr.dst_operand.operand);
     char cr0_val = *(char*)real_cr0 & 0x0f;
     
@@ -226,9 +229,9 @@ int v3_handle_cr3_write(struct guest_info * info) {
   struct x86_instr dec_instr;
 
   if (info->mem_mode == PHYSICAL_MEM) { 
-    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
   } else { 
-    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
   }
 
   /* The IFetch will already have faulted in the necessary bytes for the full instruction
@@ -248,44 +251,21 @@ int v3_handle_cr3_write(struct guest_info * info) {
 
     PrintDebug("MOV2CR3\n");
 
-    PrintDebug("CR3 at 0x%p\n", &(info->ctrl_regs.cr3));
+    PrintDebug("CR3 at 0x%p\n", &(v3_get_ctrl_regs(info)->cr3));
 
     if (info->shdw_pg_mode == SHADOW_PAGING) {
       struct cr3_32 * new_cr3 = (struct cr3_32 *)(dec_instr.src_operand.operand);	
       struct cr3_32 * guest_cr3 = (struct cr3_32 *)&(info->shdw_pg_state.guest_cr3);
       struct cr3_32 * shadow_cr3 = (struct cr3_32 *)&(info->shdw_pg_state.shadow_cr3);
-      int cached = 0;
       
 
       PrintDebug("Old Shadow CR3=%x; Old Guest CR3=%x\n", 
 		 *(uint_t*)shadow_cr3, *(uint_t*)guest_cr3);
       
 
-
-      cached = v3_cache_page_tables32(info, (addr_t)V3_PAddr((void *)(addr_t)CR3_TO_PDE32((void *)*(addr_t *)new_cr3)));
-	
-      if (cached == -1) {
+      if (v3_activate_shadow_pt32(info, (addr_t)V3_PAddr((void *)(addr_t)CR3_TO_PDE32((void *)*(addr_t *)new_cr3))) == -1) {
 	PrintError("CR3 Cache failed\n");
 	return -1;
-      } else if (cached == 0) {
-	addr_t shadow_pt;
-	
-	if( info->mem_mode == VIRTUAL_MEM )
-	{
-		PrintDebug("New CR3 is different - flushing shadow page table %p\n", shadow_cr3 );	
-	
-		delete_page_tables_pde32((pde32_t *)CR3_TO_PDE32(*(uint_t*)shadow_cr3));
-	}
-	
-	shadow_pt =  v3_create_new_shadow_pt32();
-	
-	shadow_cr3->pdt_base_addr = (addr_t)V3_PAddr((void *)(addr_t)PD32_BASE_ADDR(shadow_pt));
-	PrintDebug( "Created new shadow page table %p\n", (void *)(addr_t)shadow_cr3->pdt_base_addr );
-	//PrintDebugPageTables( (pde32_t *)CR3_TO_PDE32(*(uint_t*)shadow_cr3) );
-
-
-      } else {
-	PrintDebug("Reusing cached shadow Page table\n");
       }
       
       
@@ -300,7 +280,7 @@ int v3_handle_cr3_write(struct guest_info * info) {
 
       if (info->mem_mode == VIRTUAL_MEM) {
 	// If we aren't in paged mode then we have to preserve the identity mapped CR3
-	info->ctrl_regs.cr3 = *(addr_t*)shadow_cr3;
+	v3_mod_ctrl_regs(info)->cr3 = *(addr_t*)shadow_cr3;
       }
     }
   } else {
@@ -323,9 +303,9 @@ int v3_handle_cr3_read(struct guest_info * info) {
   struct x86_instr dec_instr;
 
   if (info->mem_mode == PHYSICAL_MEM) { 
-    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
   } else { 
-    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
   }
 
   /* The IFetch will already have faulted in the necessary bytes for the full instruction
@@ -345,12 +325,12 @@ int v3_handle_cr3_read(struct guest_info * info) {
     PrintDebug("MOVCR32\n");
     struct cr3_32 * virt_cr3 = (struct cr3_32 *)(dec_instr.dst_operand.operand);
 
-    PrintDebug("CR3 at 0x%p\n", &(info->ctrl_regs.cr3));
+    PrintDebug("CR3 at 0x%p\n", &(v3_get_ctrl_regs(info)->cr3));
 
     if (info->shdw_pg_mode == SHADOW_PAGING) {
       *virt_cr3 = *(struct cr3_32 *)&(info->shdw_pg_state.guest_cr3);
     } else {
-      *virt_cr3 = *(struct cr3_32 *)&(info->ctrl_regs.cr3);
+      *virt_cr3 = *(struct cr3_32 *)&(v3_get_ctrl_regs(info)->cr3);
     }
   } else {
     PrintError("Unhandled opcode in handle_cr3_read\n");
@@ -361,3 +341,66 @@ int v3_handle_cr3_read(struct guest_info * info) {
 
   return 0;
 }
+
+
+
+/* Only intercepted with shadow paging, where 4MB shadow and passthrough PDEs depend on CR4.PSE
+ * The guest sees its own value, so nothing has to be shadowed on reads
+ */
+int v3_handle_cr4_write(struct guest_info * info) {
+  uchar_t instr[15];
+  int ret;
+  struct x86_instr dec_instr;
+
+  if (info->mem_mode == PHYSICAL_MEM) { 
+    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
+  } else { 
+    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
+  }
+
+  // A short read is fine at the end of a page, the IFetch has already faulted in the instruction
+  if (ret <= 0) {
+    PrintError("Could not read instruction (ret=%d)\n", ret);
+    return -1;
+  }
+
+  if (v3_decode(info, (addr_t)instr, &dec_instr) == -1) {
+    PrintError("Could not decode instruction\n");
+    return -1;
+  }
+
+  if (v3_opcode_cmp(V3_OPCODE_MOV2CR, (const uchar_t *)(dec_instr.opcode)) == 0) {
+    struct cr4_32 * real_cr4 = (struct cr4_32 *)&(v3_mod_ctrl_regs(info)->cr4);
+    uint_t old_pse = real_cr4->pse;
+
+    PrintDebug("MOV2CR4\n");
+    PrintDebug("Old CR4=%x\n", *(uint_t *)real_cr4);
+
+    if (info->cpu_mode == LONG) {
+      v3_mod_ctrl_regs(info)->cr4 = *(ullong_t *)(dec_instr.src_operand.operand);
+    } else {
+      *real_cr4 = *(struct cr4_32 *)(dec_instr.src_operand.operand);
+    }
+
+    PrintDebug("New CR4=%x\n", *(uint_t *)real_cr4);
+
+    if ((info->shdw_pg_mode == SHADOW_PAGING) && (old_pse != real_cr4->pse)) {
+      if (real_cr4->pse == 0) {
+	v3_drop_large_shadow_pdes(info);
+      }
+
+      // The direct map switches between 4MB and 4KB entries as well
+      if (v3_rebuild_passthrough_pts(info) == -1) {
+	PrintError("Could not rebuild passthrough page tables\n");
+	return -1;
+      }
+    }
+  } else {
+    PrintError("Unhandled opcode in handle_cr4_write\n");
+    return -1;
+  }
+
+  info->rip += dec_instr.instr_length;
+
+  return 0;
+}
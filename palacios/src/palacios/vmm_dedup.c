@@ -0,0 +1,396 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#include <palacios/vmm_dedup.h>
+#include <palacios/vmm.h>
+#include <palacios/vm_guest.h>
+#include <palacios/vmm_mem.h>
+#include <palacios/vmm_hashtable.h>
+#include <palacios/vmm_shadow_paging.h>
+
+
+/* 
+ * Page merging
+ *
+ * Demand allocated guest pages are hashed while the guest is idle.
+ * Pages that turn out to be identical to a page seen before are merged into one read only shared page,
+ * and all zero pages go back to the zero page.
+ * A write to a merged page goes through alloc_demand_mem, which gives the page a copy of its own.
+ *
+ * The tables below are global, so they assume VMs are not run on several CPUs at once.
+ */
+
+
+// Page contents hash -> struct shared_page
+// Only one shared page is kept per hash, pages colliding with it are left alone
+static struct hashtable * shared_pages = NULL;
+
+// Page contents hash -> a page seen once during the current pass
+// Candidates are compared against the page again before use, since the guest may have written it since
+static struct hashtable * candidates = NULL;
+
+static ulong_t zero_page_hash = 0;
+
+
+struct dedup_candidate {
+  struct guest_info * info;
+  addr_t guest_pa;
+};
+
+
+DEFINE_HASHTABLE_INSERT(add_shared_page, ulong_t, struct shared_page *);
+DEFINE_HASHTABLE_SEARCH(find_shared_page, ulong_t, struct shared_page);
+DEFINE_HASHTABLE_REMOVE(del_shared_page, ulong_t, struct shared_page, 0);
+
+DEFINE_HASHTABLE_INSERT(add_dedup_candidate, ulong_t, struct dedup_candidate *);
+DEFINE_HASHTABLE_SEARCH(find_dedup_candidate, ulong_t, struct dedup_candidate);
+DEFINE_HASHTABLE_REMOVE(del_dedup_candidate, ulong_t, struct dedup_candidate, 0);
+
+
+
+static uint_t content_hash_fn(addr_t key) {
+  return (uint_t)key;
+}
+
+static int content_hash_equals(addr_t key1, addr_t key2) {
+  return (key1 == key2);
+}
+
+
+static int init_dedup_tables() {
+  if (shared_pages == NULL) {
+    addr_t zero_page = get_zero_page();
+
+    if (zero_page == 0) {
+      return -1;
+    }
+
+    zero_page_hash = hash_buffer(V3_VAddr((void *)zero_page), PAGE_SIZE);
+    shared_pages = create_hashtable(0, &content_hash_fn, &content_hash_equals);
+  }
+
+  if (candidates == NULL) {
+    candidates = create_hashtable(0, &content_hash_fn, &content_hash_equals);
+  }
+
+  if ((shared_pages == NULL) || (candidates == NULL)) {
+    PrintError("Could not allocate page merging tables\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void v3_init_dedup(struct guest_info * info, int enabled) {
+  struct v3_dedup_state * dedup = &(info->dedup);
+
+  memset(dedup, 0, sizeof(struct v3_dedup_state));
+  dedup->enabled = enabled;
+}
+
+
+
+// Points a guest page at new backing, and drops every mapping of the old one
+// The TLB flushes only take effect at the next guest entry, so merging a batch costs one flush
+static int set_demand_page(struct guest_info * info, addr_t guest_pa, addr_t * entry, addr_t new_entry) {
+  addr_t page_addr = PAGE_ADDR(guest_pa);
+
+  *entry = new_entry;
+
+  v3_zap_shadow_mappings(info, page_addr, page_addr + PAGE_SIZE);
+
+  return v3_update_passthrough_pts(info, page_addr, page_addr + PAGE_SIZE);
+}
+
+
+static int merge_page(struct guest_info * info, addr_t guest_pa, addr_t * entry, struct shared_page * shared) {
+  struct v3_dedup_stats * stats = &(info->dedup.stats);
+  addr_t old_page = *entry;
+
+  if (set_demand_page(info, guest_pa, entry, (addr_t)shared | DEMAND_PAGE_SHARED) == -1) {
+    // The guest keeps its own page, so the shared page gets no reference
+    *entry = old_page;
+    return -1;
+  }
+
+  shared->ref_count++;
+
+  V3_FreePage((void *)old_page);
+
+  stats->pages_shared++;
+  stats->pages_merged++;
+  stats->pages_saved++;
+
+#ifdef DEBUG_DEDUP
+  PrintDebug("Merged guest page %p into shared page %p (refs=%d)\n", 
+	     (void *)guest_pa, (void *)(shared->host_addr), shared->ref_count);
+#endif
+
+  return 0;
+}
+
+
+// Makes the candidate's page the shared copy of its contents
+static struct shared_page * share_candidate(struct dedup_candidate * cand, ulong_t hash, uchar_t * contents) {
+  struct shadow_region * reg = get_shadow_region_by_addr(&(cand->info->mem_map), cand->guest_pa);
+  struct shared_page * shared = NULL;
+  addr_t * entry = NULL;
+
+  if ((reg == NULL) || (reg->host_type != HOST_REGION_UNALLOCATED)) {
+    return NULL;
+  }
+
+  entry = get_demand_page_entry(reg, cand->guest_pa);
+
+  if ((*entry == 0) || (*entry & DEMAND_PAGE_SHARED) || 
+      (memcmp(V3_VAddr((void *)*entry), contents, PAGE_SIZE) != 0)) {
+    // Written since it was seen
+    return NULL;
+  }
+
+  shared = (struct shared_page *)V3_Malloc(sizeof(struct shared_page));
+
+  if (shared == NULL) {
+    PrintError("Could not allocate shared page\n");
+    return NULL;
+  }
+
+  shared->host_addr = *entry;
+  shared->hash = hash;
+  shared->ref_count = 1;
+
+  if (set_demand_page(cand->info, cand->guest_pa, entry, (addr_t)shared | DEMAND_PAGE_SHARED) == -1) {
+    *entry = shared->host_addr;
+    V3_Free(shared);
+    return NULL;
+  }
+
+  add_shared_page(shared_pages, hash, shared);
+
+  cand->info->dedup.stats.pages_shared++;
+
+  return shared;
+}
+
+
+static int dedup_page(struct guest_info * info, struct shadow_region * reg, addr_t guest_pa) {
+  addr_t * entry = get_demand_page_entry(reg, guest_pa);
+  struct shared_page * shared = NULL;
+  struct dedup_candidate * cand = NULL;
+  uchar_t * contents = NULL;
+  ulong_t hash = 0;
+
+  // Pages that were never written or are already shared
+  if ((*entry == 0) || (*entry & DEMAND_PAGE_SHARED)) {
+    return 0;
+  }
+
+  contents = V3_VAddr((void *)*entry);
+  hash = hash_buffer(contents, PAGE_SIZE);
+
+  if ((hash == zero_page_hash) && 
+      (memcmp(contents, V3_VAddr((void *)get_zero_page()), PAGE_SIZE) == 0)) {
+    addr_t old_page = *entry;
+
+    if (set_demand_page(info, guest_pa, entry, 0) == -1) {
+      return -1;
+    }
+
+    V3_FreePage((void *)old_page);
+
+    info->dedup.stats.pages_zeroed++;
+    info->dedup.stats.pages_saved++;
+
+    return 0;
+  }
+
+  shared = find_shared_page(shared_pages, hash);
+
+  if (shared != NULL) {
+    if (memcmp(contents, V3_VAddr((void *)(shared->host_addr)), PAGE_SIZE) != 0) {
+      return 0;
+    }
+
+    return merge_page(info, guest_pa, entry, shared);
+  }
+
+  cand = find_dedup_candidate(candidates, hash);
+
+  if (cand == NULL) {
+    cand = (struct dedup_candidate *)V3_Malloc(sizeof(struct dedup_candidate));
+
+    if (cand == NULL) {
+      PrintError("Could not allocate page merging candidate\n");
+      return -1;
+    }
+
+    cand->info = info;
+    cand->guest_pa = guest_pa;
+
+    add_dedup_candidate(candidates, hash, cand);
+
+    return 0;
+  } 
+
+  if ((cand->info == info) && (cand->guest_pa == guest_pa)) {
+    return 0;
+  }
+
+  shared = share_candidate(cand, hash, contents);
+
+  if (shared == NULL) {
+    // The candidate is stale, this page takes its place
+    cand->info = info;
+    cand->guest_pa = guest_pa;
+
+    return 0;
+  }
+
+  del_dedup_candidate(candidates, hash);
+  V3_Free(cand);
+
+  return merge_page(info, guest_pa, entry, shared);
+}
+
+
+int v3_dedup_scan(struct guest_info * info, uint_t max_pages) {
+  struct v3_dedup_state * dedup = &(info->dedup);
+  struct shadow_map * map = &(info->mem_map);
+  uint_t scanned = 0;
+
+  if (dedup->enabled == 0) {
+    return 0;
+  }
+
+  if (init_dedup_tables() == -1) {
+    return -1;
+  }
+
+  while (scanned < max_pages) {
+    struct shadow_region * reg = get_next_shadow_region(map, dedup->scan_addr);
+
+    // Only demand allocated memory can be remapped a page at a time
+    while ((reg != NULL) && (reg->host_type != HOST_REGION_UNALLOCATED)) {
+      reg = get_next_shadow_region(map, reg->guest_end);
+    }
+
+    if (reg == NULL) {
+      // End of a pass, candidates that did not match anything are forgotten
+      dedup->scan_addr = 0;
+      dedup->stats.full_scans++;
+
+      hashtable_destroy(candidates, 1, 0);
+      candidates = NULL;
+
+      break;
+    }
+
+    if (dedup->scan_addr < reg->guest_start) {
+      dedup->scan_addr = reg->guest_start;
+    }
+
+    if (dedup_page(info, reg, dedup->scan_addr) == -1) {
+      PrintError("Could not merge guest page %p\n", (void *)(dedup->scan_addr));
+      return -1;
+    }
+
+    dedup->scan_addr += PAGE_SIZE;
+    dedup->stats.pages_scanned++;
+    scanned++;
+  }
+
+  return 0;
+}
+
+
+addr_t v3_unshare_page(struct guest_info * info, struct shared_page * shared) {
+  struct v3_dedup_stats * stats = &(info->dedup.stats);
+  addr_t page = 0;
+
+  stats->pages_shared--;
+  stats->pages_unshared++;
+
+  if (shared->ref_count == 1) {
+    // Last user, it takes the page over
+    if (find_shared_page(shared_pages, shared->hash) == shared) {
+      del_shared_page(shared_pages, shared->hash);
+    }
+
+    page = shared->host_addr;
+    V3_Free(shared);
+
+    return page;
+  }
+
+  page = (addr_t)V3_AllocPages(1);
+
+  if (page == 0) {
+    PrintError("Could not allocate page to unshare\n");
+    return 0;
+  }
+
+  memcpy(V3_VAddr((void *)page), V3_VAddr((void *)(shared->host_addr)), PAGE_SIZE);
+
+  shared->ref_count--;
+  stats->pages_saved--;
+
+  return page;
+}
+
+
+void v3_put_shared_page(struct guest_info * info, struct shared_page * shared) {
+  struct v3_dedup_stats * stats = &(info->dedup.stats);
+
+  stats->pages_shared--;
+
+  if (shared->ref_count == 1) {
+    if (find_shared_page(shared_pages, shared->hash) == shared) {
+      del_shared_page(shared_pages, shared->hash);
+    }
+
+    V3_FreePage((void *)(shared->host_addr));
+    V3_Free(shared);
+    return;
+  }
+
+  shared->ref_count--;
+  stats->pages_saved--;
+}
+
+
+void v3_get_dedup_stats(struct guest_info * info, struct v3_dedup_stats * stats) {
+  *stats = info->dedup.stats;
+}
+
+
+void v3_print_dedup_stats(struct guest_info * info) {
+  if (info->dedup.enabled == 0) {
+    return;
+  }
+
+  PrintDebug("Page Merging Statistics:\n");
+  PrintDebug("\tscanned=%llu (full passes=%d)\n", 
+	     info->dedup.stats.pages_scanned, info->dedup.stats.full_scans);
+  PrintDebug("\tshared=%d, saved=%d\n", 
+	     info->dedup.stats.pages_shared, info->dedup.stats.pages_saved);
+  PrintDebug("\tmerged=%d, unshared=%d, zeroed=%d\n", 
+	     info->dedup.stats.pages_merged, info->dedup.stats.pages_unshared, 
+	     info->dedup.stats.pages_zeroed);
+}
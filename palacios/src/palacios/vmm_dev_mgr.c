@@ -36,7 +36,7 @@ int v3_init_dev_mgr(struct guest_info * info) {
   INIT_LIST_HEAD(&(mgr->dev_list));
   mgr->num_devs = 0;
 
-  INIT_LIST_HEAD(&(mgr->io_hooks));
+  memset(&(mgr->io_hooks), 0, sizeof(struct v3_port_table));
   mgr->num_io_hooks = 0;
 
   return 0;
@@ -53,6 +53,8 @@ int v3_dev_mgr_deinit(struct guest_info * info) {
     v3_free_device(dev);
   }
 
+  v3_port_table_free(&(mgr->io_hooks));
+
   return 0;
 }
 
@@ -77,14 +79,20 @@ static int dev_mgr_remove_device(struct vmm_dev_mgr * mgr, struct vm_device * de
 
 /* IO HOOKS */
 static int dev_mgr_add_io_hook(struct vmm_dev_mgr * mgr, struct dev_io_hook * hook) {
-  list_add(&(hook->mgr_list), &(mgr->io_hooks));
+  if (v3_port_table_insert_range(&(mgr->io_hooks), hook->port, hook->end_port, hook) == -1) {
+    return -1;
+  }
+
   mgr->num_io_hooks++;
   return 0;
 }
 
 
 static int dev_mgr_remove_io_hook(struct vmm_dev_mgr * mgr, struct dev_io_hook * hook) {
-  list_del(&(hook->mgr_list));
+  if (v3_port_table_remove_range(&(mgr->io_hooks), hook->port, hook->end_port, hook) == -1) {
+    return -1;
+  }
+
   mgr->num_io_hooks--;
 
   return 0;
@@ -110,14 +118,7 @@ static int dev_remove_io_hook(struct vm_device * dev, struct dev_io_hook * hook)
 
 
 static struct dev_io_hook * dev_mgr_find_io_hook(struct vmm_dev_mgr * mgr, ushort_t port) {
-  struct dev_io_hook * tmp = NULL;
-
-  list_for_each_entry(tmp, &(mgr->io_hooks), mgr_list) {
-    if (tmp->port == port) {
-      return tmp;
-    }
-  }
-  return NULL;
+  return (struct dev_io_hook *)v3_port_table_lookup(&(mgr->io_hooks), port);
 }
 
 
@@ -140,32 +141,84 @@ int v3_dev_hook_io(struct vm_device   *dev,
 		   ushort_t            port,
 		   int (*read)(ushort_t port, void * dst, uint_t length, struct vm_device * dev),
 		   int (*write)(ushort_t port, void * src, uint_t length, struct vm_device * dev)) {
+  return v3_dev_hook_io_range(dev, port, port, read, write);
+}
+
+
+/* Records a port range that is already hooked in the VM's IO map as belonging to dev */
+static int dev_track_io_hook(struct vm_device   *dev,
+			     ushort_t            start,
+			     ushort_t            end,
+			     int (*read)(ushort_t port, void * dst, uint_t length, struct vm_device * dev),
+			     int (*write)(ushort_t port, void * src, uint_t length, struct vm_device * dev)) {
   
   struct dev_io_hook *hook = (struct dev_io_hook *)V3_Malloc(sizeof(struct dev_io_hook));
   
   if (!hook) { 
+    v3_unhook_io_port(dev->vm, start);
     return -1;
   }
 
+  hook->dev = dev;
+  hook->port = start;
+  hook->end_port = end;
+  hook->read = read;
+  hook->write = write;
+    
+  if (dev_mgr_add_io_hook(&(dev->vm->dev_mgr), hook) == -1) {
+    v3_unhook_io_port(dev->vm, start);
+    V3_Free(hook);
+    return -1;
+  }
 
-  if (v3_hook_io_port(dev->vm, port, 
-		      (int (*)(ushort_t, void *, uint_t, void *))read, 
-		      (int (*)(ushort_t, void *, uint_t, void *))write, 
-		      (void *)dev) == 0) {
+  dev_add_io_hook(dev, hook);
+
+  return 0;
+}
 
-    hook->dev = dev;
-    hook->port = port;
-    hook->read = read;
-    hook->write = write;
-    
-    dev_mgr_add_io_hook(&(dev->vm->dev_mgr), hook);
-    dev_add_io_hook(dev, hook);
-  } else {
 
+int v3_dev_hook_io_range(struct vm_device   *dev,
+			 ushort_t            start,
+			 ushort_t            end,
+			 int (*read)(ushort_t port, void * dst, uint_t length, struct vm_device * dev),
+			 int (*write)(ushort_t port, void * src, uint_t length, struct vm_device * dev)) {
+
+  if (v3_hook_io_port_range(dev->vm, start, end, 
+			    (int (*)(ushort_t, void *, uint_t, void *))read, 
+			    (int (*)(ushort_t, void *, uint_t, void *))write, 
+			    (void *)dev) == -1) {
     return -1;
   }
 
-  return 0;
+  return dev_track_io_hook(dev, start, end, read, write);
+}
+
+
+int v3_dev_passthrough_io_range(struct vm_device   *dev,
+				ushort_t            start,
+				ushort_t            end) {
+
+  if (v3_passthrough_io_port_range(dev->vm, start, end, (void *)dev) == -1) {
+    return -1;
+  }
+
+  return dev_track_io_hook(dev, start, end, NULL, NULL);
+}
+
+
+int v3_dev_hook_io_str(struct vm_device   *dev,
+		       ushort_t            port,
+		       int (*read_str)(ushort_t port, void * dst, uint_t length, uint_t count, struct vm_device * dev),
+		       int (*write_str)(ushort_t port, void * src, uint_t length, uint_t count, struct vm_device * dev)) {
+  struct dev_io_hook * hook = dev_mgr_find_io_hook(&(dev->vm->dev_mgr), port);
+
+  if ((!hook) || (hook->dev != dev)) {
+    return -1;
+  }
+
+  return v3_hook_io_port_str(dev->vm, port, 
+			     (int (*)(ushort_t, void *, uint_t, uint_t, void *))read_str, 
+			     (int (*)(ushort_t, void *, uint_t, uint_t, void *))write_str);
 }
 
 
@@ -175,12 +228,13 @@ int v3_dev_unhook_io(struct vm_device   *dev,
   struct vmm_dev_mgr * mgr = &(dev->vm->dev_mgr);
   struct dev_io_hook * hook = dev_mgr_find_io_hook(mgr, port);
 
-  if (!hook) { 
+  if ((!hook) || (hook->port != port) || (hook->dev != dev)) { 
     return -1;
   }
 
   dev_mgr_remove_io_hook(mgr, hook);
   dev_remove_io_hook(dev, hook);
+  V3_Free(hook);
 
   return v3_unhook_io_port(dev->vm, port);
 }
@@ -300,7 +354,7 @@ void PrintDebugDevIO(struct vm_device * dev) {
   PrintDebug("IO Hooks(%d)  for Device: %s\n", dev->num_io_hooks,  dev->name);
 
   list_for_each_entry(hook, &(dev->io_hooks), dev_list) {
-    PrintDebug("\tPort: 0x%x (read=0x%p), (write=0x%p)\n", hook->port, 
+    PrintDebug("\tPort: 0x%x-0x%x (read=0x%p), (write=0x%p)\n", hook->port, hook->end_port, 
 	       (void *)(addr_t)(hook->read), 
 	       (void *)(addr_t)(hook->write));
   }
@@ -0,0 +1,301 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#include <palacios/vmm_dirty_log.h>
+#include <palacios/vmm.h>
+#include <palacios/vm_guest.h>
+#include <palacios/vmm_mem.h>
+#include <palacios/vmm_paging.h>
+#include <palacios/vmm_shadow_paging.h>
+#include <palacios/vmm_checkpoint.h>
+
+
+/* 
+ * Dirty page logging
+ *
+ * While the log is on, guest RAM is mapped read only until the first write to a page since the log was last read.
+ * That write sets the page's bit and maps the page writable again,
+ * so a page costs at most one extra fault each time the log is read.
+ * Shadow PTEs are write protected through the reverse map, passthrough PTEs are cleared in place.
+ */
+
+
+// Guest RAM, as a checkpoint sees it: hooked memory traps into the VMM anyway, 
+// and identity mapped host devices (PCI, VGA) are not guest state
+static int is_logged_region(struct shadow_region * reg) {
+  return v3_chkpt_is_guest_ram(reg);
+}
+
+
+// Bitmaps are only allocated once a region is written
+static struct dirty_bitmap * get_dirty_bitmap(struct shadow_region * reg) {
+  struct dirty_bitmap * bitmap = reg->dirty_log;
+  uint_t num_pages = 0;
+  uint_t num_bytes = 0;
+
+  if (bitmap != NULL) {
+    return bitmap;
+  }
+
+  num_pages = ((PAGE_ADDR(reg->guest_end - 1) - PAGE_ADDR(reg->guest_start)) >> PAGE_POWER) + 1;
+  num_bytes = (num_pages + 7) / 8;
+
+  bitmap = (struct dirty_bitmap *)V3_Malloc(sizeof(struct dirty_bitmap) + num_bytes);
+
+  if (bitmap == NULL) {
+    PrintError("Could not allocate dirty bitmap for %d pages\n", num_pages);
+    return NULL;
+  }
+
+  bitmap->guest_base = PAGE_ADDR(reg->guest_start);
+  bitmap->num_pages = num_pages;
+  bitmap->ref_count = 1;
+  bitmap->bits = (uchar_t *)(bitmap + 1);
+
+  memset(bitmap->bits, 0, num_bytes);
+
+  reg->dirty_log = bitmap;
+
+  return bitmap;
+}
+
+
+void v3_put_dirty_bitmap(struct shadow_region * reg) {
+  struct dirty_bitmap * bitmap = reg->dirty_log;
+
+  if (bitmap == NULL) {
+    return;
+  }
+
+  reg->dirty_log = NULL;
+  bitmap->ref_count--;
+
+  if (bitmap->ref_count == 0) {
+    V3_Free(bitmap);
+  }
+}
+
+
+static inline uint_t dirty_bit_index(struct dirty_bitmap * bitmap, addr_t guest_pa) {
+  return (PAGE_ADDR(guest_pa) - bitmap->guest_base) >> PAGE_POWER;
+}
+
+static inline int is_page_dirty(struct dirty_bitmap * bitmap, addr_t guest_pa) {
+  uint_t index = dirty_bit_index(bitmap, guest_pa);
+
+  return ((bitmap->bits[index / 8] & (1 << (index % 8))) != 0);
+}
+
+
+
+void v3_init_dirty_log(struct guest_info * info) {
+  struct v3_dirty_log_state * log = &(info->dirty_log);
+
+  memset(log, 0, sizeof(struct v3_dirty_log_state));
+}
+
+
+int v3_dirty_log_writable(struct guest_info * info, addr_t guest_pa) {
+  struct shadow_region * reg = NULL;
+
+  if (info->dirty_log.enabled == 0) {
+    return 1;
+  }
+
+  reg = get_shadow_region_by_addr(&(info->mem_map), guest_pa);
+
+  if ((reg == NULL) || (is_logged_region(reg) == 0)) {
+    return 1;
+  }
+
+  if (reg->dirty_log == NULL) {
+    return 0;
+  }
+
+  return is_page_dirty(reg->dirty_log, guest_pa);
+}
+
+
+int v3_mark_page_dirty(struct guest_info * info, addr_t guest_pa) {
+  struct v3_dirty_log_state * log = &(info->dirty_log);
+  struct shadow_region * reg = NULL;
+  struct dirty_bitmap * bitmap = NULL;
+  uint_t index = 0;
+
+  if (log->enabled == 0) {
+    return 0;
+  }
+
+  reg = get_shadow_region_by_addr(&(info->mem_map), guest_pa);
+
+  if ((reg == NULL) || (is_logged_region(reg) == 0)) {
+    return 0;
+  }
+
+  bitmap = get_dirty_bitmap(reg);
+
+  if (bitmap == NULL) {
+    return -1;
+  }
+
+  index = dirty_bit_index(bitmap, guest_pa);
+
+  if ((bitmap->bits[index / 8] & (1 << (index % 8))) == 0) {
+    bitmap->bits[index / 8] |= (1 << (index % 8));
+    log->num_dirty++;
+  }
+
+  return 0;
+}
+
+
+int v3_handle_dirty_log_fault(struct guest_info * info, addr_t guest_pa) {
+  PrintDebug("Dirty log write fault on %p\n", (void *)guest_pa);
+
+  if (v3_mark_page_dirty(info, guest_pa) == -1) {
+    return -1;
+  }
+
+  return v3_unprotect_passthrough_page(info, guest_pa);
+}
+
+
+
+// The next write to a page in [guest_start, guest_end) faults
+static int write_protect_pages(struct guest_info * info, addr_t guest_start, addr_t guest_end) {
+  v3_write_protect_shadow_mappings(info, guest_start, guest_end);
+
+  return v3_protect_passthrough_pages(info, guest_start, guest_end);
+}
+
+
+int v3_enable_dirty_log(struct guest_info * info) {
+  struct v3_dirty_log_state * log = &(info->dirty_log);
+  struct shadow_map * map = &(info->mem_map);
+  uint_t i = 0;
+
+  if (log->enabled == 1) {
+    return 0;
+  }
+
+  log->enabled = 1;
+  log->num_dirty = 0;
+
+  for (i = 0; i < map->num_regions; i++) {
+    struct shadow_region * reg = map->regions[i];
+
+    if (is_logged_region(reg) == 0) {
+      continue;
+    }
+
+    if (write_protect_pages(info, reg->guest_start, reg->guest_end) == -1) {
+      PrintError("Could not write protect region %p-%p\n", 
+		 (void *)(reg->guest_start), (void *)(reg->guest_end));
+      v3_disable_dirty_log(info);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+int v3_disable_dirty_log(struct guest_info * info) {
+  struct v3_dirty_log_state * log = &(info->dirty_log);
+  struct shadow_map * map = &(info->mem_map);
+  uint_t i = 0;
+
+  if (log->enabled == 0) {
+    return 0;
+  }
+
+  log->enabled = 0;
+  log->num_dirty = 0;
+
+  for (i = 0; i < map->num_regions; i++) {
+    struct shadow_region * reg = map->regions[i];
+
+    v3_put_dirty_bitmap(reg);
+
+    // Shadow PTEs left read only are made writable by their next write fault
+    if ((is_logged_region(reg) == 1) && 
+	(v3_update_passthrough_pts(info, reg->guest_start, reg->guest_end) == -1)) {
+      PrintError("Could not remap region %p-%p\n", 
+		 (void *)(reg->guest_start), (void *)(reg->guest_end));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+int v3_get_and_clear_dirty_log(struct guest_info * info, unsigned long guest_start, 
+			       unsigned int num_pages, unsigned char * bitmap) {
+  struct v3_dirty_log_state * log = &(info->dirty_log);
+  addr_t run_start = 0;
+  uint_t run_pages = 0;
+  int num_dirty = 0;
+  uint_t i = 0;
+
+  if (log->enabled == 0) {
+    PrintError("Dirty page logging is not enabled\n");
+    return -1;
+  }
+
+  memset(bitmap, 0, (num_pages + 7) / 8);
+
+  // Consecutive dirty pages are protected together, so a run within a 4MB range rebuilds its passthrough PDE once
+  for (i = 0; i <= num_pages; i++) {
+    addr_t guest_pa = PAGE_ADDR(guest_start) + (i * PAGE_SIZE);
+    struct shadow_region * reg = NULL;
+
+    if (i < num_pages) {
+      reg = get_shadow_region_by_addr(&(info->mem_map), guest_pa);
+
+      if ((reg != NULL) && (reg->dirty_log != NULL) && (is_page_dirty(reg->dirty_log, guest_pa))) {
+	uint_t index = dirty_bit_index(reg->dirty_log, guest_pa);
+
+	reg->dirty_log->bits[index / 8] &= ~(1 << (index % 8));
+	log->num_dirty--;
+
+	bitmap[i / 8] |= (1 << (i % 8));
+	num_dirty++;
+
+	if (run_pages == 0) {
+	  run_start = guest_pa;
+	}
+
+	run_pages++;
+	continue;
+      }
+    }
+
+    if (run_pages > 0) {
+      if (write_protect_pages(info, run_start, run_start + (run_pages * PAGE_SIZE)) == -1) {
+	PrintError("Could not write protect dirty pages at %p\n", (void *)run_start);
+	return -1;
+      }
+
+      run_pages = 0;
+    }
+  }
+
+  return num_dirty;
+}
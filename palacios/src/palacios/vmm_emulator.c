@@ -108,9 +108,9 @@ static int set_stepping(struct guest_info * info) {
   vmcb_ctrl_t * ctrl_area = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
   ctrl_area->exceptions.db = 1;
 
-  info->emulator.tf_enabled = ((struct rflags *)&(info->ctrl_regs.rflags))->tf;
+  info->emulator.tf_enabled = ((struct rflags *)&(v3_get_ctrl_regs(info)->rflags))->tf;
 
-  ((struct rflags *)&(info->ctrl_regs.rflags))->tf = 1;
+  ((struct rflags *)&(v3_mod_ctrl_regs(info)->rflags))->tf = 1;
 
   return 0;
 }
@@ -120,7 +120,7 @@ static int unset_stepping(struct guest_info * info) {
   vmcb_ctrl_t * ctrl_area = GET_VMCB_CTRL_AREA((vmcb_t*)(info->vmm_data));
   ctrl_area->exceptions.db = 0;
 
-  ((struct rflags *)&(info->ctrl_regs.rflags))->tf = info->emulator.tf_enabled;
+  ((struct rflags *)&(v3_mod_ctrl_regs(info)->rflags))->tf = info->emulator.tf_enabled;
 
   if (info->emulator.tf_enabled) {
     // Inject breakpoint exception into guest
@@ -149,9 +149,9 @@ int v3_emulate_memory_read(struct guest_info * info, addr_t read_gva,
   PrintDebug("Emulating Read\n");
 
   if (info->mem_mode == PHYSICAL_MEM) { 
-    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
   } else { 
-    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
   }
 
   if (ret == -1) {
@@ -240,9 +240,9 @@ int v3_emulate_memory_write(struct guest_info * info, addr_t write_gva,
   PrintDebug("Emulating Write for instruction at 0x%p\n", (void *)(addr_t)(info->rip));
 
   if (info->mem_mode == PHYSICAL_MEM) { 
-    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+    ret = read_guest_pa_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
   } else { 
-    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+    ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
   }
 
 
@@ -0,0 +1,185 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#include <palacios/vmm_exit_stats.h>
+#include <palacios/vmm.h>
+#include <palacios/svm_handler.h>
+
+
+static inline uint_t cycles_to_bucket(ullong_t cycles) {
+  uint_t hi = (uint_t)(cycles >> 32);
+  uint_t lo = (uint_t)cycles;
+  uint_t bucket = 0;
+
+  if (hi) {
+    // Anything above 2^31 cycles lands in the last bucket
+    return V3_EXIT_HIST_BUCKETS - 1;
+  } else if (lo) {
+    bucket = 31 - __builtin_clz(lo);
+  }
+
+  return bucket;
+}
+
+
+int v3_init_exit_stats(struct guest_info * info) {
+  struct v3_exit_stats * stats = &(info->exit_stats);
+
+  stats->num_slots = VMEXIT_NUM_SLOTS;
+  stats->slots = (struct v3_exit_stat *)V3_Malloc(sizeof(struct v3_exit_stat) * stats->num_slots);
+
+  if (stats->slots == NULL) {
+    PrintError("Could not allocate exit statistics table\n");
+    stats->num_slots = 0;
+    return -1;
+  }
+
+  memset(stats->slots, 0, sizeof(struct v3_exit_stat) * stats->num_slots);
+
+  return 0;
+}
+
+
+void v3_record_exit(struct guest_info * info, uint_t exit_code, 
+		    ullong_t hw_cycles, ullong_t vmm_cycles) {
+  struct v3_exit_stats * stats = &(info->exit_stats);
+  struct v3_exit_stat * stat = NULL;
+
+  if (stats->slots == NULL) {
+    return;
+  }
+
+  stat = &(stats->slots[v3_svm_exit_slot(exit_code)]);
+
+  stat->count++;
+  stat->hw_cycles += hw_cycles;
+  stat->vmm_cycles += vmm_cycles;
+
+  if (hw_cycles > stat->max_hw_cycles) {
+    stat->max_hw_cycles = hw_cycles;
+  }
+
+  if (vmm_cycles > stat->max_vmm_cycles) {
+    stat->max_vmm_cycles = vmm_cycles;
+  }
+
+  stat->hw_hist[cycles_to_bucket(hw_cycles)]++;
+  stat->vmm_hist[cycles_to_bucket(vmm_cycles)]++;
+}
+
+
+
+int v3_get_exit_stats(struct guest_info * info, unsigned int exit_code, struct v3_exit_stat * stat) {
+  struct v3_exit_stats * stats = &(info->exit_stats);
+
+  if (stats->slots == NULL) {
+    PrintError("Exit statistics are not initialized\n");
+    return -1;
+  }
+
+  memcpy(stat, &(stats->slots[v3_svm_exit_slot(exit_code)]), sizeof(struct v3_exit_stat));
+
+  return 0;
+}
+
+
+void v3_reset_exit_stats(struct guest_info * info) {
+  struct v3_exit_stats * stats = &(info->exit_stats);
+
+  if (stats->slots == NULL) {
+    return;
+  }
+
+  memset(stats->slots, 0, sizeof(struct v3_exit_stat) * stats->num_slots);
+}
+
+
+/* Printing compiles away without VMM_DEBUG, and so do its helpers */
+#ifdef VMM_DEBUG
+
+static uint_t slot_to_exit_code(uint_t slot) {
+  switch (slot) {
+  case VMEXIT_NPF_SLOT:
+    return VMEXIT_NPF;
+  case VMEXIT_INVALID_VMCB_SLOT:
+    return VMEXIT_INVALID_VMCB;
+  default:
+    return slot;
+  }
+}
+
+
+static const char * exit_slot_name(uint_t slot) {
+  const uchar_t * name = NULL;
+
+  if (slot == VMEXIT_UNKNOWN_SLOT) {
+    return "VMEXIT_UNKNOWN";
+  }
+
+  name = vmexit_code_to_str(slot_to_exit_code(slot));
+
+  return (name) ? (const char *)name : "VMEXIT_RESERVED";
+}
+
+
+static void print_hist(const char * name, unsigned int * hist) {
+  int i = 0;
+
+  for (i = 0; i < V3_EXIT_HIST_BUCKETS; i++) {
+    if (hist[i] == 0) {
+      continue;
+    }
+
+    PrintDebug("\t\t%s [2^%d cycles]: %u\n", name, i, hist[i]);
+  }
+}
+
+
+#endif
+
+
+void v3_print_exit_stats(struct guest_info * info) {
+#ifdef VMM_DEBUG
+  struct v3_exit_stats * stats = &(info->exit_stats);
+  uint_t i = 0;
+
+  if (stats->slots == NULL) {
+    return;
+  }
+
+  PrintDebug("VM Exit Statistics:\n");
+
+  for (i = 0; i < stats->num_slots; i++) {
+    struct v3_exit_stat * stat = &(stats->slots[i]);
+
+    if (stat->count == 0) {
+      continue;
+    }
+
+    PrintDebug("\t%s: count=%llu, hw_cycles=%llu (max=%llu), vmm_cycles=%llu (max=%llu)\n", 
+	       exit_slot_name(i), 
+	       stat->count, 
+	       stat->hw_cycles, stat->max_hw_cycles,
+	       stat->vmm_cycles, stat->max_vmm_cycles);
+
+    print_hist("hw", stat->hw_hist);
+    print_hist("vmm", stat->vmm_hist);
+  }
+#endif
+}
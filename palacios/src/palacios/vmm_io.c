@@ -32,77 +32,172 @@
 
 static int default_write(ushort_t port, void *src, uint_t length, void * priv_data);
 static int default_read(ushort_t port, void * dst, uint_t length, void * priv_data);
+static int passthrough_write(ushort_t port, void * src, uint_t length, void * priv_data);
+static int passthrough_read(ushort_t port, void * dst, uint_t length, void * priv_data);
+static int hook_io_ports(struct guest_info * info, uint_t start, uint_t end, uint_t type,
+			 int (*read)(ushort_t port, void * dst, uint_t length, void * priv_data),
+			 int (*write)(ushort_t port, void * src, uint_t length, void * priv_data), 
+			 void * priv_data);
 
 
-void v3_init_vmm_io_map(struct guest_info * info) {
+// Without the bitmap the guest would get every host port, so the guest can't be set up
+int v3_init_vmm_io_map(struct guest_info * info) {
   struct vmm_io_map * io_map = &(info->io_map);
+  void * bitmap_pa = NULL;
+
   io_map->num_ports = 0;
-  io_map->head = NULL;
-}
+  memset(&(io_map->ports), 0, sizeof(struct v3_port_table));
 
+  bitmap_pa = V3_AllocPages(IO_BITMAP_PAGES);
 
+  if (bitmap_pa == NULL) {
+    PrintError("Could not allocate IO permission bitmap\n");
+    io_map->io_bitmap = NULL;
+    return -1;
+  }
 
+  io_map->io_bitmap = (uchar_t *)V3_VAddr(bitmap_pa);
+  memset(io_map->io_bitmap, 0, PAGE_SIZE * IO_BITMAP_PAGES);
 
+  return 0;
+}
 
-static int add_io_hook(struct vmm_io_map * io_map, struct vmm_io_hook * io_hook) {
 
-  if (!(io_map->head)) {
-    io_map->head = io_hook;
-    io_map->num_ports = 1;
-    return 0;
-  } else if (io_map->head->port > io_hook->port) {
-    io_hook->next = io_map->head;
+/* Sets (trap) or clears (no exit) the IO bitmap bits for [start, end] */
+static void update_io_bitmap(struct vmm_io_map * io_map, ushort_t start, ushort_t end, int trap) {
+  uint_t port = 0;
 
-    io_map->head->prev = io_hook;
-    io_map->head = io_hook;
-    io_map->num_ports++;
+  if (io_map->io_bitmap == NULL) {
+    return;
+  }
 
-    return 0;
-  } else {
-    struct vmm_io_hook * tmp_hook = io_map->head;
-    
-    while ((tmp_hook->next)  && 
-	   (tmp_hook->next->port <= io_hook->port)) {
-	tmp_hook = tmp_hook->next;
+  for (port = start; port <= end; port++) {
+    if (trap) {
+      io_map->io_bitmap[port / 8] |= (1 << (port % 8));
+    } else {
+      io_map->io_bitmap[port / 8] &= ~(1 << (port % 8));
     }
-    
-    if (tmp_hook->port == io_hook->port) {
-      //tmp_hook->read = io_hook->read;
-      //tmp_hook->write = io_hook->write;
-      //V3_Free(io_hook);
+  }
+}
+
+
+
+
+int v3_port_table_insert(struct v3_port_table * table, ushort_t port, void * entry) {
+  void ** leaf = table->dir[IO_PORT_DIR_INDEX(port)];
+
+  if (leaf == NULL) {
+    leaf = (void **)V3_Malloc(sizeof(void *) * IO_PORT_LEAF_ENTRIES);
+
+    if (leaf == NULL) {
+      PrintError("Could not allocate port table leaf\n");
       return -1;
-    } else {
-      io_hook->prev = tmp_hook;
-      io_hook->next = tmp_hook->next;
+    }
+
+    memset(leaf, 0, sizeof(void *) * IO_PORT_LEAF_ENTRIES);
+    table->dir[IO_PORT_DIR_INDEX(port)] = leaf;
+  }
+
+  if (leaf[IO_PORT_LEAF_INDEX(port)] != NULL) {
+    return -1;
+  }
+
+  leaf[IO_PORT_LEAF_INDEX(port)] = entry;
+
+  return 0;
+}
+
+
+void * v3_port_table_remove(struct v3_port_table * table, ushort_t port) {
+  void ** leaf = table->dir[IO_PORT_DIR_INDEX(port)];
+  void * entry = NULL;
+
+  if (leaf == NULL) {
+    return NULL;
+  }
+
+  entry = leaf[IO_PORT_LEAF_INDEX(port)];
+  leaf[IO_PORT_LEAF_INDEX(port)] = NULL;
+
+  return entry;
+}
 
-      if (tmp_hook->next) {
-	tmp_hook->next->prev = io_hook;
+
+/* Store the same entry in every slot of [start, end] 
+ * Either all of the ports are inserted or none are
+ */
+int v3_port_table_insert_range(struct v3_port_table * table, ushort_t start, ushort_t end, void * entry) {
+  uint_t port = 0;
+
+  for (port = start; port <= end; port++) {
+    if (v3_port_table_insert(table, port, entry) == -1) {
+      uint_t i = 0;
+
+      for (i = start; i < port; i++) {
+	v3_port_table_remove(table, i);
       }
 
-      tmp_hook->next = io_hook;
+      return -1;
+    }
+  }
+
+  return 0;
+}
 
-      io_map->num_ports++;
-      return 0;
+
+int v3_port_table_remove_range(struct v3_port_table * table, ushort_t start, ushort_t end, void * entry) {
+  uint_t port = 0;
+
+  for (port = start; port <= end; port++) {
+    if (v3_port_table_lookup(table, port) != entry) {
+      return -1;
     }
   }
-  return -1;
+
+  for (port = start; port <= end; port++) {
+    v3_port_table_remove(table, port);
+  }
+
+  return 0;
 }
 
-static int remove_io_hook(struct vmm_io_map * io_map, struct vmm_io_hook * io_hook) {
-  if (io_map->head == io_hook) {
-    io_map->head = io_hook->next;
-  } else if (io_hook->prev) {
-    io_hook->prev->next = io_hook->next;
-  } else {
+
+void v3_port_table_free(struct v3_port_table * table) {
+  int i = 0;
+
+  for (i = 0; i < IO_PORT_DIR_ENTRIES; i++) {
+    if (table->dir[i]) {
+      V3_Free(table->dir[i]);
+      table->dir[i] = NULL;
+    }
+  }
+}
+
+
+
+static int add_io_hook(struct vmm_io_map * io_map, struct vmm_io_hook * io_hook) {
+
+  if (v3_port_table_insert_range(&(io_map->ports), io_hook->port, io_hook->end_port, io_hook) == -1) {
     return -1;
-    // data corruption failure
   }
-  
-  if (io_hook->next) {
-    io_hook->next->prev = io_hook->prev;
+
+  update_io_bitmap(io_map, io_hook->port, io_hook->end_port, 
+		   (io_hook->type == V3_IO_HOOK_TRAP));
+
+  io_map->num_ports += io_hook->end_port - io_hook->port + 1;
+  return 0;
+}
+
+static int remove_io_hook(struct vmm_io_map * io_map, struct vmm_io_hook * io_hook) {
+  if (v3_port_table_remove_range(&(io_map->ports), io_hook->port, io_hook->end_port, io_hook) == -1) {
+    // data corruption failure
+    return -1;
   }
 
-  io_map->num_ports--;
+  // Unhooked ports go straight to the hardware
+  update_io_bitmap(io_map, io_hook->port, io_hook->end_port, 0);
+
+  io_map->num_ports -= io_hook->end_port - io_hook->port + 1;
 
   return 0;
 }
@@ -115,10 +210,41 @@ int v3_hook_io_port(struct guest_info * info, uint_t port,
 		    int (*read)(ushort_t port, void * dst, uint_t length, void * priv_data),
 		    int (*write)(ushort_t port, void * src, uint_t length, void * priv_data), 
 		    void * priv_data) {
+  return v3_hook_io_port_range(info, port, port, read, write, priv_data);
+}
+
+
+int v3_hook_io_port_range(struct guest_info * info, uint_t start, uint_t end, 
+			  int (*read)(ushort_t port, void * dst, uint_t length, void * priv_data),
+			  int (*write)(ushort_t port, void * src, uint_t length, void * priv_data), 
+			  void * priv_data) {
+  return hook_io_ports(info, start, end, V3_IO_HOOK_TRAP, read, write, priv_data);
+}
+
+
+int v3_passthrough_io_port_range(struct guest_info * info, uint_t start, uint_t end, void * priv_data) {
+  return hook_io_ports(info, start, end, V3_IO_HOOK_PASSTHROUGH, 
+		       &passthrough_read, &passthrough_write, priv_data);
+}
+
+
+static int hook_io_ports(struct guest_info * info, uint_t start, uint_t end, uint_t type,
+			 int (*read)(ushort_t port, void * dst, uint_t length, void * priv_data),
+			 int (*write)(ushort_t port, void * src, uint_t length, void * priv_data), 
+			 void * priv_data) {
   struct vmm_io_map * io_map = &(info->io_map);
-  struct vmm_io_hook * io_hook = (struct vmm_io_hook *)V3_Malloc(sizeof(struct vmm_io_hook));
+  struct vmm_io_hook * io_hook = NULL;
 
-  io_hook->port = port;
+  if ((start > end) || (end > 0xffff)) {
+    PrintError("Invalid IO port range %x-%x\n", start, end);
+    return -1;
+  }
+
+  io_hook = (struct vmm_io_hook *)V3_Malloc(sizeof(struct vmm_io_hook));
+
+  io_hook->port = start;
+  io_hook->end_port = end;
+  io_hook->type = type;
 
   if (!read) {
     io_hook->read = &default_read;
@@ -132,8 +258,8 @@ int v3_hook_io_port(struct guest_info * info, uint_t port,
     io_hook->write = write;
   }
 
-  io_hook->next = NULL;
-  io_hook->prev = NULL;
+  io_hook->read_str = NULL;
+  io_hook->write_str = NULL;
 
   io_hook->priv_data = priv_data;
 
@@ -145,40 +271,62 @@ int v3_hook_io_port(struct guest_info * info, uint_t port,
   return 0;
 }
 
-int v3_unhook_io_port(struct guest_info * info, uint_t port) {
-  struct vmm_io_map * io_map = &(info->io_map);
-  struct vmm_io_hook * hook = v3_get_io_hook(io_map, port);
+int v3_hook_io_port_str(struct guest_info * info, uint_t port, 
+			int (*read_str)(ushort_t port, void * dst, uint_t length, uint_t count, void * priv_data),
+			int (*write_str)(ushort_t port, void * src, uint_t length, uint_t count, void * priv_data)) {
+  struct vmm_io_hook * hook = v3_get_io_hook(&(info->io_map), port);
 
   if (hook == NULL) {
+    PrintError("Cannot add string handlers to unhooked port %x\n", port);
     return -1;
   }
 
-  remove_io_hook(io_map, hook);
+  hook->read_str = read_str;
+  hook->write_str = write_str;
+
   return 0;
 }
 
+int v3_unhook_io_port(struct guest_info * info, uint_t port) {
+  struct vmm_io_map * io_map = &(info->io_map);
+  struct vmm_io_hook * hook = v3_get_io_hook(io_map, port);
+
+  if (hook == NULL) {
+    return -1;
+  }
 
-struct vmm_io_hook * v3_get_io_hook(struct vmm_io_map * io_map, uint_t port) {
-  struct vmm_io_hook * tmp_hook;
-  FOREACH_IO_HOOK(*io_map, tmp_hook) {
-    if (tmp_hook->port == port) {
-      return tmp_hook;
-    }
+  if (hook->port != port) {
+    PrintError("Port %x is inside the range hook %x-%x\n", port, hook->port, hook->end_port);
+    return -1;
   }
-  return NULL;
+
+  if (remove_io_hook(io_map, hook) == -1) {
+    return -1;
+  }
+
+  V3_Free(hook);
+  return 0;
 }
 
 
 
 void v3_print_io_map(struct vmm_io_map * io_map) {
-  struct vmm_io_hook * iter = io_map->head;
+  uint_t port = 0;
 
   PrintDebug("VMM IO Map (Entries=%d)\n", io_map->num_ports);
 
-  while (iter) {
-    PrintDebug("IO Port: %hu (Read=%p) (Write=%p)\n", 
-	       iter->port, 
+  for (port = 0; port < 0x10000; port++) {
+    struct vmm_io_hook * iter = v3_get_io_hook(io_map, port);
+
+    if (iter == NULL) {
+      continue;
+    }
+
+    PrintDebug("IO Port: %hu-%hu (Read=%p) (Write=%p)\n", 
+	       iter->port, iter->end_port,
 	       (void *)(iter->read), (void *)(iter->write));
+
+    port = iter->end_port;
   }
 }
 
@@ -308,3 +456,80 @@ static int default_read(ushort_t port, void * dst, uint_t length, void * priv_da
 
   return 0;
 }
+
+
+
+/* Passthrough ports do not exit, so these only get single bytes that v3_io_write()/v3_io_read()
+ * split off an access that ran into a trapped port
+ */
+static int passthrough_write(ushort_t port, void * src, uint_t length, void * priv_data) {
+  if (length != 1) {
+    PrintError("Passthrough write of %d bytes on port %x\n", length, port);
+    return -1;
+  }
+
+  v3_outb(port, ((uchar_t *)src)[0]);
+
+  return length;
+}
+
+static int passthrough_read(ushort_t port, void * dst, uint_t length, void * priv_data) {
+  if (length != 1) {
+    PrintError("Passthrough read of %d bytes on port %x\n", length, port);
+    return -1;
+  }
+
+  ((uchar_t *)dst)[0] = v3_inb(port);
+
+  return length;
+}
+
+
+
+/* An access that starts on a passthrough or unhooked port only exits because it runs into 
+ * a trapped port. It is split per byte so every port goes to its own hook, 
+ * and the trapped ports never reach the hardware
+ */
+int v3_io_write(struct vmm_io_map * io_map, ushort_t port, void * src, uint_t length) {
+  struct vmm_io_hook * hook = v3_get_io_hook(io_map, port);
+  uint_t i = 0;
+
+  if ((hook != NULL) && (hook->type == V3_IO_HOOK_TRAP)) {
+    return hook->write(port, src, length, hook->priv_data);
+  }
+
+  for (i = 0; i < length; i++) {
+    ushort_t byte_port = (ushort_t)(port + i);
+    struct vmm_io_hook * byte_hook = v3_get_io_hook(io_map, byte_port);
+
+    if (byte_hook == NULL) {
+      v3_outb(byte_port, ((uchar_t *)src)[i]);
+    } else if (byte_hook->write(byte_port, (uchar_t *)src + i, 1, byte_hook->priv_data) != 1) {
+      return -1;
+    }
+  }
+
+  return length;
+}
+
+int v3_io_read(struct vmm_io_map * io_map, ushort_t port, void * dst, uint_t length) {
+  struct vmm_io_hook * hook = v3_get_io_hook(io_map, port);
+  uint_t i = 0;
+
+  if ((hook != NULL) && (hook->type == V3_IO_HOOK_TRAP)) {
+    return hook->read(port, dst, length, hook->priv_data);
+  }
+
+  for (i = 0; i < length; i++) {
+    ushort_t byte_port = (ushort_t)(port + i);
+    struct vmm_io_hook * byte_hook = v3_get_io_hook(io_map, byte_port);
+
+    if (byte_hook == NULL) {
+      ((uchar_t *)dst)[i] = v3_inb(byte_port);
+    } else if (byte_hook->read(byte_port, (uchar_t *)dst + i, 1, byte_hook->priv_data) != 1) {
+      return -1;
+    }
+  }
+
+  return length;
+}
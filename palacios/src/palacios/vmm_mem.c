@@ -21,6 +21,9 @@
 #include <palacios/vmm.h>
 #include <palacios/vmm_util.h>
 #include <palacios/vmm_decoder.h>
+#include <palacios/vmm_dedup.h>
+#include <palacios/vmm_dirty_log.h>
+#include <palacios/vmm_shadow_paging.h>
 
 
 
@@ -35,7 +38,7 @@ void init_shadow_region(struct shadow_region * entry,
   entry->guest_end = guest_addr_end;
   entry->host_type = host_region_type;
   entry->host_addr = 0;
-  entry->next=entry->prev = NULL;
+  entry->dirty_log = NULL;
 }
 
 int add_shadow_region_passthrough( struct guest_info *  guest_info,
@@ -49,9 +52,213 @@ int add_shadow_region_passthrough( struct guest_info *  guest_info,
 		     GUEST_REGION_PHYSICAL_MEMORY, HOST_REGION_PHYSICAL_MEMORY);
   entry->host_addr = host_addr;
 
-  return add_shadow_region(&(guest_info->mem_map), entry);
+  if (add_shadow_region(&(guest_info->mem_map), entry) == -1) {
+    V3_Free(entry);
+    return -1;
+  }
+
+  return v3_update_passthrough_pts(guest_info, guest_addr_start, guest_addr_end);
+}
+
+int add_shadow_region_demand(struct guest_info * guest_info, 
+			     addr_t guest_addr_start, 
+			     addr_t guest_addr_end) 
+{
+  struct shadow_region * entry = NULL;
+  struct demand_mem * demand = NULL;
+  addr_t chunk_size = DEMAND_MEM_CHUNK_PAGES * PAGE_SIZE;
+
+  if (guest_addr_start >= guest_addr_end) {
+    return -1;
+  }
+
+  entry = (struct shadow_region *)V3_Malloc(sizeof(struct shadow_region));
+  demand = (struct demand_mem *)V3_Malloc(sizeof(struct demand_mem));
+
+  if ((entry == NULL) || (demand == NULL)) {
+    PrintError("Could not allocate demand region (%p-%p)\n", 
+	       (void *)guest_addr_start, (void *)guest_addr_end);
+
+    if (demand) {
+      V3_Free(demand);
+    }
+
+    if (entry) {
+      V3_Free(entry);
+    }
+
+    return -1;
+  }
+
+  demand->ref_count = 1;
+  demand->guest_base = guest_addr_start & ~(chunk_size - 1);
+  demand->num_pages = (guest_addr_end - demand->guest_base + (PAGE_SIZE - 1)) / PAGE_SIZE;
+  demand->pages = (addr_t *)V3_Malloc(sizeof(addr_t) * demand->num_pages);
+
+  if (demand->pages == NULL) {
+    PrintError("Could not allocate page table for demand region (%p-%p)\n", 
+	       (void *)guest_addr_start, (void *)guest_addr_end);
+    V3_Free(demand);
+    V3_Free(entry);
+    return -1;
+  }
+
+  memset(demand->pages, 0, sizeof(addr_t) * demand->num_pages);
+
+  init_shadow_region(entry, guest_addr_start, guest_addr_end, 
+		     GUEST_REGION_PHYSICAL_MEMORY, HOST_REGION_UNALLOCATED);
+  entry->host_addr = (addr_t)demand;
+
+  if (add_shadow_region(&(guest_info->mem_map), entry) == -1) {
+    V3_Free(demand->pages);
+    V3_Free(demand);
+    V3_Free(entry);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+addr_t * get_demand_page_entry(struct shadow_region * region, addr_t guest_addr) {
+  struct demand_mem * demand = (struct demand_mem *)(region->host_addr);
+
+  return &(demand->pages[(guest_addr - demand->guest_base) / PAGE_SIZE]);
+}
+
+
+addr_t get_demand_mem_addr(struct shadow_region * region, addr_t guest_addr) {
+  addr_t page = *get_demand_page_entry(region, guest_addr);
+
+  if ((page == 0) || (page & DEMAND_PAGE_SHARED)) {
+    return 0;
+  }
+
+  return page + PAGE_OFFSET(guest_addr);
+}
+
+
+addr_t get_demand_mem_readonly_addr(struct shadow_region * region, addr_t guest_addr) {
+  addr_t page = *get_demand_page_entry(region, guest_addr);
+
+  if (page == 0) {
+    return get_zero_page();
+  } else if (page & DEMAND_PAGE_SHARED) {
+    return ((struct shared_page *)(page & ~DEMAND_PAGE_SHARED))->host_addr;
+  }
+
+  return page;
 }
 
+
+int alloc_demand_mem(struct guest_info * info, addr_t guest_addr) {
+  struct shadow_region * reg = get_shadow_region_by_addr(&(info->mem_map), guest_addr);
+  addr_t chunk_size = DEMAND_MEM_CHUNK_PAGES * PAGE_SIZE;
+  addr_t * entry = NULL;
+  addr_t start = 0;
+  addr_t end = 0;
+
+  if ((reg == NULL) || (reg->host_type != HOST_REGION_UNALLOCATED)) {
+    PrintError("No demand region at %p\n", (void *)guest_addr);
+    return -1;
+  }
+
+  entry = get_demand_page_entry(reg, guest_addr);
+
+  if (*entry & DEMAND_PAGE_SHARED) {
+    // Write to a merged page, it gets a copy of its own
+    addr_t page = v3_unshare_page(info, (struct shared_page *)(*entry & ~DEMAND_PAGE_SHARED));
+
+    if (page == 0) {
+      return -1;
+    }
+
+    *entry = page;
+
+    start = PAGE_ADDR(guest_addr);
+    end = start + PAGE_SIZE;
+  } else if (*entry != 0) {
+    return 0;
+  } else {
+    // First write to the chunk, back every page of it
+    struct demand_mem * demand = (struct demand_mem *)(reg->host_addr);
+    addr_t page_addr = 0;
+
+    start = demand->guest_base + (((guest_addr - demand->guest_base) / chunk_size) * chunk_size);
+    end = start + chunk_size;
+
+    if (start < reg->guest_start) {
+      start = reg->guest_start;
+    }
+
+    if (end > reg->guest_end) {
+      end = reg->guest_end;
+    }
+
+    // If the chunk was backed before, its empty entries are pages page merging gave back to the zero page,
+    // so only the written page gets memory again
+    for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+      if (*get_demand_page_entry(reg, page_addr) != 0) {
+	start = PAGE_ADDR(guest_addr);
+	end = start + PAGE_SIZE;
+	break;
+      }
+    }
+
+    for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+      addr_t * page_entry = get_demand_page_entry(reg, page_addr);
+      void * page = NULL;
+
+      if (*page_entry != 0) {
+	continue;
+      }
+
+      page = V3_AllocPages(1);
+
+      if (page == NULL) {
+	PrintError("Could not allocate memory for guest address %p\n", (void *)page_addr);
+	return -1;
+      }
+
+      memset(V3_VAddr(page), 0, PAGE_SIZE);
+      *page_entry = (addr_t)page;
+    }
+
+    PrintDebug("Allocated demand memory for %p-%p\n", (void *)start, (void *)end);
+  }
+
+  // Reads may have mapped the zero page or a shared page
+  v3_zap_shadow_mappings(info, start, end);
+
+  if (v3_update_passthrough_pts(info, start, end) == -1) {
+    PrintError("Could not map demand memory in the passthrough page tables\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// Shared by every guest, it is never written
+static addr_t zero_page = 0;
+
+addr_t get_zero_page() {
+  if (zero_page == 0) {
+    void * page = V3_AllocPages(1);
+
+    if (page == NULL) {
+      PrintError("Could not allocate the zero page\n");
+      return 0;
+    }
+
+    memset(V3_VAddr(page), 0, PAGE_SIZE);
+    zero_page = (addr_t)page;
+  }
+
+  return zero_page;
+}
+
+
 int hook_guest_mem(struct guest_info * info, addr_t guest_addr_start, addr_t guest_addr_end,
 		   int (*read)(addr_t guest_addr, void * dst, uint_t length, void * priv_data),
 		   int (*write)(addr_t guest_addr, void * src, uint_t length, void * priv_data),
@@ -73,7 +280,39 @@ int hook_guest_mem(struct guest_info * info, addr_t guest_addr_start, addr_t gue
 
   entry->host_addr = (addr_t)hook;
 
-  return add_shadow_region(&(info->mem_map), entry);
+  if (add_shadow_region(&(info->mem_map), entry) == -1) {
+    V3_Free(hook);
+    V3_Free(entry);
+    return -1;
+  }
+
+  return v3_update_passthrough_pts(info, guest_addr_start, guest_addr_end);
+}
+
+
+int unhook_guest_mem(struct guest_info * info, addr_t guest_addr) {
+  struct shadow_region * reg = get_shadow_region_by_addr(&(info->mem_map), guest_addr);
+  struct vmm_mem_hook * hook = NULL;
+  addr_t guest_start = 0;
+  addr_t guest_end = 0;
+
+  if ((reg == NULL) || (reg->host_type != HOST_REGION_HOOK)) {
+    PrintError("No memory hook at %p\n", (void *)guest_addr);
+    return -1;
+  }
+
+  hook = (struct vmm_mem_hook *)(reg->host_addr);
+  guest_start = reg->guest_start;
+  guest_end = reg->guest_end;
+
+  if (delete_shadow_region(info, guest_start, guest_end) == -1) {
+    PrintError("Could not remove hooked region (%p-%p)\n", (void *)guest_start, (void *)guest_end);
+    return -1;
+  }
+
+  V3_Free(hook);
+
+  return v3_update_passthrough_pts(info, guest_start, guest_end);
 }
 
 
@@ -127,6 +366,15 @@ int handle_special_page_fault(struct guest_info * info,
   switch (reg->host_type) {
   case HOST_REGION_HOOK:
     return mem_hook_dispatch(info, fault_gva, fault_gpa, access_info, (struct vmm_mem_hook *)(reg->host_addr));
+  case HOST_REGION_UNALLOCATED:
+    if (get_demand_mem_addr(reg, fault_gpa) == 0) {
+      // A write to a page still backed by the zero page, the access is restarted on the new page
+      return alloc_demand_mem(info, fault_gpa);
+    }
+
+    // The page has memory of its own, so it is only write protected for the dirty log
+  case HOST_REGION_PHYSICAL_MEMORY:
+    return v3_handle_dirty_log_fault(info, fault_gpa);
   default:
     return -1;
   }
@@ -137,23 +385,28 @@ int handle_special_page_fault(struct guest_info * info,
 
 
 
+#define SHADOW_MAP_INIT_REGIONS 16
+
+
 void init_shadow_map(struct guest_info * info) {
   struct shadow_map * map = &(info->mem_map);
 
   map->num_regions = 0;
-
-  map->head = NULL;
+  map->max_regions = 0;
+  map->regions = NULL;
+  map->last_hit = NULL;
 }
 
 
 void free_shadow_map(struct shadow_map * map) {
-  struct shadow_region * cursor = map->head;
-  struct shadow_region * tmp = NULL;
+  uint_t i = 0;
+
+  for (i = 0; i < map->num_regions; i++) {
+    V3_Free(map->regions[i]);
+  }
 
-  while(cursor) {
-    tmp = cursor;
-    cursor = cursor->next;
-    V3_Free(tmp);
+  if (map->regions) {
+    V3_Free(map->regions);
   }
 
   V3_Free(map);
@@ -161,100 +414,294 @@ void free_shadow_map(struct shadow_map * map) {
 
 
 
+/* Returns the index of the first region whose guest_start is > addr
+ * So the region that could contain addr is at (index - 1)
+ */
+static uint_t find_region_index(struct shadow_map * map, addr_t addr) {
+  uint_t lo = 0;
+  uint_t hi = map->num_regions;
+
+  while (lo < hi) {
+    uint_t mid = lo + ((hi - lo) / 2);
+
+    if (map->regions[mid]->guest_start <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+
+static int insert_region_at(struct shadow_map * map, uint_t index, struct shadow_region * region) {
+  uint_t i = 0;
+
+  if (map->num_regions == map->max_regions) {
+    uint_t new_max = (map->max_regions == 0) ? SHADOW_MAP_INIT_REGIONS : (map->max_regions * 2);
+    struct shadow_region ** new_regions = NULL;
+
+    new_regions = (struct shadow_region **)V3_Malloc(sizeof(struct shadow_region *) * new_max);
+
+    if (new_regions == NULL) {
+      PrintError("Could not grow shadow map\n");
+      return -1;
+    }
+
+    if (map->regions) {
+      memcpy(new_regions, map->regions, sizeof(struct shadow_region *) * map->num_regions);
+      V3_Free(map->regions);
+    }
+
+    map->regions = new_regions;
+    map->max_regions = new_max;
+  }
+
+  for (i = map->num_regions; i > index; i--) {
+    map->regions[i] = map->regions[i - 1];
+  }
+
+  map->regions[index] = region;
+  map->num_regions++;
+
+  return 0;
+}
+
+
+static void remove_region_at(struct shadow_map * map, uint_t index) {
+  uint_t i = 0;
+
+  if (map->regions[index] == map->last_hit) {
+    map->last_hit = NULL;
+  }
+
+  for (i = index; i < map->num_regions - 1; i++) {
+    map->regions[i] = map->regions[i + 1];
+  }
+
+  map->num_regions--;
+}
+
+
+// host_addr is an address (rather than a structure) for these types, so it moves with guest_start
+static int region_host_addr_is_linear(struct shadow_region * region) {
+  return ((region->host_type == HOST_REGION_PHYSICAL_MEMORY) ||
+	  (region->host_type == HOST_REGION_MEMORY_MAPPED_DEVICE));
+}
+
+
 
 int add_shadow_region(struct shadow_map * map,
 		      struct shadow_region * region) 
 {
-  struct shadow_region * cursor = map->head;
+  uint_t index = find_region_index(map, region->guest_start);
 
   PrintDebug("Adding Shadow Region: (0x%p-0x%p)\n", 
 	     (void *)region->guest_start, (void *)region->guest_end);
 
-  if ((!cursor) || (cursor->guest_start >= region->guest_end)) {
-    region->prev = NULL;
-    region->next = cursor;
-    map->num_regions++;
-    map->head = region;
-    return 0;
+  // Check if it overlaps with its neighbors
+  if ((index > 0) && (map->regions[index - 1]->guest_end > region->guest_start)) {
+    // overlaps not allowed
+    return -1;
   }
 
-  while (cursor) {
-    // Check if it overlaps with the current cursor
-    if ((cursor->guest_end > region->guest_start) && (cursor->guest_start < region->guest_start)) {
-      // overlaps not allowed
-      return -1;
-    }
-    
-    if (!(cursor->next)) {
-      // add to the end of the list
-      cursor->next = region;
-      region->prev = cursor;
-      region->next = NULL;
-      map->num_regions++;
-      return 0;
-    } else if (cursor->next->guest_start >= region->guest_end) {
-      // add here
-      region->next = cursor->next;
-      region->prev = cursor;
-      
-      cursor->next->prev = region;
-      cursor->next = region;
-
-      map->num_regions++;
-      
-      return 0;
-    } else if (cursor->next->guest_end <= region->guest_start) {
-      cursor = cursor->next;
-    } else {
-      // This cannot happen!
-      // we should panic here
-      return -1;
+  if ((index < map->num_regions) && (map->regions[index]->guest_start < region->guest_end)) {
+    return -1;
+  }
+
+  return insert_region_at(map, index, region);
+}
+
+
+/* Returns the host pages behind [start, end) of a demand region, reads see the zero page again */
+static void release_demand_pages(struct guest_info * info, struct shadow_region * reg, 
+				 addr_t start, addr_t end) {
+  addr_t page_addr = 0;
+
+  v3_zap_shadow_mappings(info, start, end);
+
+  for (page_addr = PT32_PAGE_ADDR(start); page_addr < end; page_addr += PAGE_SIZE) {
+    addr_t * entry = get_demand_page_entry(reg, page_addr);
+
+    if (*entry & DEMAND_PAGE_SHARED) {
+      v3_put_shared_page(info, (struct shared_page *)(*entry & ~DEMAND_PAGE_SHARED));
+    } else if (*entry != 0) {
+      V3_FreePage((void *)(*entry));
     }
+
+    *entry = 0;
+  }
+}
+
+
+static void put_demand_mem(struct shadow_region * reg) {
+  struct demand_mem * demand = (struct demand_mem *)(reg->host_addr);
+
+  demand->ref_count--;
+
+  if (demand->ref_count == 0) {
+    V3_Free(demand->pages);
+    V3_Free(demand);
   }
-  
-  // This cannot happen
-  // We should panic here
-  return -1;
 }
 
 
-int delete_shadow_region(struct shadow_map * map,
+int delete_shadow_region(struct guest_info * info,
 			 addr_t guest_start,
 			 addr_t guest_end) {
-  return -1;
+  struct shadow_map * map = &(info->mem_map);
+  uint_t index = find_region_index(map, guest_start);
+  int found = 0;
+
+  if (guest_start >= guest_end) {
+    return -1;
+  }
+
+  // The region at (index - 1) may start before guest_start and still overlap
+  if (index > 0) {
+    index--;
+  }
+
+  while (index < map->num_regions) {
+    struct shadow_region * reg = map->regions[index];
+
+    if (reg->guest_start >= guest_end) {
+      break;
+    }
+
+    if (reg->guest_end <= guest_start) {
+      index++;
+      continue;
+    }
+
+    found = 1;
+
+    if ((reg->guest_start < guest_start) && (reg->guest_end > guest_end)) {
+      // Hole in the middle: split into two regions
+      struct shadow_region * tail = (struct shadow_region *)V3_Malloc(sizeof(struct shadow_region));
+
+      if (tail == NULL) {
+	PrintError("Could not allocate region for split\n");
+	return -1;
+      }
+
+      *tail = *reg;
+      tail->guest_start = guest_end;
+
+      if (tail->dirty_log) {
+	tail->dirty_log->ref_count++;
+      }
+
+      if (region_host_addr_is_linear(reg)) {
+	tail->host_addr += guest_end - reg->guest_start;
+      } else if (reg->host_type == HOST_REGION_UNALLOCATED) {
+	((struct demand_mem *)(tail->host_addr))->ref_count++;
+      }
+
+      reg->guest_end = guest_start;
+
+      if (insert_region_at(map, index + 1, tail) == -1) {
+	reg->guest_end = tail->guest_end;
+	v3_put_dirty_bitmap(tail);
+
+	if (tail->host_type == HOST_REGION_UNALLOCATED) {
+	  put_demand_mem(tail);
+	}
+
+	V3_Free(tail);
+	return -1;
+      }
+
+      if (reg->host_type == HOST_REGION_UNALLOCATED) {
+	release_demand_pages(info, reg, guest_start, guest_end);
+      }
+
+      break;
+    } else if (reg->guest_start < guest_start) {
+      // Trim the end
+      if (reg->host_type == HOST_REGION_UNALLOCATED) {
+	release_demand_pages(info, reg, guest_start, reg->guest_end);
+      }
+
+      reg->guest_end = guest_start;
+      index++;
+    } else if (reg->guest_end > guest_end) {
+      // Trim the start
+      if (region_host_addr_is_linear(reg)) {
+	reg->host_addr += guest_end - reg->guest_start;
+      } else if (reg->host_type == HOST_REGION_UNALLOCATED) {
+	release_demand_pages(info, reg, reg->guest_start, guest_end);
+      }
+
+      reg->guest_start = guest_end;
+      break;
+    } else {
+      // Entirely covered
+      remove_region_at(map, index);
+      v3_put_dirty_bitmap(reg);
+
+      if (reg->host_type == HOST_REGION_UNALLOCATED) {
+	release_demand_pages(info, reg, reg->guest_start, reg->guest_end);
+	put_demand_mem(reg);
+      }
+
+      V3_Free(reg);
+    }
+  }
+
+  return (found) ? 0 : -1;
 }
 
 
 
 struct shadow_region *get_shadow_region_by_index(struct shadow_map *  map,
 						 uint_t index) {
-  struct shadow_region * reg = map->head;
-  uint_t i = 0;
+  if (index >= map->num_regions) {
+    return NULL;
+  }
 
-  while (reg) { 
-    if (i == index) { 
-      return reg;
-    }
-    reg = reg->next;
-    i++;
+  return map->regions[index];
+}
+
+
+struct shadow_region * get_next_shadow_region(struct shadow_map * map, addr_t addr) {
+  uint_t index = find_region_index(map, addr);
+
+  if ((index > 0) && (map->regions[index - 1]->guest_end > addr)) {
+    return map->regions[index - 1];
+  }
+
+  if (index < map->num_regions) {
+    return map->regions[index];
   }
+
   return NULL;
 }
 
 
 struct shadow_region * get_shadow_region_by_addr(struct shadow_map * map,
 						 addr_t addr) {
-  struct shadow_region * reg = map->head;
+  struct shadow_region * reg = map->last_hit;
+  uint_t index = 0;
 
-  while (reg) {
-    if ((reg->guest_start <= addr) && (reg->guest_end > addr)) {
-      return reg;
-    } else if (reg->guest_start > addr) {
-      return NULL;
-    } else {
-      reg = reg->next;
-    }
+  if ((reg) && (reg->guest_start <= addr) && (reg->guest_end > addr)) {
+    return reg;
   }
+
+  index = find_region_index(map, addr);
+
+  if (index == 0) {
+    return NULL;
+  }
+
+  reg = map->regions[index - 1];
+
+  if (reg->guest_end > addr) {
+    map->last_hit = reg;
+    return reg;
+  }
+
   return NULL;
 }
 
@@ -264,6 +711,9 @@ host_region_type_t get_shadow_addr_type(struct guest_info * info, addr_t guest_a
 
   if (!reg) {
     return HOST_REGION_INVALID;
+  } else if ((reg->host_type == HOST_REGION_UNALLOCATED) && 
+	     (get_demand_mem_addr(reg, guest_addr) != 0)) {
+    return HOST_REGION_PHYSICAL_MEMORY;
   } else {
     return reg->host_type;
   }
@@ -274,12 +724,43 @@ addr_t get_shadow_addr(struct guest_info * info, addr_t guest_addr) {
 
   if (!reg) {
     return 0;
+  } else if (reg->host_type == HOST_REGION_UNALLOCATED) {
+    return get_demand_mem_addr(reg, guest_addr);
   } else {
     return (guest_addr - reg->guest_start) + reg->host_addr;
   }
 }
 
 
+/* The range has to be plain memory inside a single region, 
+ * and the host address has to be aligned like the guest address
+ */
+int get_large_page_backing(struct shadow_map * map, addr_t guest_addr, addr_t page_size, addr_t * host_addr) {
+  struct shadow_region * reg = get_shadow_region_by_addr(map, guest_addr);
+  addr_t host_start = 0;
+
+  if ((guest_addr & (page_size - 1)) != 0) {
+    return 0;
+  }
+
+  if ((!reg) || 
+      (reg->host_type != HOST_REGION_PHYSICAL_MEMORY) || 
+      (reg->guest_end < guest_addr + page_size)) {
+    return 0;
+  }
+
+  host_start = (guest_addr - reg->guest_start) + reg->host_addr;
+
+  if ((host_start & (page_size - 1)) != 0) {
+    return 0;
+  }
+
+  *host_addr = host_start;
+
+  return 1;
+}
+
+
 host_region_type_t lookup_shadow_map_addr(struct shadow_map * map, addr_t guest_addr, addr_t * host_addr) {
   struct shadow_region * reg = get_shadow_region_by_addr(map, guest_addr);
 
@@ -291,8 +772,13 @@ host_region_type_t lookup_shadow_map_addr(struct shadow_map * map, addr_t guest_
     case HOST_REGION_PHYSICAL_MEMORY:
      *host_addr = (guest_addr - reg->guest_start) + reg->host_addr;
      return reg->host_type;
-    case HOST_REGION_MEMORY_MAPPED_DEVICE:
     case HOST_REGION_UNALLOCATED:
+      // Pages that have been touched behave like any other memory
+      if ((*host_addr = get_demand_mem_addr(reg, guest_addr)) != 0) {
+	return HOST_REGION_PHYSICAL_MEMORY;
+      }
+      return reg->host_type;
+    case HOST_REGION_MEMORY_MAPPED_DEVICE:
       // ... 
     default:
       *host_addr = 0;
@@ -303,12 +789,13 @@ host_region_type_t lookup_shadow_map_addr(struct shadow_map * map, addr_t guest_
 
 
 void print_shadow_map(struct shadow_map * map) {
-  struct shadow_region * cur = map->head;
-  int i = 0;
+  uint_t i = 0;
 
   PrintDebug("Memory Layout (regions: %d) \n", map->num_regions);
 
-  while (cur) {
+  for (i = 0; i < map->num_regions; i++) {
+    struct shadow_region * cur = map->regions[i];
+
     PrintDebug("%d:  0x%p - 0x%p (%s) -> ", i, 
 	       (void *)cur->guest_start, (void *)(cur->guest_end - 1),
 	       cur->guest_type == GUEST_REGION_PHYSICAL_MEMORY ? "GUEST_REGION_PHYSICAL_MEMORY" :
@@ -328,8 +815,6 @@ void print_shadow_map(struct shadow_map * map) {
 	       cur->host_type == HOST_REGION_REMOTE ? "HOST_REGION_REMOTE" : 
 	       cur->host_type == HOST_REGION_SWAPPED ? "HOST_REGION_SWAPPED" :
 	       "UNKNOWN");
-    cur = cur->next;
-    i++;
   }
 }
 
@@ -0,0 +1,380 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#include <palacios/vmm_migrate.h>
+#include <palacios/vmm.h>
+#include <palacios/vm_guest.h>
+#include <palacios/vmm_mem.h>
+#include <palacios/vmm_dirty_log.h>
+#include <palacios/vmm_checkpoint.h>
+
+
+/* 
+ * Pre-copy live migration
+ *
+ * The sender streams every RAM page while the guest keeps running, a batch after each VM exit,
+ * then makes further passes that resend only the pages the dirty log caught being written during the previous one.
+ * Once a pass leaves few enough dirty pages (or they stop shrinking) the guest is not resumed again:
+ * the last dirty pages and the CPU and device state are sent, and start_guest() returns.
+ *
+ * Stream format
+ *
+ * A checkpoint header with the memory map layout, then records, each starting with a tag byte:
+ * a page record carries the guest physical address and the page in checkpoint encoding,
+ * the state record carries the CPU and device state and ends the stream.
+ * A page may be sent several times, the receiver keeps the last copy.
+ *
+ * Pre-copy is only correct if the dirty log sees every write to guest RAM.
+ * Built with DEBUG_MIGRATE, both sides hash all of RAM at the end and the receiver fails on a mismatch.
+ */
+
+
+#define MIGRATE_REC_PAGE  0
+#define MIGRATE_REC_STATE 1
+
+
+
+void v3_init_migration(struct guest_info * info) {
+  struct v3_migration_state * mig = &(info->migration);
+
+  memset(mig, 0, sizeof(struct v3_migration_state));
+  mig->state = MIGRATE_IDLE;
+}
+
+
+
+static int send_page(struct guest_info * info, struct shadow_region * reg, addr_t guest_pa) {
+  struct v3_migration_state * mig = &(info->migration);
+  uchar_t tag = MIGRATE_REC_PAGE;
+
+  if ((V3_CHKPT_SAVE(&(mig->stream), tag) == -1) ||
+      (V3_CHKPT_SAVE(&(mig->stream), guest_pa) == -1) ||
+      (v3_chkpt_save_page(&(mig->stream), reg, guest_pa) == -1)) {
+    return -1;
+  }
+
+  mig->round_pages++;
+  mig->stats.pages_sent++;
+
+  return 0;
+}
+
+
+/* Carries on with the current pass over guest RAM until max_pages pages have been sent
+ * The first pass sends every page, later ones only the pages dirtied since they were last sent
+ * Returns 1 when the pass is complete, 0 if it has more to send
+ */
+static int send_pages(struct guest_info * info, uint_t max_pages) {
+  struct v3_migration_state * mig = &(info->migration);
+  struct shadow_map * map = &(info->mem_map);
+  uchar_t bitmap[MIGRATE_BATCH_PAGES / 8];
+  uint_t sent = 0;
+
+  while (sent < max_pages) {
+    struct shadow_region * reg = get_next_shadow_region(map, mig->send_addr);
+    uint_t num_pages = 0;
+    uint_t i = 0;
+
+    while ((reg != NULL) && (v3_chkpt_is_guest_ram(reg) == 0)) {
+      reg = get_next_shadow_region(map, reg->guest_end);
+    }
+
+    if (reg == NULL) {
+      return 1;
+    }
+
+    if (mig->send_addr < reg->guest_start) {
+      mig->send_addr = reg->guest_start;
+    }
+
+    num_pages = (reg->guest_end - mig->send_addr) / PAGE_SIZE;
+
+    if (num_pages > MIGRATE_BATCH_PAGES) {
+      num_pages = MIGRATE_BATCH_PAGES;
+    }
+
+    // Reading the log write protects the pages again, so a write after they are sent puts them in the next pass
+    if (v3_get_and_clear_dirty_log(info, mig->send_addr, num_pages, bitmap) == -1) {
+      return -1;
+    }
+
+    for (i = 0; i < num_pages; i++) {
+      if ((mig->stats.rounds > 0) && ((bitmap[i / 8] & (1 << (i % 8))) == 0)) {
+	continue;
+      }
+
+      if (send_page(info, reg, mig->send_addr + (i * PAGE_SIZE)) == -1) {
+	PrintError("Could not send guest page %p\n", (void *)(mig->send_addr + (i * PAGE_SIZE)));
+	return -1;
+      }
+
+      sent++;
+    }
+
+    mig->send_addr += num_pages * PAGE_SIZE;
+  }
+
+  return 0;
+}
+
+
+static void start_round(struct v3_migration_state * mig) {
+  mig->last_round_pages = mig->round_pages;
+  mig->round_pages = 0;
+  mig->send_addr = 0;
+}
+
+
+// Once the dirty set stops shrinking, further passes would only resend the pages the guest keeps writing
+static int precopy_converged(struct v3_migration_state * mig) {
+  return ((mig->round_pages <= MIGRATE_STOP_PAGES) ||
+	  (mig->round_pages >= mig->last_round_pages) ||
+	  (mig->stats.rounds >= MIGRATE_MAX_ROUNDS));
+}
+
+
+// The guest is not entered again, so everything it dirtied since its pages were sent goes out now
+static int stop_and_copy(struct guest_info * info) {
+  struct v3_migration_state * mig = &(info->migration);
+  uchar_t tag = MIGRATE_REC_STATE;
+  ullong_t stop_tsc = 0;
+  ullong_t end_tsc = 0;
+
+  rdtscll(stop_tsc);
+
+  start_round(mig);
+
+  if (send_pages(info, (uint_t)-1) == -1) {
+    return -1;
+  }
+
+  mig->stats.final_pages = mig->round_pages;
+
+  if ((V3_CHKPT_SAVE(&(mig->stream), tag) == -1) ||
+      (v3_chkpt_save_state(info, &(mig->stream)) == -1)) {
+    PrintError("Could not send the guest state\n");
+    return -1;
+  }
+
+  rdtscll(end_tsc);
+
+  mig->stats.downtime_cycles = end_tsc - stop_tsc;
+  mig->stats.total_cycles = end_tsc - mig->start_tsc;
+
+#ifdef DEBUG_MIGRATE
+  {
+    // Left out of the downtime, it is not part of a normal migration
+    ulong_t checksum = v3_chkpt_ram_checksum(info);
+
+    if (V3_CHKPT_SAVE(&(mig->stream), checksum) == -1) {
+      PrintError("Could not send the RAM checksum\n");
+      return -1;
+    }
+  }
+#endif
+
+  return 0;
+}
+
+
+int v3_migration_step(struct guest_info * info) {
+  struct v3_migration_state * mig = &(info->migration);
+  int ret = 0;
+
+  if (mig->state != MIGRATE_PRECOPY) {
+    return 0;
+  }
+
+  ret = send_pages(info, MIGRATE_BATCH_PAGES);
+
+  if (ret == 0) {
+    return 0;
+  } else if (ret == -1) {
+    goto failed;
+  }
+
+  mig->stats.rounds++;
+
+  PrintDebug("Migration round %d sent %d pages\n", mig->stats.rounds, mig->round_pages);
+
+  // The guest can't be stopped halfway through emulating an instruction, so that takes another pass
+  if ((precopy_converged(mig) == 0) || (info->run_state == VM_EMULATING)) {
+    start_round(mig);
+    return 0;
+  }
+
+  if (stop_and_copy(info) == -1) {
+    goto failed;
+  }
+
+  v3_disable_dirty_log(info);
+  mig->state = MIGRATE_DONE;
+
+  return 1;
+
+ failed:
+  // The guest just keeps running here
+  PrintError("Migration failed after %d rounds\n", mig->stats.rounds);
+  v3_disable_dirty_log(info);
+  mig->state = MIGRATE_FAILED;
+
+  return 0;
+}
+
+
+
+int v3_start_migration(struct guest_info * info, struct v3_chkpt_ops * ops, void * priv_data) {
+  struct v3_migration_state * mig = &(info->migration);
+
+  if (mig->state == MIGRATE_PRECOPY) {
+    PrintError("The guest is already being migrated\n");
+    return -1;
+  }
+
+  if (info->dirty_log.enabled == 1) {
+    PrintError("Cannot migrate a guest while its dirty log is in use\n");
+    return -1;
+  }
+
+  memset(&(mig->stats), 0, sizeof(struct v3_migration_stats));
+
+  mig->stream.ops = ops;
+  mig->stream.priv_data = priv_data;
+  mig->send_addr = 0;
+  mig->round_pages = 0;
+  mig->last_round_pages = (uint_t)-1;
+
+  rdtscll(mig->start_tsc);
+
+  if (v3_chkpt_save_header(info, &(mig->stream), V3_CHKPT_MIGRATION) == -1) {
+    PrintError("Could not send the migration header\n");
+    return -1;
+  }
+
+  if (v3_enable_dirty_log(info) == -1) {
+    PrintError("Could not enable dirty page logging\n");
+    return -1;
+  }
+
+  mig->state = MIGRATE_PRECOPY;
+
+  return 0;
+}
+
+
+int v3_receive_migration(struct guest_info * info, struct v3_chkpt_ops * ops, void * priv_data) {
+  struct v3_chkpt stream;
+  uint_t num_pages = 0;
+
+  if (info->run_state != VM_STOPPED) {
+    PrintError("Migrations can only be received by a guest that has not been started\n");
+    return -1;
+  }
+
+  stream.ops = ops;
+  stream.priv_data = priv_data;
+
+  if (v3_chkpt_check_header(info, &stream, V3_CHKPT_MIGRATION) == -1) {
+    PrintError("Invalid migration stream\n");
+    return -1;
+  }
+
+  while (1) {
+    struct shadow_region * reg = NULL;
+    addr_t guest_pa = 0;
+    uchar_t tag = 0;
+
+    if (V3_CHKPT_LOAD(&stream, tag) == -1) {
+      return -1;
+    }
+
+    if (tag == MIGRATE_REC_STATE) {
+      break;
+    } else if (tag != MIGRATE_REC_PAGE) {
+      PrintError("Invalid migration record (%d)\n", tag);
+      return -1;
+    }
+
+    if (V3_CHKPT_LOAD(&stream, guest_pa) == -1) {
+      return -1;
+    }
+
+    reg = get_shadow_region_by_addr(&(info->mem_map), guest_pa);
+
+    if ((reg == NULL) || (v3_chkpt_is_guest_ram(reg) == 0) || (PAGE_OFFSET(guest_pa) != 0)) {
+      PrintError("Migration sent an invalid guest page (%p)\n", (void *)guest_pa);
+      return -1;
+    }
+
+    if (v3_chkpt_load_page(info, &stream, reg, guest_pa) == -1) {
+      PrintError("Could not receive guest page %p\n", (void *)guest_pa);
+      return -1;
+    }
+
+    num_pages++;
+  }
+
+  if (v3_chkpt_load_state(info, &stream) == -1) {
+    PrintError("Could not receive the guest state\n");
+    return -1;
+  }
+
+#ifdef DEBUG_MIGRATE
+  {
+    ulong_t sent_checksum = 0;
+    ulong_t checksum = v3_chkpt_ram_checksum(info);
+
+    if (V3_CHKPT_LOAD(&stream, sent_checksum) == -1) {
+      PrintError("Could not receive the RAM checksum\n");
+      return -1;
+    }
+
+    if (checksum != sent_checksum) {
+      PrintError("Migrated RAM does not match the sender (checksum %lx, expected %lx)\n", 
+		 checksum, sent_checksum);
+      return -1;
+    }
+  }
+#endif
+
+  PrintDebug("Received migrated guest (%d pages)\n", num_pages);
+
+  return 0;
+}
+
+
+
+void v3_get_migration_stats(struct guest_info * info, struct v3_migration_stats * stats) {
+  *stats = info->migration.stats;
+}
+
+
+void v3_print_migration_stats(struct guest_info * info) {
+  if (info->migration.state == MIGRATE_IDLE) {
+    return;
+  }
+
+  PrintDebug("Migration Statistics:\n");
+  PrintDebug("\trounds=%d, pages sent=%llu (final=%d)\n", 
+	     info->migration.stats.rounds, info->migration.stats.pages_sent, 
+	     info->migration.stats.final_pages);
+  PrintDebug("\tdowntime=%llu cycles, total=%llu cycles (cpu freq=%d kHz)\n", 
+	     info->migration.stats.downtime_cycles, info->migration.stats.total_cycles, 
+	     info->time_state.cpu_freq);
+}
@@ -22,6 +22,7 @@
 #include <palacios/vmm.h>
 
 #include <palacios/vm_guest_mem.h>
+#include <palacios/vmm_ctrl_regs.h>
 
 
 
@@ -37,7 +38,8 @@ void delete_page_tables_pde32(pde32_t * pde) {
   }
 
   for (i = 0; (i < MAX_PDE32_ENTRIES); i++) {
-    if (pde[i].present) {
+    // 4MB entries point at guest memory, not at a page table
+    if ((pde[i].present) && (pde[i].large_page == 0)) {
       // We double cast, first to an addr_t to handle 64 bit issues, then to the pointer
       PrintDebug("PTE base addr %x \n", pde[i].pt_base_addr);
       pte32_t * pte = (pte32_t *)((addr_t)(uint_t)(pde[i].pt_base_addr << PAGE_POWER));
@@ -165,278 +167,565 @@ pt_access_status_t can_access_pte32(pte32_t * pte, addr_t addr, pf_error_t acces
 
 
 
-/* We generate a page table to correspond to a given memory layout
- * pulling pages from the mem_list when necessary
- * If there are any gaps in the layout, we add them as unmapped pages
+// Only regions backed by host memory are mapped, everything else faults into the VMM
+static int passthrough_region_mapped(struct shadow_region * region) {
+  return ((region->host_type == HOST_REGION_PHYSICAL_MEMORY) || 
+	  (region->host_type == HOST_REGION_UNALLOCATED));
+}
+
+// Demand allocated pages without memory of their own map the zero page or a shared page read only
+// Pages that are clean in the dirty log are read only as well
+static int get_passthrough_page(struct guest_info * info, struct shadow_region * region, 
+				addr_t guest_addr, addr_t * host_addr, int * writable) {
+  *writable = v3_dirty_log_writable(info, guest_addr);
+
+  if (region->host_type == HOST_REGION_UNALLOCATED) {
+    *host_addr = get_demand_mem_addr(region, guest_addr);
+
+    if (*host_addr == 0) {
+      *host_addr = get_demand_mem_readonly_addr(region, guest_addr);
+      *writable = 0;
+    }
+
+    return (*host_addr != 0);
+  }
+
+  *host_addr = (guest_addr - region->guest_start) + region->host_addr;
+  return 1;
+}
+
+
+
+/* Rebuilds one PDE of a 32 bit passthrough page directory from the memory map
+ * The page table is only allocated if some page in the 4MB range is mapped
  */
-pde32_t * create_passthrough_pts_32(struct guest_info * guest_info) {
-  addr_t current_page_addr = 0;
-  int i, j;
-  struct shadow_map * map = &(guest_info->mem_map);
+static int rebuild_passthrough_pde32(struct guest_info * info, pde32_t * pde, uint_t index) {
+  struct shadow_map * map = &(info->mem_map);
+  // With shadow paging the table is walked in the guest's paging mode, whose CR4 writes are intercepted.
+  // Nested walks use the host's mode, which we don't track, so nested tables only get 4KB entries
+  struct cr4_32 * cr4 = (struct cr4_32 *)&(v3_get_ctrl_regs(info)->cr4);
+  int large_ok = ((info->shdw_pg_mode == SHADOW_PAGING) && (cr4->pse == 1));
+  addr_t range_start = ((addr_t)index) << 22;
+  addr_t range_last = range_start + (PAGE_SIZE_4MB - 1);
+  addr_t current_addr = range_start;
+  addr_t large_host_addr = 0;
+  struct shadow_region * region = NULL;
+  pte32_t * pte = NULL;
+  int pte_present = 0;
+
+  if ((pde[index].present == 1) && (pde[index].large_page == 0)) {
+    pte = V3_VAddr((void *)(addr_t)PDE32_T_ADDR(pde[index]));
+  }
 
-  pde32_t * pde = V3_VAddr(V3_AllocPages(1));
+  // The dirty log needs to write protect single pages
+  if ((large_ok) && (info->dirty_log.enabled == 0) && 
+      (get_large_page_backing(map, range_start, PAGE_SIZE_4MB, &large_host_addr) == 1)) {
+    pde32_4MB_t * large_pde = (pde32_4MB_t *)&(pde[index]);
 
-  for (i = 0; i < MAX_PDE32_ENTRIES; i++) {
-    int pte_present = 0;
-    pte32_t * pte = V3_VAddr(V3_AllocPages(1));
-    
+    if (pte) {
+      V3_FreePage(V3_PAddr(pte));
+    }
+
+    *(uint_t *)large_pde = 0;
+    large_pde->present = 1;
+    large_pde->writable = 1;
+    large_pde->user_page = 1;
+    large_pde->one = 1;
+    large_pde->page_base_addr = PD32_4MB_BASE_ADDR(large_host_addr);
+
+    return 0;
+  }
+
+  if (pte) {
+    memset(pte, 0, PAGE_SIZE);
+  }
 
-    for (j = 0; j < MAX_PTE32_ENTRIES; j++) {
-      struct shadow_region * region = get_shadow_region_by_addr(map, current_page_addr);
-
-      if (!region || 
-	  (region->host_type == HOST_REGION_HOOK) || 
-	  (region->host_type == HOST_REGION_UNALLOCATED) || 
-	  (region->host_type == HOST_REGION_MEMORY_MAPPED_DEVICE) || 
-	  (region->host_type == HOST_REGION_REMOTE) ||
-	  (region->host_type == HOST_REGION_SWAPPED)) {
-	pte[j].present = 0;
-	pte[j].writable = 0;
-	pte[j].user_page = 0;
-	pte[j].write_through = 0;
-	pte[j].cache_disable = 0;
-	pte[j].accessed = 0;
-	pte[j].dirty = 0;
-	pte[j].pte_attr = 0;
-	pte[j].global_page = 0;
-	pte[j].vmm_info = 0;
-	pte[j].page_base_addr = 0;
-      } else {
-	addr_t host_addr;
-	pte[j].present = 1;
-	pte[j].writable = 1;
-	pte[j].user_page = 1;
-	pte[j].write_through = 0;
-	pte[j].cache_disable = 0;
-	pte[j].accessed = 0;
-	pte[j].dirty = 0;
-	pte[j].pte_attr = 0;
-	pte[j].global_page = 0;
-	pte[j].vmm_info = 0;
-
-	if (guest_pa_to_host_pa(guest_info, current_page_addr, &host_addr) == -1) {
-	  // BIG ERROR
-	  // PANIC
-	  return NULL;
+  // Fill in the pages of every region overlapping the 4MB range
+  while (((region = get_next_shadow_region(map, current_addr)) != NULL) && 
+	 (region->guest_start <= range_last)) {
+    addr_t start = (region->guest_start > current_addr) ? region->guest_start : current_addr;
+    addr_t last = ((region->guest_end - 1) < range_last) ? (region->guest_end - 1) : range_last;
+
+    if (passthrough_region_mapped(region)) {
+      uint_t i = 0;
+
+      for (i = PTE32_INDEX(start); i <= PTE32_INDEX(last); i++) {
+	addr_t host_addr = 0;
+	int writable = 0;
+
+	if (get_passthrough_page(info, region, range_start + (i * PAGE_SIZE), &host_addr, &writable) == 0) {
+	  continue;
+	}
+
+	if (pte == NULL) {
+	  void * pte_page = V3_AllocPages(1);
+
+	  if (pte_page == NULL) {
+	    PrintError("Could not allocate passthrough page table\n");
+	    return -1;
+	  }
+
+	  pte = V3_VAddr(pte_page);
+	  memset(pte, 0, PAGE_SIZE);
 	}
-	
-	pte[j].page_base_addr = host_addr >> 12;
-	
+
+	pte[i].present = 1;
+	pte[i].writable = writable;
+	pte[i].user_page = 1;
+	pte[i].page_base_addr = PT32_BASE_ADDR(host_addr);
+
 	pte_present = 1;
       }
+    }
 
-      current_page_addr += PAGE_SIZE;
+    if (last == range_last) {
+      break;
     }
 
-    if (pte_present == 0) { 
+    current_addr = last + 1;
+  }
+
+  *(uint_t *)&(pde[index]) = 0;
+
+  if (pte_present == 0) {
+    if (pte) {
       V3_FreePage(V3_PAddr(pte));
+    }
 
-      pde[i].present = 0;
-      pde[i].writable = 0;
-      pde[i].user_page = 0;
-      pde[i].write_through = 0;
-      pde[i].cache_disable = 0;
-      pde[i].accessed = 0;
-      pde[i].reserved = 0;
-      pde[i].large_page = 0;
-      pde[i].global_page = 0;
-      pde[i].vmm_info = 0;
-      pde[i].pt_base_addr = 0;
-    } else {
-      pde[i].present = 1;
-      pde[i].writable = 1;
-      pde[i].user_page = 1;
-      pde[i].write_through = 0;
-      pde[i].cache_disable = 0;
-      pde[i].accessed = 0;
-      pde[i].reserved = 0;
-      pde[i].large_page = 0;
-      pde[i].global_page = 0;
-      pde[i].vmm_info = 0;
-      pde[i].pt_base_addr = PAGE_ALIGNED_ADDR((addr_t)V3_PAddr(pte));
+    return 0;
+  }
+
+  pde[index].present = 1;
+  pde[index].writable = 1;
+  pde[index].user_page = 1;
+  pde[index].pt_base_addr = PAGE_ALIGNED_ADDR((addr_t)V3_PAddr(pte));
+
+  return 0;
+}
+
+
+/* We generate a page table to correspond to a given memory layout
+ * The layout is walked region by region, so PDE ranges without mapped memory
+ * are never visited and stay not present
+ */
+pde32_t * create_passthrough_pts_32(struct guest_info * guest_info) {
+  struct shadow_map * map = &(guest_info->mem_map);
+  // PDEs below this index have already been built
+  uint_t next_index = 0;
+  uint_t i = 0;
+  pde32_t * pde = V3_VAddr(V3_AllocPages(1));
+
+  memset(pde, 0, PAGE_SIZE);
+
+  for (i = 0; i < map->num_regions; i++) {
+    struct shadow_region * region = get_shadow_region_by_index(map, i);
+    uint_t first = PDE32_INDEX(region->guest_start);
+    uint_t last = PDE32_INDEX(region->guest_end - 1);
+    uint_t j = 0;
+
+    if ((!passthrough_region_mapped(region)) || (last < next_index)) {
+      continue;
     }
 
+    for (j = ((first < next_index) ? next_index : first); j <= last; j++) {
+      if (rebuild_passthrough_pde32(guest_info, pde, j) == -1) {
+	PrintError("Could not build passthrough PDE %d\n", j);
+	return NULL;
+      }
+    }
+
+    next_index = last + 1;
   }
 
   return pde;
 }
 
 
+/* Brings the PDEs covering [guest_start, guest_end) back in line with the memory map
+ * after regions in that range have been added or removed
+ */
+int v3_patch_passthrough_pts_32(struct guest_info * info, pde32_t * pde, addr_t guest_start, addr_t guest_end) {
+  uint_t i = 0;
+
+  if (guest_start >= guest_end) {
+    return 0;
+  }
 
+  for (i = PDE32_INDEX(guest_start); i <= PDE32_INDEX(guest_end - 1); i++) {
+    if (rebuild_passthrough_pde32(info, pde, i) == -1) {
+      PrintError("Could not patch passthrough PDE %d\n", i);
+      return -1;
+    }
+  }
 
-pml4e64_t * create_passthrough_pts_64(struct guest_info * info) {
-  addr_t current_page_addr = 0;
-  int i, j, k, m;
+  return 0;
+}
+
+
+
+
+/* Returns the page directory covering guest_addr
+ * The upper levels are only created if alloc is set
+ */
+static pde64_t * get_passthrough_pd64(pml4e64_t * pml, addr_t guest_addr, int alloc) {
+  pml4e64_t * pml_entry = &(pml[PML4E64_INDEX(guest_addr)]);
+  pdpe64_t * pdpe_entry = NULL;
+  pdpe64_t * pdpe = NULL;
+  pde64_t * pde = NULL;
+
+  if (pml_entry->present == 0) {
+    void * pdpe_page = NULL;
+
+    if ((!alloc) || ((pdpe_page = V3_AllocPages(1)) == NULL)) {
+      return NULL;
+    }
+
+    pdpe = V3_VAddr(pdpe_page);
+    memset(pdpe, 0, PAGE_SIZE);
+
+    memset(pml_entry, 0, sizeof(pml4e64_t));
+    pml_entry->present = 1;
+    pml_entry->writable = 1;
+    pml_entry->user_page = 1;
+    pml_entry->pdp_base_addr = PAGE_ALIGNED_ADDR((addr_t)pdpe_page);
+  } else {
+    pdpe = V3_VAddr((void *)(addr_t)(pml_entry->pdp_base_addr << PAGE_POWER));
+  }
+
+  pdpe_entry = &(pdpe[PDPE64_INDEX(guest_addr)]);
+
+  if (pdpe_entry->present == 0) {
+    void * pde_page = NULL;
+
+    if ((!alloc) || ((pde_page = V3_AllocPages(1)) == NULL)) {
+      return NULL;
+    }
+
+    pde = V3_VAddr(pde_page);
+    memset(pde, 0, PAGE_SIZE);
+
+    memset(pdpe_entry, 0, sizeof(pdpe64_t));
+    pdpe_entry->present = 1;
+    pdpe_entry->writable = 1;
+    pdpe_entry->user_page = 1;
+    pdpe_entry->pd_base_addr = PAGE_ALIGNED_ADDR((addr_t)pde_page);
+  } else {
+    pde = V3_VAddr((void *)(addr_t)(pdpe_entry->pd_base_addr << PAGE_POWER));
+  }
+
+  return pde;
+}
+
+
+/* Rebuilds the PDE of a 64 bit passthrough table that covers the 2MB range at range_start
+ * Nothing is allocated unless some page in the range is mapped
+ */
+static int rebuild_passthrough_pde64(struct guest_info * info, pml4e64_t * pml, addr_t range_start) {
   struct shadow_map * map = &(info->mem_map);
-  
-  pml4e64_t * pml = V3_VAddr(V3_AllocPages(1));
+  addr_t range_last = range_start + (PAGE_SIZE_2MB - 1);
+  addr_t current_addr = range_start;
+  addr_t large_host_addr = 0;
+  struct shadow_region * region = NULL;
+  pde64_t * pd = get_passthrough_pd64(pml, range_start, 0);
+  pde64_t * pde = NULL;
+  pte64_t * pte = NULL;
+  int pte_present = 0;
+
+  if (pd) {
+    pde = &(pd[PDE64_INDEX(range_start)]);
+
+    if ((pde->present == 1) && (pde->large_page == 0)) {
+      pte = V3_VAddr((void *)(addr_t)(pde->pt_base_addr << PAGE_POWER));
+    }
+  }
 
-  for (i = 0; i < 1; i++) {
-    int pdpe_present = 0;
-    pdpe64_t * pdpe = V3_VAddr(V3_AllocPages(1));
-
-    for (j = 0; j < 1; j++) {
-      int pde_present = 0;
-      pde64_t * pde = V3_VAddr(V3_AllocPages(1));
-
-      for (k = 0; k < MAX_PDE64_ENTRIES; k++) {
-	int pte_present = 0;
-	pte64_t * pte = V3_VAddr(V3_AllocPages(1));
-
-
-	for (m = 0; m < MAX_PTE64_ENTRIES; m++) {
-	  struct shadow_region * region = get_shadow_region_by_addr(map, current_page_addr);
-	  
-
-	  
-	  if (!region || 
-	      (region->host_type == HOST_REGION_HOOK) || 
-	      (region->host_type == HOST_REGION_UNALLOCATED) || 
-	      (region->host_type == HOST_REGION_MEMORY_MAPPED_DEVICE) || 
-	      (region->host_type == HOST_REGION_REMOTE) ||
-	      (region->host_type == HOST_REGION_SWAPPED)) {
-	    pte[m].present = 0;
-	    pte[m].writable = 0;
-	    pte[m].user_page = 0;
-	    pte[m].write_through = 0;
-	    pte[m].cache_disable = 0;
-	    pte[m].accessed = 0;
-	    pte[m].dirty = 0;
-	    pte[m].pte_attr = 0;
-	    pte[m].global_page = 0;
-	    pte[m].vmm_info = 0;
-	    pte[m].page_base_addr = 0;
-	  } else {
-	    addr_t host_addr;
-	    pte[m].present = 1;
-	    pte[m].writable = 1;
-	    pte[m].user_page = 1;
-	    pte[m].write_through = 0;
-	    pte[m].cache_disable = 0;
-	    pte[m].accessed = 0;
-	    pte[m].dirty = 0;
-	    pte[m].pte_attr = 0;
-	    pte[m].global_page = 0;
-	    pte[m].vmm_info = 0;
-	    
-	    if (guest_pa_to_host_pa(info, current_page_addr, &host_addr) == -1) {
-	      // BIG ERROR
-	      // PANIC
-	      return NULL;
-	    }
+  if ((info->dirty_log.enabled == 0) && 
+      (get_large_page_backing(map, range_start, PAGE_SIZE_2MB, &large_host_addr) == 1)) {
+    pde64_2MB_t * large_pde = NULL;
 
-	    pte[m].page_base_addr = PTE64_BASE_ADDR(host_addr);
+    if (pd == NULL) {
+      if ((pd = get_passthrough_pd64(pml, range_start, 1)) == NULL) {
+	PrintError("Could not allocate passthrough page directory\n");
+	return -1;
+      }
 
-	    //PrintPTE64(current_page_addr, &(pte[m]));
+      pde = &(pd[PDE64_INDEX(range_start)]);
+    }
 
-	    pte_present = 1;	  
-	  }
+    if (pte) {
+      V3_FreePage(V3_PAddr(pte));
+    }
+
+    large_pde = (pde64_2MB_t *)pde;
+
+    memset(large_pde, 0, sizeof(pde64_2MB_t));
+    large_pde->present = 1;
+    large_pde->writable = 1;
+    large_pde->user_page = 1;
+    large_pde->large_page = 1;
+    large_pde->page_base_addr = PDE64_2MB_BASE_ADDR(large_host_addr);
+
+    return 0;
+  }
+
+  if (pte) {
+    memset(pte, 0, PAGE_SIZE);
+  }
 
+  while (((region = get_next_shadow_region(map, current_addr)) != NULL) && 
+	 (region->guest_start <= range_last)) {
+    addr_t start = (region->guest_start > current_addr) ? region->guest_start : current_addr;
+    addr_t last = ((region->guest_end - 1) < range_last) ? (region->guest_end - 1) : range_last;
 
+    if (passthrough_region_mapped(region)) {
+      uint_t i = 0;
 
+      for (i = PTE64_INDEX(start); i <= PTE64_INDEX(last); i++) {
+	addr_t host_addr = 0;
+	int writable = 0;
 
-	  current_page_addr += PAGE_SIZE;
+	if (get_passthrough_page(info, region, range_start + (i * PAGE_SIZE), &host_addr, &writable) == 0) {
+	  continue;
 	}
-	
-	if (pte_present == 0) {
-	  V3_FreePage(V3_PAddr(pte));
-
-	  pde[k].present = 0;
-	  pde[k].writable = 0;
-	  pde[k].user_page = 0;
-	  pde[k].write_through = 0;
-	  pde[k].cache_disable = 0;
-	  pde[k].accessed = 0;
-	  pde[k].reserved = 0;
-	  pde[k].large_page = 0;
-	  //pde[k].global_page = 0;
-	  pde[k].vmm_info = 0;
-	  pde[k].pt_base_addr = 0;
-	} else {
-	  pde[k].present = 1;
-	  pde[k].writable = 1;
-	  pde[k].user_page = 1;
-	  pde[k].write_through = 0;
-	  pde[k].cache_disable = 0;
-	  pde[k].accessed = 0;
-	  pde[k].reserved = 0;
-	  pde[k].large_page = 0;
-	  //pde[k].global_page = 0;
-	  pde[k].vmm_info = 0;
-	  pde[k].pt_base_addr = PAGE_ALIGNED_ADDR((addr_t)V3_PAddr(pte));
-
-	  pde_present = 1;
+
+	if (pte == NULL) {
+	  void * pte_page = NULL;
+
+	  if (pd == NULL) {
+	    if ((pd = get_passthrough_pd64(pml, range_start, 1)) == NULL) {
+	      PrintError("Could not allocate passthrough page directory\n");
+	      return -1;
+	    }
+
+	    pde = &(pd[PDE64_INDEX(range_start)]);
+	  }
+
+	  if ((pte_page = V3_AllocPages(1)) == NULL) {
+	    PrintError("Could not allocate passthrough page table\n");
+	    return -1;
+	  }
+
+	  pte = V3_VAddr(pte_page);
+	  memset(pte, 0, PAGE_SIZE);
 	}
-      }
 
-      if (pde_present == 0) {
-	V3_FreePage(V3_PAddr(pde));
-	
-	pdpe[j].present = 0;
-	pdpe[j].writable = 0;
-	pdpe[j].user_page = 0;
-	pdpe[j].write_through = 0;
-	pdpe[j].cache_disable = 0;
-	pdpe[j].accessed = 0;
-	pdpe[j].reserved = 0;
-	pdpe[j].large_page = 0;
-	//pdpe[j].global_page = 0;
-	pdpe[j].vmm_info = 0;
-	pdpe[j].pd_base_addr = 0;
-      } else {
-	pdpe[j].present = 1;
-	pdpe[j].writable = 1;
-	pdpe[j].user_page = 1;
-	pdpe[j].write_through = 0;
-	pdpe[j].cache_disable = 0;
-	pdpe[j].accessed = 0;
-	pdpe[j].reserved = 0;
-	pdpe[j].large_page = 0;
-	//pdpe[j].global_page = 0;
-	pdpe[j].vmm_info = 0;
-	pdpe[j].pd_base_addr = PAGE_ALIGNED_ADDR((addr_t)V3_PAddr(pde));
-
-
-	pdpe_present = 1;
+	pte[i].present = 1;
+	pte[i].writable = writable;
+	pte[i].user_page = 1;
+	pte[i].page_base_addr = PTE64_BASE_ADDR(host_addr);
+
+	pte_present = 1;
       }
+    }
 
+    if (last == range_last) {
+      break;
     }
 
-    PrintDebug("PML index=%d\n", i);
-
-    if (pdpe_present == 0) {
-      V3_FreePage(V3_PAddr(pdpe));
-      
-      pml[i].present = 0;
-      pml[i].writable = 0;
-      pml[i].user_page = 0;
-      pml[i].write_through = 0;
-      pml[i].cache_disable = 0;
-      pml[i].accessed = 0;
-      pml[i].reserved = 0;
-      //pml[i].large_page = 0;
-      //pml[i].global_page = 0;
-      pml[i].vmm_info = 0;
-      pml[i].pdp_base_addr = 0;
-    } else {
-      pml[i].present = 1;
-      pml[i].writable = 1;
-      pml[i].user_page = 1;
-      pml[i].write_through = 0;
-      pml[i].cache_disable = 0;
-      pml[i].accessed = 0;
-      pml[i].reserved = 0;
-      //pml[i].large_page = 0;
-      //pml[i].global_page = 0;
-      pml[i].vmm_info = 0;
-      pml[i].pdp_base_addr = PAGE_ALIGNED_ADDR((addr_t)V3_PAddr(pdpe));
+    current_addr = last + 1;
+  }
+
+  if (pde == NULL) {
+    // Nothing was there and nothing is mapped
+    return 0;
+  }
+
+  memset(pde, 0, sizeof(pde64_t));
+
+  if (pte_present == 0) {
+    if (pte) {
+      V3_FreePage(V3_PAddr(pte));
+    }
+
+    return 0;
+  }
+
+  pde->present = 1;
+  pde->writable = 1;
+  pde->user_page = 1;
+  pde->pt_base_addr = PAGE_ALIGNED_ADDR((addr_t)V3_PAddr(pte));
+
+  return 0;
+}
+
+
+pml4e64_t * create_passthrough_pts_64(struct guest_info * info) {
+  struct shadow_map * map = &(info->mem_map);
+  // 2MB ranges below this index have already been built
+  uint_t next_index = 0;
+  uint_t i = 0;
+  pml4e64_t * pml = V3_VAddr(V3_AllocPages(1));
+
+  memset(pml, 0, PAGE_SIZE);
+
+  for (i = 0; i < map->num_regions; i++) {
+    struct shadow_region * region = get_shadow_region_by_index(map, i);
+    uint_t first = region->guest_start / PAGE_SIZE_2MB;
+    uint_t last = (region->guest_end - 1) / PAGE_SIZE_2MB;
+    uint_t j = 0;
+
+    if ((!passthrough_region_mapped(region)) || (last < next_index)) {
+      continue;
+    }
+
+    for (j = ((first < next_index) ? next_index : first); j <= last; j++) {
+      if (rebuild_passthrough_pde64(info, pml, ((addr_t)j) * PAGE_SIZE_2MB) == -1) {
+	PrintError("Could not build passthrough PDE for %p\n", (void *)(((addr_t)j) * PAGE_SIZE_2MB));
+	return NULL;
+      }
     }
+
+    next_index = last + 1;
   }
 
   return pml;
 }
 
 
+int v3_patch_passthrough_pts_64(struct guest_info * info, pml4e64_t * pml, addr_t guest_start, addr_t guest_end) {
+  uint_t i = 0;
+
+  if (guest_start >= guest_end) {
+    return 0;
+  }
+
+  for (i = guest_start / PAGE_SIZE_2MB; i <= (guest_end - 1) / PAGE_SIZE_2MB; i++) {
+    if (rebuild_passthrough_pde64(info, pml, ((addr_t)i) * PAGE_SIZE_2MB) == -1) {
+      PrintError("Could not patch passthrough PDE for %p\n", (void *)(((addr_t)i) * PAGE_SIZE_2MB));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+/* Keeps the guest's direct map in step with the memory map
+ * direct_map_pt is always built in the 32 bit format
+ */
+int v3_update_passthrough_pts(struct guest_info * info, addr_t guest_start, addr_t guest_end) {
+  if (info->direct_map_pt == 0) {
+    // Not built yet, it will be created from the complete map
+    return 0;
+  }
+
+  if (v3_patch_passthrough_pts_32(info, V3_VAddr((void *)(info->direct_map_pt)), guest_start, guest_end) == -1) {
+    return -1;
+  }
+
+  v3_flush_guest_tlb(info);
+
+  return 0;
+}
+
+
+
+/* Rebuilds the whole direct map, after a CR4.PSE change decides whether 4MB entries can be used
+ */
+int v3_rebuild_passthrough_pts(struct guest_info * info) {
+  struct shadow_map * map = &(info->mem_map);
+  uint_t i = 0;
+
+  for (i = 0; i < map->num_regions; i++) {
+    struct shadow_region * region = get_shadow_region_by_index(map, i);
+
+    if ((passthrough_region_mapped(region)) && 
+	(v3_update_passthrough_pts(info, region->guest_start, region->guest_end) == -1)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+
+/* Makes the direct map entry of a page writable once the dirty log has recorded a write to it
+ * Only the one PTE changes, so the first write to each page does not rebuild a whole page table
+ */
+int v3_unprotect_passthrough_page(struct guest_info * info, addr_t guest_pa) {
+  pde32_t * pde = NULL;
+  pte32_t * pte = NULL;
+
+  if (info->direct_map_pt == 0) {
+    return 0;
+  }
+
+  pde = &(((pde32_t *)V3_VAddr((void *)(info->direct_map_pt)))[PDE32_INDEX(guest_pa)]);
+
+  if ((pde->present == 0) || (pde->large_page == 1)) {
+    // Not mapped by a page of its own, so rebuild it from the memory map
+    return v3_update_passthrough_pts(info, PAGE_ADDR(guest_pa), PAGE_ADDR(guest_pa) + PAGE_SIZE);
+  }
+
+  pte = &(((pte32_t *)V3_VAddr((void *)(addr_t)PDE32_T_ADDR(*pde)))[PTE32_INDEX(guest_pa)]);
+
+  if (pte->present == 0) {
+    return v3_update_passthrough_pts(info, PAGE_ADDR(guest_pa), PAGE_ADDR(guest_pa) + PAGE_SIZE);
+  }
+
+  pte->writable = 1;
+
+  if (info->shdw_pg_mode == NESTED_PAGING) {
+    v3_flush_guest_tlb(info);
+  } else {
+    // Paging is off in the guest, so the faulting virtual address is the physical one
+    v3_flush_guest_tlb_page(info, guest_pa);
+  }
+
+  return 0;
+}
+
+
+/* The inverse for the dirty log: the direct map entries of [guest_start, guest_end) become read only
+ * Only the PTEs of the range are touched, and the TLB is flushed once for all of them
+ */
+int v3_protect_passthrough_pages(struct guest_info * info, addr_t guest_start, addr_t guest_end) {
+  pde32_t * pd = NULL;
+  addr_t guest_pa = PAGE_ADDR(guest_start);
+  int flush = 0;
+
+  if (info->direct_map_pt == 0) {
+    return 0;
+  }
+
+  pd = (pde32_t *)V3_VAddr((void *)(info->direct_map_pt));
+
+  // The second test stops at the top of the address space
+  while ((guest_pa < guest_end) && (guest_pa >= PAGE_ADDR(guest_start))) {
+    pde32_t * pde = &(pd[PDE32_INDEX(guest_pa)]);
+    addr_t next_pde = PD32_4MB_PAGE_ADDR(guest_pa) + PAGE_SIZE_4MB;
+
+    if ((pde->present == 1) && (pde->large_page == 1)) {
+      // Rebuilt with 4KB entries, which follow the dirty log already
+      if (v3_patch_passthrough_pts_32(info, pd, guest_pa, guest_pa + PAGE_SIZE) == -1) {
+	return -1;
+      }
+
+      flush = 1;
+    } else if (pde->present == 1) {
+      pte32_t * pt = (pte32_t *)V3_VAddr((void *)(addr_t)PDE32_T_ADDR(*pde));
+
+      for (; (guest_pa < next_pde) && (guest_pa < guest_end); guest_pa += PAGE_SIZE) {
+	pte32_t * pte = &(pt[PTE32_INDEX(guest_pa)]);
+
+	if ((pte->present == 1) && (pte->writable == 1)) {
+	  pte->writable = 0;
+	  flush = 1;
+	}
+      }
+    }
+
+    guest_pa = next_pde;
+  }
+
+  if (flush) {
+    v3_flush_guest_tlb(info);
+  }
+
+  return 0;
+}
+
 
 
 
@@ -24,6 +24,7 @@
 #include <palacios/vmm.h>
 #include <palacios/vm_guest_mem.h>
 #include <palacios/vmm_decoder.h>
+#include <palacios/vmm_ctrl_regs.h>
 
 #ifndef DEBUG_SHADOW_PAGING
 #undef PrintDebug
@@ -39,14 +40,24 @@
 
 
 
-DEFINE_HASHTABLE_INSERT(add_cr3_to_cache, addr_t, struct hashtable *);
-DEFINE_HASHTABLE_SEARCH(find_cr3_in_cache, addr_t, struct hashtable *);
-DEFINE_HASHTABLE_REMOVE(del_cr3_from_cache, addr_t, struct hashtable *, 0);
+DEFINE_HASHTABLE_INSERT(add_cr3_to_cache, addr_t, struct shadow_cr3_entry *);
+DEFINE_HASHTABLE_SEARCH(find_cr3_in_cache, addr_t, struct shadow_cr3_entry);
+DEFINE_HASHTABLE_REMOVE(del_cr3_from_cache, addr_t, struct shadow_cr3_entry, 0);
 
 
-DEFINE_HASHTABLE_INSERT(add_pte_map, addr_t, addr_t);
-DEFINE_HASHTABLE_SEARCH(find_pte_map, addr_t, addr_t);
-DEFINE_HASHTABLE_REMOVE(del_pte_map, addr_t, addr_t, 0);
+DEFINE_HASHTABLE_INSERT(add_guest_frame, addr_t, struct guest_frame *);
+DEFINE_HASHTABLE_SEARCH(find_guest_frame, addr_t, struct guest_frame);
+DEFINE_HASHTABLE_REMOVE(del_guest_frame, addr_t, struct guest_frame, 0);
+
+
+DEFINE_HASHTABLE_INSERT(add_shadow_table, addr_t, struct shadow_table *);
+DEFINE_HASHTABLE_SEARCH(find_shadow_table, addr_t, struct shadow_table);
+DEFINE_HASHTABLE_REMOVE(del_shadow_table, addr_t, struct shadow_table, 0);
+
+
+DEFINE_HASHTABLE_INSERT(add_shared_pt, addr_t, struct shadow_table *);
+DEFINE_HASHTABLE_SEARCH(find_shared_pt, addr_t, struct shadow_table);
+DEFINE_HASHTABLE_REMOVE(del_shared_pt, addr_t, struct shadow_table, 0);
 
 
 
@@ -76,6 +87,135 @@ static int handle_shadow_pte32_fault(struct guest_info* info,
 
 static int handle_shadow_pagefault32(struct guest_info * info, addr_t fault_addr, pf_error_t error_code);
 
+
+
+
+/*
+ * Shadow page pool
+ *
+ * Shadow tables are built and torn down constantly, so their pages are recycled 
+ * through a per guest pool instead of the host allocator.
+ * Freed pages are queued dirty and cleared later, when the guest is idle.
+ */
+
+static void refill_shadow_page_pool(struct shadow_page_pool * pool) {
+
+  // Clear the freed pages first, they are already ours
+  while ((pool->num_dirty > 0) && (pool->num_zeroed < pool->high_watermark)) {
+    struct list_head * page = pool->dirty.next;
+
+    list_del(page);
+    pool->num_dirty--;
+
+    memset(page, 0, PAGE_SIZE);
+
+    list_add(page, &(pool->zeroed));
+    pool->num_zeroed++;
+  }
+
+  /* Return the excess to the host. The host interface only frees single pages,
+   * so this is one call per page, but it happens here off the fault path rather than on each free
+   */
+  while (pool->num_dirty > 0) {
+    struct list_head * page = pool->dirty.next;
+
+    list_del(page);
+    pool->num_dirty--;
+
+    V3_FreePage(V3_PAddr(page));
+  }
+
+  if (pool->num_zeroed >= pool->low_watermark) {
+    return;
+  }
+
+  while (pool->num_zeroed < pool->high_watermark) {
+    void * page_pa = V3_AllocPages(1);
+    struct list_head * page = NULL;
+
+    if (page_pa == NULL) {
+      PrintError("Could not refill shadow page pool (%d pages)\n", pool->num_zeroed);
+      return;
+    }
+
+    page = (struct list_head *)V3_VAddr(page_pa);
+    memset(page, 0, PAGE_SIZE);
+
+    list_add(page, &(pool->zeroed));
+    pool->num_zeroed++;
+  }
+}
+
+
+static void init_shadow_page_pool(struct shadow_page_state * state) {
+  struct shadow_page_pool * pool = &(state->page_pool);
+
+  INIT_LIST_HEAD(&(pool->zeroed));
+  pool->num_zeroed = 0;
+  INIT_LIST_HEAD(&(pool->dirty));
+  pool->num_dirty = 0;
+
+  pool->low_watermark = SHADOW_POOL_LOW_WATERMARK;
+  pool->high_watermark = SHADOW_POOL_HIGH_WATERMARK;
+
+  refill_shadow_page_pool(pool);
+}
+
+
+void v3_refill_shadow_page_pool(struct guest_info * info) {
+  if (info->shdw_pg_mode != SHADOW_PAGING) {
+    return;
+  }
+
+  refill_shadow_page_pool(&(info->shdw_pg_state.page_pool));
+}
+
+
+// Returns the host virtual address of a zeroed page, or 0 if the host is out of memory
+static addr_t alloc_shadow_page(struct shadow_page_state * state) {
+  struct shadow_page_pool * pool = &(state->page_pool);
+  struct list_head * page = NULL;
+
+  if (pool->num_zeroed > 0) {
+    page = pool->zeroed.next;
+    list_del(page);
+    pool->num_zeroed--;
+
+    memset(page, 0, sizeof(struct list_head));
+  } else if (pool->num_dirty > 0) {
+    page = pool->dirty.next;
+    list_del(page);
+    pool->num_dirty--;
+
+    memset(page, 0, PAGE_SIZE);
+  } else {
+    void * page_pa = NULL;
+
+    PrintDebug("Shadow page pool is empty, going to the host\n");
+
+    page_pa = V3_AllocPages(1);
+
+    if (page_pa == NULL) {
+      PrintError("Could not allocate shadow page\n");
+      return 0;
+    }
+
+    page = (struct list_head *)V3_VAddr(page_pa);
+    memset(page, 0, PAGE_SIZE);
+  }
+
+  return (addr_t)page;
+}
+
+
+static void free_shadow_page(struct shadow_page_state * state, addr_t page) {
+  struct shadow_page_pool * pool = &(state->page_pool);
+
+  list_add((struct list_head *)page, &(pool->dirty));
+  pool->num_dirty++;
+}
+
+
 int v3_init_shadow_page_state(struct guest_info * info) {
   struct shadow_page_state * state = &(info->shdw_pg_state);
   
@@ -84,112 +224,940 @@ int v3_init_shadow_page_state(struct guest_info * info) {
 
 
   state->cr3_cache = create_hashtable(0, &cr3_hash_fn, &cr3_equals);
+  INIT_LIST_HEAD(&(state->cr3_lru));
+  state->num_cached_cr3s = 0;
+  state->current_cr3 = NULL;
+
+  state->guest_frames = create_hashtable(0, &pte_hash_fn, &pte_equals);
+  state->shadow_tables = create_hashtable(0, &pte_hash_fn, &pte_equals);
+  state->shared_pts = create_hashtable(0, &pte_hash_fn, &pte_equals);
+  INIT_LIST_HEAD(&(state->unsynced_tables));
+
+  state->prefetch_window = SHADOW_PTE_PREFETCH_WINDOW;
 
-  state->cached_cr3 = 0;
-  state->cached_ptes = NULL;
+  init_shadow_page_pool(state);
+
+  INIT_LIST_HEAD(&(state->reclaim_list));
 
   return 0;
 }
 
 
 
+/* 
+ * Shadow page table reverse map
+ *
+ * Every shadow table remembers the guest page table page it was built from, 
+ * and every guest page remembers the shadow tables built from it and the shadow PTEs mapping it.
+ * A guest page is write protected while any shadow table is in sync with it.
+ * The first write to it moves those tables to the unsynced list and lifts the protection, 
+ * so the guest can keep updating the page without further exits.
+ *
+ * Unsynced page tables stay writable until the guest loads CR3, 
+ * only the entries the guest actually touches are checked in the meantime:
+ * a faulting entry is compared against the guest PTE, and INVLPG drops its entry.
+ * On CR3 load every unsynced table is compared against the guest table, 
+ * the entries that no longer match are dropped, and the protection comes back.
+ * Page directories are resynced at the next shadow fault, since every fault walks them.
+ */
 
-/*
- For now we'll do something a little more lightweight
-int cache_page_tables32(struct guest_info * info, addr_t pde) {
-  struct shadow_page_state * state = &(info->shdw_pg_state);
-  addr_t pde_host_addr;
-  pde32_t * tmp_pde;
-  struct hashtable * pte_cache = NULL;
-  int i = 0;
+static struct guest_frame * get_guest_frame(struct shadow_page_state * state, addr_t guest_pa) {
+  struct guest_frame * frame = find_guest_frame(state->guest_frames, guest_pa);
+
+  if (frame != NULL) {
+    return frame;
+  }
+
+  frame = (struct guest_frame *)V3_Malloc(sizeof(struct guest_frame));
+
+  if (frame == NULL) {
+    PrintError("Could not allocate guest frame for %p\n", (void *)guest_pa);
+    return NULL;
+  }
+
+  frame->guest_pa = guest_pa;
+  INIT_LIST_HEAD(&(frame->tables));
+  frame->num_tables = 0;
+  INIT_LIST_HEAD(&(frame->mappings));
+
+  add_guest_frame(state->guest_frames, guest_pa, frame);
+
+  return frame;
+}
+
+
+static void put_guest_frame(struct shadow_page_state * state, struct guest_frame * frame) {
+  if ((frame->num_tables > 0) || (!list_empty(&(frame->mappings)))) {
+    return;
+  }
+
+  del_guest_frame(state->guest_frames, frame->guest_pa);
+  V3_Free(frame);
+}
 
 
-  pte_cache = (struct hashtable *)find_cr3_in_cache(state->cr3_cache, pde);
-  if (pte_cache != NULL) {
-    PrintError("CR3 already present in cache\n");
-    state->current_ptes = pte_cache;
-    return 1;
+static int is_guest_pt_frame(struct shadow_page_state * state, addr_t guest_pa) {
+  struct guest_frame * frame = find_guest_frame(state->guest_frames, PT32_PAGE_ADDR(guest_pa));
+
+  return ((frame != NULL) && (frame->num_tables > 0));
+}
+
+
+static addr_t large_page_key(addr_t guest_pa) {
+  return (PD32_4MB_PAGE_ADDR(guest_pa) | 0x2);
+}
+
+
+// Record that entry 'index' of a shadow table maps the guest frame 'key'
+static int map_table_entry(struct shadow_page_state * state, struct shadow_table * table, 
+			   uint_t index, addr_t key) {
+  struct shadow_pte_map * map = table->maps[index];
+  struct guest_frame * frame = NULL;
+
+  if (map != NULL) {
+    if (map->frame->guest_pa == key) {
+      return 0;
+    }
+
+    list_del(&(map->link));
+    put_guest_frame(state, map->frame);
   } else {
-    PrintError("Creating new CR3 cache entry\n");
-    pte_cache = create_hashtable(0, &pte_hash_fn, &pte_equals);
-    state->current_ptes = pte_cache;
-    add_cr3_to_cache(state->cr3_cache, pde, pte_cache);
+    map = (struct shadow_pte_map *)V3_Malloc(sizeof(struct shadow_pte_map));
+
+    if (map == NULL) {
+      PrintError("Could not allocate shadow PTE reverse map entry\n");
+      return -1;
+    }
+
+    map->shadow_pte = &(((pte32_t *)(table->page))[index]);
+    map->table = table;
+    map->index = index;
+    table->maps[index] = map;
   }
 
-  if (guest_pa_to_host_va(info, pde, &pde_host_addr) == -1) {
-    PrintError("Could not lookup host address of guest PDE\n");
+  frame = get_guest_frame(state, key);
+
+  if (frame == NULL) {
+    table->maps[index] = NULL;
+    V3_Free(map);
     return -1;
   }
 
-  tmp_pde = (pde32_t *)pde_host_addr;
+  map->frame = frame;
+  list_add(&(map->link), &(frame->mappings));
 
-  add_pte_map(pte_cache, pde, pde_host_addr);
+  return 0;
+}
 
 
-  for (i = 0; i < MAX_PDE32_ENTRIES; i++) {
-    if ((tmp_pde[i].present) && (tmp_pde[i].large_page == 0)) {
-      addr_t pte_host_addr;
+static int map_shadow_pte(struct shadow_page_state * state, struct shadow_table * table, 
+			  uint_t index, addr_t guest_pa) {
+  return map_table_entry(state, table, index, PT32_PAGE_ADDR(guest_pa));
+}
 
-      if (guest_pa_to_host_va(info, (addr_t)(PDE32_T_ADDR(tmp_pde[i])), &pte_host_addr) == -1) {
-	PrintError("Could not lookup host address of guest PDE\n");
-	return -1;
+
+static void unmap_table_entry(struct shadow_page_state * state, struct shadow_table * table, uint_t index) {
+  struct shadow_pte_map * map = table->maps[index];
+
+  if (map != NULL) {
+    list_del(&(map->link));
+    put_guest_frame(state, map->frame);
+    V3_Free(map);
+    table->maps[index] = NULL;
+  }
+}
+
+
+static void zap_shadow_pte(struct shadow_page_state * state, struct shadow_table * table, uint_t index) {
+  pte32_t * shadow_pt = (pte32_t *)(table->page);
+
+  unmap_table_entry(state, table, index);
+
+  *(uint_t *)&(shadow_pt[index]) = 0;
+}
+
+
+// Called when a page becomes a guest page table page: its mappings must trap writes
+static void write_protect_guest_frame(struct guest_info * info, struct guest_frame * frame) {
+  struct shadow_pte_map * map = NULL;
+  int flush = 0;
+
+  list_for_each_entry(map, &(frame->mappings), link) {
+    if (map->shadow_pte->writable == 1) {
+      map->shadow_pte->writable = 0;
+      flush = 1;
+    }
+
+    map->shadow_pte->vmm_info = PT32_GUEST_PT;
+  }
+
+  if (flush) {
+    // We don't track the virtual addresses of the mappings
+    v3_flush_guest_tlb(info);
+  }
+}
+
+
+static void zap_shadow_pde(struct shadow_page_state * state, struct shadow_table * pd, uint_t index);
+
+// A 4MB shadow mapping can't write protect a single page, so drop it and let it be split on the next fault
+static void split_large_mappings(struct guest_info * info, addr_t guest_pa) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  struct guest_frame * large_frame = find_guest_frame(state->guest_frames, large_page_key(guest_pa));
+
+  if (large_frame == NULL) {
+    return;
+  }
+
+  PrintDebug("Splitting 4MB shadow mappings of %p\n", (void *)PD32_4MB_PAGE_ADDR(guest_pa));
+
+  // The frame is freed along with its last mapping
+  while (large_frame != NULL) {
+    struct shadow_pte_map * map = list_entry(large_frame->mappings.next, struct shadow_pte_map, link);
+    int last = (map->link.next == &(large_frame->mappings));
+
+    zap_shadow_pde(state, map->table, map->index);
+
+    if (last) {
+      break;
+    }
+  }
+
+  v3_flush_guest_tlb(info);
+}
+
+
+// Drop every shadow mapping of the guest pages in [guest_start, guest_end)
+void v3_zap_shadow_mappings(struct guest_info * info, addr_t guest_start, addr_t guest_end) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  addr_t guest_pa = 0;
+  int flush = 0;
+
+  if ((info->shdw_pg_mode != SHADOW_PAGING) || (state->guest_frames == NULL)) {
+    return;
+  }
+
+  for (guest_pa = PT32_PAGE_ADDR(guest_start); guest_pa < guest_end; guest_pa += PAGE_SIZE) {
+    struct guest_frame * frame = find_guest_frame(state->guest_frames, guest_pa);
+
+    // The frame is freed along with its last mapping, unless it is also a page table
+    while ((frame != NULL) && (!list_empty(&(frame->mappings)))) {
+      struct shadow_pte_map * map = list_entry(frame->mappings.next, struct shadow_pte_map, link);
+      int last = ((map->link.next == &(frame->mappings)) && (frame->num_tables == 0));
+
+      zap_shadow_pte(state, map->table, map->index);
+      flush = 1;
+
+      if (last) {
+	break;
+      }
+    }
+  }
+
+  if (flush) {
+    v3_flush_guest_tlb(info);
+  }
+}
+
+
+// Make the shadow mappings of the guest pages in [guest_start, guest_end) read only, so their next write faults
+// Used by the dirty log, the mappings keep their vmm_info so guest page tables stay marked
+void v3_write_protect_shadow_mappings(struct guest_info * info, addr_t guest_start, addr_t guest_end) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  addr_t guest_pa = 0;
+  int flush = 0;
+
+  if ((info->shdw_pg_mode != SHADOW_PAGING) || (state->guest_frames == NULL)) {
+    return;
+  }
+
+  for (guest_pa = PT32_PAGE_ADDR(guest_start); guest_pa < guest_end; guest_pa += PAGE_SIZE) {
+    struct guest_frame * frame = NULL;
+    struct shadow_pte_map * map = NULL;
+
+    if ((guest_pa == PT32_PAGE_ADDR(guest_start)) || (PD32_4MB_PAGE_OFFSET(guest_pa) == 0)) {
+      split_large_mappings(info, guest_pa);
+    }
+
+    frame = find_guest_frame(state->guest_frames, guest_pa);
+
+    if (frame == NULL) {
+      continue;
+    }
+
+    list_for_each_entry(map, &(frame->mappings), link) {
+      if (map->shadow_pte->writable == 1) {
+	map->shadow_pte->writable = 0;
+	flush = 1;
       }
+    }
+  }
+
+  if (flush) {
+    v3_flush_guest_tlb(info);
+  }
+}
+
+
+// Drop the 4MB shadow PDEs of every cached address space, their ranges fault back in as 4KB shadow PTEs
+// Without CR4.PSE the hardware would take them for pointers to page tables
+void v3_drop_large_shadow_pdes(struct guest_info * info) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  struct shadow_cr3_entry * entry = NULL;
+  int flush = 0;
+
+  if (info->shdw_pg_mode != SHADOW_PAGING) {
+    return;
+  }
+
+  list_for_each_entry(entry, &(state->cr3_lru), lru_link) {
+    struct shadow_table * pd = find_shadow_table(state->shadow_tables, entry->shadow_pd);
+    pde32_t * shadow_pd = (pde32_t *)(entry->shadow_pd);
+    uint_t i = 0;
+
+    if (pd == NULL) {
+      continue;
+    }
+
+    for (i = 0; i < MAX_PDE32_ENTRIES; i++) {
+      if ((shadow_pd[i].present == 1) && (shadow_pd[i].large_page == 1)) {
+	zap_shadow_pde(state, pd, i);
+	flush = 1;
+      }
+    }
+  }
+
+  if (flush) {
+    v3_flush_guest_tlb(info);
+  }
+}
+
+
+// Start tracking writes to the source page of a table
+static int attach_shadow_table(struct guest_info * info, struct shadow_table * table) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  struct guest_frame * frame = NULL;
+
+  if ((table->has_source == 0) || (table->frame != NULL)) {
+    return 0;
+  }
+
+  frame = get_guest_frame(state, table->guest_pa);
+
+  if (frame == NULL) {
+    return -1;
+  }
+
+  table->frame = frame;
+  list_add(&(table->frame_link), &(frame->tables));
+  frame->num_tables++;
+
+  if (frame->num_tables == 1) {
+    split_large_mappings(info, frame->guest_pa);
+    write_protect_guest_frame(info, frame);
+  }
+
+  return 0;
+}
+
+
+static void detach_shadow_table(struct shadow_page_state * state, struct shadow_table * table) {
+  struct guest_frame * frame = table->frame;
+
+  if (frame == NULL) {
+    return;
+  }
+
+  list_del(&(table->frame_link));
+  frame->num_tables--;
+  table->frame = NULL;
+
+  put_guest_frame(state, frame);
+}
+
+
+static struct shadow_table * create_shadow_table(struct shadow_page_state * state, int is_pd) {
+  struct shadow_table * table = (struct shadow_table *)V3_Malloc(sizeof(struct shadow_table));
+
+  if (table == NULL) {
+    PrintError("Could not allocate shadow table descriptor\n");
+    return NULL;
+  }
+
+  table->page = alloc_shadow_page(state);
+
+  if (table->page == 0) {
+    V3_Free(table);
+    return NULL;
+  }
+
+  table->is_pd = is_pd;
+  table->has_source = 0;
+  table->guest_pa = 0;
+  table->frame = NULL;
+  table->unsynced = 0;
+  table->maps = NULL;
+  table->num_parents = 0;
+
+  table->maps = (struct shadow_pte_map **)V3_Malloc(sizeof(struct shadow_pte_map *) * MAX_PTE32_ENTRIES);
+
+  if (table->maps == NULL) {
+    PrintError("Could not allocate shadow PTE reverse map\n");
+    free_shadow_page(state, table->page);
+    V3_Free(table);
+    return NULL;
+  }
+
+  memset(table->maps, 0, sizeof(struct shadow_pte_map *) * MAX_PTE32_ENTRIES);
+
+  add_shadow_table(state->shadow_tables, table->page, table);
+
+  return table;
+}
+
+
+static void free_shadow_table(struct shadow_page_state * state, struct shadow_table * table);
+
+
+/* 
+ * Shared shadow page tables
+ *
+ * A shadow PT only depends on the guest PT it was built from (or on the 4MB guest page), 
+ * so all shadow PDs whose guest PDs point at the same guest PT use one shadow PT.
+ * Kernel mappings, which every guest address space shares, are thus faulted in once
+ * and linked into each new shadow PD. Writes to the guest PT are tracked through 
+ * the reverse map as for any other shadow table.
+ */
+
+static addr_t shared_pt_key(addr_t guest_pa, int has_source) {
+  return (has_source) ? guest_pa : (guest_pa | 0x1);
+}
+
+
+static struct shadow_table * find_pt_for_pde(struct shadow_page_state * state, pde32_t * guest_pde) {
+  if (guest_pde->large_page == 0) {
+    return find_shared_pt(state->shared_pts, shared_pt_key(PDE32_T_ADDR(*guest_pde), 1));
+  }
+
+  return find_shared_pt(state->shared_pts, shared_pt_key(PDE32_4MB_T_ADDR(*(pde32_4MB_t *)guest_pde), 0));
+}
+
+
+// Returns the shadow page table for a guest PDE with a reference taken
+static struct shadow_table * get_pt_for_pde(struct shadow_page_state * state, pde32_t * guest_pde) {
+  struct shadow_table * pt = find_pt_for_pde(state, guest_pde);
+
+  if (pt == NULL) {
+    pt = create_shadow_table(state, 0);
+
+    if (pt == NULL) {
+      return NULL;
+    }
+
+    if (guest_pde->large_page == 0) {
+      // Attached to the guest PT when it gets its first entry
+      pt->has_source = 1;
+      pt->guest_pa = PDE32_T_ADDR(*guest_pde);
+    } else {
+      pt->guest_pa = PDE32_4MB_T_ADDR(*(pde32_4MB_t *)guest_pde);
+    }
+
+    add_shared_pt(state->shared_pts, shared_pt_key(pt->guest_pa, pt->has_source), pt);
+  }
+
+  pt->num_parents++;
+
+  return pt;
+}
+
+
+static void zap_shadow_pde(struct shadow_page_state * state, struct shadow_table * pd, uint_t index) {
+  pde32_t * shadow_pde = &(((pde32_t *)(pd->page))[index]);
+
+  if ((shadow_pde->present == 1) && (shadow_pde->large_page == 1)) {
+    unmap_table_entry(state, pd, index);
+  } else if (shadow_pde->present == 1) {
+    addr_t pt_va = (addr_t)V3_VAddr((void *)(addr_t)PDE32_T_ADDR(*shadow_pde));
+    struct shadow_table * pt = find_shadow_table(state->shadow_tables, pt_va);
+
+    if (pt != NULL) {
+      pt->num_parents--;
+
+      if (pt->num_parents == 0) {
+	free_shadow_table(state, pt);
+      }
+    }
+  }
+
+  *(uint_t *)shadow_pde = 0;
+}
+
+
+// Drop every entry of a shadow table, page directories free their page tables
+static void zap_shadow_table(struct shadow_page_state * state, struct shadow_table * table) {
+  uint_t i = 0;
+
+  if (table->is_pd) {
+    pde32_t * shadow_pd = (pde32_t *)(table->page);
+
+    for (i = 0; i < MAX_PDE32_ENTRIES; i++) {
+      if (shadow_pd[i].present == 1) {
+	zap_shadow_pde(state, table, i);
+      }
+    }
+  } else {
+    pte32_t * shadow_pt = (pte32_t *)(table->page);
+
+    for (i = 0; i < MAX_PTE32_ENTRIES; i++) {
+      if ((shadow_pt[i].present == 1) || (table->maps[i] != NULL)) {
+	zap_shadow_pte(state, table, i);
+      }
+    }
+  }
+}
+
+
+static void free_shadow_table(struct shadow_page_state * state, struct shadow_table * table) {
+  zap_shadow_table(state, table);
+  detach_shadow_table(state, table);
+
+  if (table->unsynced) {
+    list_del(&(table->unsync_link));
+  }
+
+  if (table->is_pd == 0) {
+    del_shared_pt(state->shared_pts, shared_pt_key(table->guest_pa, table->has_source));
+  }
+
+  del_shadow_table(state->shadow_tables, table->page);
+  free_shadow_page(state, table->page);
+
+  V3_Free(table->maps);
+  V3_Free(table);
+}
+
+
+// The guest is writing one of its page table pages
+static void unsync_guest_frame(struct shadow_page_state * state, addr_t guest_pa) {
+  struct guest_frame * frame = find_guest_frame(state->guest_frames, PT32_PAGE_ADDR(guest_pa));
+  struct shadow_table * table = NULL;
+  struct shadow_table * tmp = NULL;
+
+  if ((frame == NULL) || (frame->num_tables == 0)) {
+    return;
+  }
+
+  PrintDebug("Guest page table %p written, unsyncing %d shadow tables\n", 
+	     (void *)(frame->guest_pa), frame->num_tables);
+
+  list_for_each_entry_safe(table, tmp, &(frame->tables), frame_link) {
+    list_del(&(table->frame_link));
+    table->frame = NULL;
+
+    table->unsynced = 1;
+    list_add(&(table->unsync_link), &(state->unsynced_tables));
+  }
+
+  frame->num_tables = 0;
+  put_guest_frame(state, frame);
+}
+
+
+static int shadow_pte_in_sync(pte32_t * shadow_pte, pte32_t * guest_pte, struct shadow_pte_map * map) {
+  if ((guest_pte->present == 0) || (guest_pte->accessed == 0)) {
+    return 0;
+  }
+
+  if ((map == NULL) || (map->frame->guest_pa != PTE32_T_ADDR(*guest_pte))) {
+    return 0;
+  }
+
+  if (shadow_pte->user_page != guest_pte->user_page) {
+    return 0;
+  }
+
+  // Writable shadow entries imply a writable and dirty guest entry
+  if ((shadow_pte->writable == 1) && 
+      ((guest_pte->writable == 0) || (guest_pte->dirty == 0))) {
+    return 0;
+  }
+
+  return 1;
+}
+
+
+static int shadow_pde_in_sync(pde32_t * shadow_pde, pde32_t * guest_pde, struct shadow_table * pt) {
+  if ((pt == NULL) || (guest_pde->present == 0) || (guest_pde->accessed == 0)) {
+    return 0;
+  }
+
+  if (shadow_pde->user_page != guest_pde->user_page) {
+    return 0;
+  }
+
+  if (guest_pde->large_page == 0) {
+    return ((pt->has_source == 1) && 
+	    (pt->guest_pa == PDE32_T_ADDR(*guest_pde)) && 
+	    (shadow_pde->writable == guest_pde->writable));
+  } else {
+    pde32_4MB_t * large_guest_pde = (pde32_4MB_t *)guest_pde;
+
+    if ((pt->has_source == 1) || (pt->guest_pa != PDE32_4MB_T_ADDR(*large_guest_pde))) {
+      return 0;
+    }
+
+    // Writable only once the guest page is dirty
+    return (shadow_pde->writable == ((large_guest_pde->writable == 1) && (large_guest_pde->dirty == 1)));
+  }
+}
+
+
+static int large_shadow_pde_in_sync(pde32_4MB_t * large_shadow_pde, pde32_t * guest_pde, struct shadow_pte_map * map) {
+  pde32_4MB_t * large_guest_pde = (pde32_4MB_t *)guest_pde;
+
+  if ((guest_pde->present == 0) || (guest_pde->accessed == 0) || (guest_pde->large_page == 0)) {
+    return 0;
+  }
+
+  if ((map == NULL) || (map->frame->guest_pa != large_page_key(PDE32_4MB_T_ADDR(*large_guest_pde)))) {
+    return 0;
+  }
+
+  if (large_shadow_pde->user_page != large_guest_pde->user_page) {
+    return 0;
+  }
+
+  return (large_shadow_pde->writable == ((large_guest_pde->writable == 1) && (large_guest_pde->dirty == 1)));
+}
+
+
+// Compare an unsynced table with its source page, dropping the entries that changed
+static int resync_shadow_table(struct guest_info * info, struct shadow_table * table) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  addr_t guest_table = 0;
+  int freed_pts = 0;
+  uint_t i = 0;
+
+  list_del(&(table->unsync_link));
+  table->unsynced = 0;
+
+  if (guest_pa_to_host_va(info, table->guest_pa, &guest_table) == -1) {
+    PrintError("Invalid guest page table address %p, dropping its shadow\n", (void *)(table->guest_pa));
+    zap_shadow_table(state, table);
+    v3_flush_guest_tlb(info);
+    return 0;
+  }
+
+  if (table->is_pd) {
+    pde32_t * shadow_pd = (pde32_t *)(table->page);
+    pde32_t * guest_pd = (pde32_t *)guest_table;
+
+    for (i = 0; i < MAX_PDE32_ENTRIES; i++) {
+      struct shadow_table * pt = NULL;
+
+      if (shadow_pd[i].present == 0) {
+	continue;
+      }
+
+      if (shadow_pd[i].large_page == 1) {
+	if (large_shadow_pde_in_sync((pde32_4MB_t *)&(shadow_pd[i]), &(guest_pd[i]), table->maps[i]) == 0) {
+	  zap_shadow_pde(state, table, i);
+	  freed_pts = 1;
+	}
+
+	continue;
+      }
+
+      pt = find_shadow_table(state->shadow_tables, (addr_t)V3_VAddr((void *)(addr_t)PDE32_T_ADDR(shadow_pd[i])));
+
+      if (shadow_pde_in_sync(&(shadow_pd[i]), &(guest_pd[i]), pt) == 0) {
+	zap_shadow_pde(state, table, i);
+	freed_pts = 1;
+      }
+    }
+  } else {
+    pte32_t * shadow_pt = (pte32_t *)(table->page);
+    pte32_t * guest_pt = (pte32_t *)guest_table;
+
+    for (i = 0; i < MAX_PTE32_ENTRIES; i++) {
+      if (shadow_pt[i].present == 0) {
+	continue;
+      }
+
+      if (shadow_pte_in_sync(&(shadow_pt[i]), &(guest_pt[i]), table->maps[i]) == 0) {
+	zap_shadow_pte(state, table, i);
+      }
+    }
+  }
+
+  if (freed_pts) {
+    // The freed tables may still be cached by the page walker
+    v3_flush_guest_tlb(info);
+  }
+
+  return attach_shadow_table(info, table);
+}
+
+
+// Make sure a table is in sync with the guest before it is used
+static int sync_shadow_table(struct guest_info * info, struct shadow_table * table) {
+  if (table->unsynced) {
+    return resync_shadow_table(info, table);
+  }
+
+  return attach_shadow_table(info, table);
+}
+
+
+static int resync_all_shadow_tables(struct guest_info * info) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+
+  // Resyncing a directory can free unsynced tables, so always restart from the head
+  while (!list_empty(&(state->unsynced_tables))) {
+    struct shadow_table * table = list_entry(state->unsynced_tables.next, struct shadow_table, unsync_link);
+
+    if (resync_shadow_table(info, table) == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+
+/* 
+ * Retired shadow roots
+ *
+ * Freeing a whole shadow hierarchy can take a while, so evicted page directories 
+ * are only detached from the guest and queued. Their page tables are freed 
+ * a few at a time on each exit, and the rest whenever the guest halts.
+ */
+
+static void retire_shadow_pd(struct shadow_page_state * state, struct shadow_table * pd) {
+  detach_shadow_table(state, pd);
+
+  if (pd->unsynced) {
+    list_del(&(pd->unsync_link));
+    pd->unsynced = 0;
+  }
+
+  list_add_tail(&(pd->reclaim_link), &(state->reclaim_list));
+}
+
+
+void v3_reclaim_shadow_tables(struct guest_info * info, uint_t max_pts) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+
+  if (info->shdw_pg_mode != SHADOW_PAGING) {
+    return;
+  }
+
+  while (!list_empty(&(state->reclaim_list))) {
+    struct shadow_table * pd = list_entry(state->reclaim_list.next, struct shadow_table, reclaim_link);
+    pde32_t * shadow_pd = (pde32_t *)(pd->page);
+    uint_t i = 0;
+
+    for (i = 0; i < MAX_PDE32_ENTRIES; i++) {
+      if (shadow_pd[i].present == 0) {
+	continue;
+      }
+
+      if (max_pts == 0) {
+	return;
+      }
+
+      zap_shadow_pde(state, pd, i);
+      max_pts--;
+    }
+
+    list_del(&(pd->reclaim_link));
+    free_shadow_table(state, pd);
+  }
+}
+
+
+
+/* 
+ * Shadow CR3 cache
+ *
+ * The shadow page directories of recently used guest CR3 values are kept around.
+ * The reverse map keeps them consistent with the guest tables, 
+ * so switching back to one only has to resync the tables the guest wrote in the meantime.
+ */
+
+static void free_cr3_entry(struct shadow_page_state * state, struct shadow_cr3_entry * entry) {
+  struct shadow_table * pd = find_shadow_table(state->shadow_tables, entry->shadow_pd);
+
+  PrintDebug("Retiring shadow page tables for guest CR3 %p\n", (void *)(entry->guest_cr3));
+
+  if (pd != NULL) {
+    retire_shadow_pd(state, pd);
+  }
+
+  del_cr3_from_cache(state->cr3_cache, entry->guest_cr3);
+  list_del(&(entry->lru_link));
+  state->num_cached_cr3s--;
+
+  if (state->current_cr3 == entry) {
+    state->current_cr3 = NULL;
+  }
+
+  V3_Free(entry);
+}
+
+
+// Point a new shadow PD at the shadow PTs that already exist for its guest PDEs
+static int link_shared_pts(struct guest_info * info, struct shadow_table * pd) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  pde32_t * shadow_pd = (pde32_t *)(pd->page);
+  pde32_t * guest_pd = NULL;
+  uint_t num_linked = 0;
+  uint_t i = 0;
+
+  if (guest_pa_to_host_va(info, pd->guest_pa, (addr_t *)&guest_pd) == -1) {
+    // Will be caught by the fault handler
+    return 0;
+  }
+
+  for (i = 0; i < MAX_PDE32_ENTRIES; i++) {
+    pde32_t * guest_pde = &(guest_pd[i]);
+    pde32_t * shadow_pde = &(shadow_pd[i]);
+    struct shadow_table * pt = NULL;
+
+    // Only entries the guest has used, so we don't have to touch the accessed bits
+    if ((guest_pde->present == 0) || (guest_pde->accessed == 0)) {
+      continue;
+    }
+
+    pt = find_pt_for_pde(state, guest_pde);
+
+    if (pt == NULL) {
+      continue;
+    }
+
+    pt->num_parents++;
+
+    shadow_pde->present = 1;
+    shadow_pde->user_page = guest_pde->user_page;
+    shadow_pde->large_page = 0;
+    shadow_pde->write_through = 0;
+    shadow_pde->cache_disable = 0;
+    shadow_pde->global_page = 0;
+    shadow_pde->pt_base_addr = PD32_BASE_ADDR((addr_t)V3_PAddr((void *)(pt->page)));
+
+    if (guest_pde->large_page == 0) {
+      shadow_pde->writable = guest_pde->writable;
+    } else {
+      pde32_4MB_t * large_guest_pde = (pde32_4MB_t *)guest_pde;
 
-      add_pte_map(pte_cache, (addr_t)(PDE32_T_ADDR(tmp_pde[i])), pte_host_addr); 
+      // Clean large pages stay read only so the first write sets the dirty bit
+      shadow_pde->writable = (large_guest_pde->dirty == 1) ? large_guest_pde->writable : 0;
     }
+
+    num_linked++;
   }
 
+  PrintDebug("Linked %d shared shadow page tables\n", num_linked);
+
+  if (num_linked > 0) {
+    return attach_shadow_table(info, pd);
+  }
 
   return 0;
 }
-*/
 
-int v3_cache_page_tables32(struct guest_info * info, addr_t pde) {
+
+static struct shadow_cr3_entry * create_cr3_entry(struct guest_info * info, addr_t guest_pd) {
   struct shadow_page_state * state = &(info->shdw_pg_state);
-  addr_t pde_host_addr;
-  pde32_t * tmp_pde;
-  struct hashtable * pte_cache = NULL;
-  int i = 0;
+  struct shadow_cr3_entry * entry = NULL;
+  struct shadow_table * pd = NULL;
 
-  if (pde == state->cached_cr3) {
-    return 1;
-  }
+  entry = (struct shadow_cr3_entry *)V3_Malloc(sizeof(struct shadow_cr3_entry));
 
-  if (state->cached_ptes != NULL) {
-    hashtable_destroy(state->cached_ptes, 0, 0);
-    state->cached_ptes = NULL;
+  if (entry == NULL) {
+    PrintError("Could not allocate shadow CR3 cache entry\n");
+    return NULL;
   }
 
-  state->cached_cr3 = pde;
+  pd = create_shadow_table(state, 1);
+
+  if (pd == NULL) {
+    V3_Free(entry);
+    return NULL;
+  }
 
-  pte_cache = create_hashtable(0, &pte_hash_fn, &pte_equals);
-  state->cached_ptes = pte_cache;
+  // The directory is attached to the guest PD when it gets its first entry
+  pd->has_source = 1;
+  pd->guest_pa = guest_pd;
 
-  if (guest_pa_to_host_va(info, pde, &pde_host_addr) == -1) {
-    PrintError("Could not lookup host address of guest PDE\n");
-    return -1;
+  if (link_shared_pts(info, pd) == -1) {
+    free_shadow_table(state, pd);
+    V3_Free(entry);
+    return NULL;
   }
 
-  tmp_pde = (pde32_t *)pde_host_addr;
+  entry->guest_cr3 = guest_pd;
+  entry->shadow_pd = pd->page;
 
-  add_pte_map(pte_cache, pde, pde_host_addr);
+  add_cr3_to_cache(state->cr3_cache, guest_pd, entry);
+  list_add(&(entry->lru_link), &(state->cr3_lru));
+  state->num_cached_cr3s++;
 
+  return entry;
+}
 
-  for (i = 0; i < MAX_PDE32_ENTRIES; i++) {
-    if ((tmp_pde[i].present) && (tmp_pde[i].large_page == 0)) {
-      addr_t pte_host_addr;
 
-      if (guest_pa_to_host_va(info, (addr_t)(PDE32_T_ADDR(tmp_pde[i])), &pte_host_addr) == -1) {
-	PrintError("Could not lookup host address of guest PDE\n");
-	return -1;
+/* Switch the shadow page tables to the ones for guest_pd, 
+ * reusing cached tables if we have them
+ */
+int v3_activate_shadow_pt32(struct guest_info * info, addr_t guest_pd) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  struct cr3_32 * shadow_cr3 = (struct cr3_32 *)&(state->shadow_cr3);
+  struct shadow_cr3_entry * entry = find_cr3_in_cache(state->cr3_cache, guest_pd);
+
+  if (state->page_pool.num_zeroed < state->page_pool.low_watermark) {
+    // Not on the page fault path, and a new address space is about to need pages
+    refill_shadow_page_pool(&(state->page_pool));
+  }
+
+  if (entry == NULL) {
+    if (state->num_cached_cr3s >= SHADOW_CR3_CACHE_SIZE) {
+      struct shadow_cr3_entry * lru = list_entry(state->cr3_lru.prev, struct shadow_cr3_entry, lru_link);
+
+      if (lru != state->current_cr3) {
+	free_cr3_entry(state, lru);
       }
+    }
 
-      add_pte_map(pte_cache, (addr_t)(PDE32_T_ADDR(tmp_pde[i])), pte_host_addr); 
+    entry = create_cr3_entry(info, guest_pd);
+
+    if (entry == NULL) {
+      return -1;
     }
+
+    PrintDebug("Created new shadow page table %p\n", (void *)(entry->shadow_pd));
+  } else {
+    list_move(&(entry->lru_link), &(state->cr3_lru));
+    PrintDebug("Reusing cached shadow Page table\n");
   }
 
-  return 0;
+  // A CR3 load must make every earlier page table write visible
+  if (resync_all_shadow_tables(info) == -1) {
+    PrintError("Could not resync shadow page tables\n");
+    return -1;
+  }
+
+  shadow_cr3->pdt_base_addr = PD32_BASE_ADDR((addr_t)V3_PAddr((void *)(entry->shadow_pd)));
 
+  if (info->mem_mode == VIRTUAL_MEM) {
+    // Drops both the old address space and entries the resync zapped
+    v3_flush_guest_tlb(info);
+  }
+
+  state->current_cr3 = entry;
+
+  return 0;
 }
 
 
@@ -208,6 +1176,8 @@ int v3_replace_shdw_page32(struct guest_info * info, addr_t location, pte32_t *
 
     *(uint_t *)shadow_pte = *(uint_t *)new_page;
 
+    v3_flush_guest_tlb_page(info, location);
+
   } else {
     // currently unhandled
     return -1;
@@ -255,7 +1225,7 @@ addr_t v3_create_new_shadow_pt32() {
 
 
 static void inject_guest_pf(struct guest_info * info, addr_t fault_addr, pf_error_t error_code) {
-  info->ctrl_regs.cr2 = fault_addr;
+  v3_mod_ctrl_regs(info)->cr2 = fault_addr;
   v3_raise_exception_with_error(info, PF_EXCEPTION, *(uint_t *)&error_code);
 }
 
@@ -294,6 +1264,210 @@ static int is_guest_pf(pt_access_status_t guest_access, pt_access_status_t shado
 
 
 
+/* 
+ * 4MB shadow mappings
+ *
+ * A 4MB guest page can be mapped by a single 4MB shadow PDE when the guest range 
+ * is backed by one contiguous, 4MB aligned host region of plain memory,
+ * and none of its pages are guest page tables. Otherwise it is split into 4KB shadow PTEs.
+ */
+
+static int can_map_large_page(struct guest_info * info, addr_t guest_pa) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  struct cr4_32 * cr4 = (struct cr4_32 *)&(v3_get_ctrl_regs(info)->cr4);
+  addr_t host_pa = 0;
+  uint_t i = 0;
+
+  // The dirty log write protects single pages
+  if ((cr4->pse == 0) || (info->dirty_log.enabled == 1)) {
+    return 0;
+  }
+
+  if (get_large_page_backing(&(info->mem_map), guest_pa, PAGE_SIZE_4MB, &host_pa) == 0) {
+    return 0;
+  }
+
+  for (i = 0; i < MAX_PTE32_ENTRIES; i++) {
+    if (is_guest_pt_frame(state, guest_pa + (i * PAGE_SIZE))) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+static int map_large_shadow_pde(struct guest_info * info, struct shadow_table * pd, uint_t index, 
+				pde32_4MB_t * large_guest_pde) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  pde32_4MB_t * large_shadow_pde = (pde32_4MB_t *)&(((pde32_t *)(pd->page))[index]);
+  addr_t guest_pa = PDE32_4MB_T_ADDR(*large_guest_pde);
+
+  if (map_table_entry(state, pd, index, large_page_key(guest_pa)) == -1) {
+    return -1;
+  }
+
+  PrintDebug("Mapping 4MB guest page %p with a 4MB shadow page\n", (void *)guest_pa);
+
+  *(uint_t *)large_shadow_pde = 0;
+
+  large_shadow_pde->present = 1;
+  large_shadow_pde->user_page = large_guest_pde->user_page;
+  large_shadow_pde->one = 1;
+  large_shadow_pde->page_base_addr = PD32_4MB_BASE_ADDR(get_shadow_addr(info, guest_pa));
+
+  large_guest_pde->accessed = 1;
+
+  // Clean pages stay read only so the first write sets the dirty bit
+  large_shadow_pde->writable = (large_guest_pde->dirty == 1) ? large_guest_pde->writable : 0;
+
+  return 0;
+}
+
+
+
+
+/* 
+ * Read only demand pages
+ *
+ * Demand allocated pages without memory of their own (never written, or merged with identical pages)
+ * are mapped read only to the zero page or their shared page.
+ * A write gives the page its own memory, which drops every read only mapping of it.
+ */
+
+static int maps_readonly_page(struct guest_info * info, pte32_t * shadow_pte, addr_t guest_pa) {
+  return ((shadow_pte->present == 1) && 
+	  (get_shadow_addr_type(info, guest_pa) == HOST_REGION_UNALLOCATED));
+}
+
+
+static int map_readonly_page(struct guest_info * info, struct shadow_table * table, 
+			     uint_t index, addr_t guest_pa, int user_page) {
+  pte32_t * shadow_pte = &(((pte32_t *)(table->page))[index]);
+  struct shadow_region * reg = get_shadow_region_by_addr(&(info->mem_map), guest_pa);
+  addr_t host_addr = get_demand_mem_readonly_addr(reg, guest_pa);
+
+  if (host_addr == 0) {
+    return -1;
+  }
+
+  if (map_shadow_pte(&(info->shdw_pg_state), table, index, guest_pa) == -1) {
+    return -1;
+  }
+
+  *(uint_t *)shadow_pte = 0;
+  shadow_pte->page_base_addr = PT32_BASE_ADDR(host_addr);
+  shadow_pte->present = 1;
+  shadow_pte->user_page = user_page;
+  shadow_pte->writable = 0;
+
+  return 0;
+}
+
+
+
+
+/* 
+ * Shadow PTE prefetching
+ *
+ * After a fill, the other entries of its aligned prefetch window are filled as well 
+ * if the guest already uses them, so a sequential scan does not exit on every page.
+ * Hooked pages and guest page tables are left for their own faults.
+ */
+
+static int can_prefetch_page(struct guest_info * info, addr_t guest_pa) {
+  return ((get_shadow_addr_type(info, guest_pa) == HOST_REGION_PHYSICAL_MEMORY) && 
+	  (is_guest_pt_frame(&(info->shdw_pg_state), guest_pa) == 0));
+}
+
+
+static void prefetch_shadow_ptes(struct guest_info * info, struct shadow_table * table, 
+				 pte32_t * guest_pt, uint_t fault_index) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  pte32_t * shadow_pt = (pte32_t *)(table->page);
+  uint_t window = state->prefetch_window;
+  uint_t start = 0;
+  uint_t i = 0;
+
+  if (window <= 1) {
+    return;
+  }
+
+  start = fault_index - (fault_index % window);
+
+  for (i = start; (i < start + window) && (i < MAX_PTE32_ENTRIES); i++) {
+    pte32_t * guest_pte = &(guest_pt[i]);
+    pte32_t * shadow_pte = &(shadow_pt[i]);
+    addr_t guest_pa = PTE32_T_ADDR(*guest_pte);
+
+    if ((i == fault_index) || (shadow_pte->present == 1)) {
+      continue;
+    }
+
+    // Only pages the guest already uses, so we don't have to touch the accessed bits
+    if ((guest_pte->present == 0) || (guest_pte->accessed == 0) || 
+	(can_prefetch_page(info, guest_pa) == 0)) {
+      continue;
+    }
+
+    if (map_shadow_pte(state, table, i, guest_pa) == -1) {
+      return;
+    }
+
+    *(uint_t *)shadow_pte = 0;
+    shadow_pte->page_base_addr = PT32_BASE_ADDR(get_shadow_addr(info, guest_pa));
+    shadow_pte->present = 1;
+    shadow_pte->user_page = guest_pte->user_page;
+
+    // Clean pages stay read only so the first write still sets the guest dirty bit
+    shadow_pte->writable = (guest_pte->dirty == 1) ? guest_pte->writable : 0;
+
+    if (v3_dirty_log_writable(info, guest_pa) == 0) {
+      shadow_pte->writable = 0;
+    }
+  }
+}
+
+
+static void prefetch_large_shadow_ptes(struct guest_info * info, struct shadow_table * table, 
+				       addr_t large_page_pa, uint_t fault_index) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  pte32_t * shadow_pt = (pte32_t *)(table->page);
+  uint_t window = state->prefetch_window;
+  uint_t start = 0;
+  uint_t i = 0;
+
+  if (window <= 1) {
+    return;
+  }
+
+  start = fault_index - (fault_index % window);
+
+  for (i = start; (i < start + window) && (i < MAX_PTE32_ENTRIES); i++) {
+    pte32_t * shadow_pte = &(shadow_pt[i]);
+    addr_t guest_pa = large_page_pa + (i * PAGE_SIZE);
+
+    if ((i == fault_index) || (shadow_pte->present == 1) || 
+	(can_prefetch_page(info, guest_pa) == 0)) {
+      continue;
+    }
+
+    if (map_shadow_pte(state, table, i, guest_pa) == -1) {
+      return;
+    }
+
+    // Permissions come from the shadow PDE, as in handle_large_pagefault32
+    *(uint_t *)shadow_pte = 0;
+    shadow_pte->page_base_addr = PT32_BASE_ADDR(get_shadow_addr(info, guest_pa));
+    shadow_pte->present = 1;
+    shadow_pte->user_page = 1;
+    shadow_pte->writable = v3_dirty_log_writable(info, guest_pa);
+  }
+}
+
+
+
+
 /* The guest status checks have already been done,
  * only special case shadow checks remain
  */
@@ -325,10 +1499,44 @@ static int handle_large_pagefault32(struct guest_info * info,
       return 0;
     }
 
+    if (host_page_type == HOST_REGION_UNALLOCATED) {
+      if (error_code.write == 0) {
+	struct shadow_table * table = find_shadow_table(info->shdw_pg_state.shadow_tables, (addr_t)shadow_pt);
+
+	if (table == NULL) {
+	  PrintError("Untracked shadow page table %p\n", (void *)shadow_pt);
+	  return -1;
+	}
+
+	return map_readonly_page(info, table, PTE32_INDEX(fault_addr), guest_fault_pa, 1);
+      }
+
+      if (alloc_demand_mem(info, guest_fault_pa) == -1) {
+	return -1;
+      }
+
+      host_page_type = HOST_REGION_PHYSICAL_MEMORY;
+    }
+
     if (host_page_type == HOST_REGION_PHYSICAL_MEMORY) {
       struct shadow_page_state * state = &(info->shdw_pg_state);
+      struct shadow_table * table = find_shadow_table(state->shadow_tables, (addr_t)shadow_pt);
       addr_t shadow_pa = get_shadow_addr(info, guest_fault_pa);
 
+      if (table == NULL) {
+	PrintError("Untracked shadow page table %p\n", (void *)shadow_pt);
+	return -1;
+      }
+
+      if ((error_code.write == 1) && (is_guest_pt_frame(state, guest_fault_pa))) {
+	PrintDebug("Immediate Write operation on Guest PAge Table Page (large page)\n");
+	unsync_guest_frame(state, guest_fault_pa);
+      }
+
+      if (map_shadow_pte(state, table, PTE32_INDEX(fault_addr), guest_fault_pa) == -1) {
+	return -1;
+      }
+
       shadow_pte->page_base_addr = PT32_BASE_ADDR(shadow_pa);
 
       shadow_pte->present = 1;
@@ -340,21 +1548,33 @@ static int handle_large_pagefault32(struct guest_info * info,
        */
       shadow_pte->user_page = 1;
 
-      if (find_pte_map(state->cached_ptes, PT32_PAGE_ADDR(guest_fault_pa)) != NULL) {
+      if (is_guest_pt_frame(state, guest_fault_pa)) {
 	// Check if the entry is a page table...
 	PrintDebug("Marking page as Guest Page Table (large page)\n");
 	shadow_pte->vmm_info = PT32_GUEST_PT;
 	shadow_pte->writable = 0;
       } else {
+	shadow_pte->vmm_info = 0;
 	shadow_pte->writable = 1;
       }
 
+      // Pages that are clean in the dirty log stay read only until their first write
+      if (error_code.write == 1) {
+	if (v3_mark_page_dirty(info, guest_fault_pa) == -1) {
+	  return -1;
+	}
+      } else if (v3_dirty_log_writable(info, guest_fault_pa) == 0) {
+	shadow_pte->writable = 0;
+      }
+
 
       //set according to VMM policy
       shadow_pte->write_through = 0;
       shadow_pte->cache_disable = 0;
       shadow_pte->global_page = 0;
       //
+
+      prefetch_large_shadow_ptes(info, table, PDE32_4MB_T_ADDR(*large_guest_pde), PTE32_INDEX(fault_addr));
       
     } else {
       // Handle hooked pages as well as other special pages
@@ -364,12 +1584,29 @@ static int handle_large_pagefault32(struct guest_info * info,
       }
     }
   } else if ((shadow_pte_access == PT_WRITE_ERROR) && 
-	     (shadow_pte->vmm_info == PT32_GUEST_PT)) {
+	     (maps_readonly_page(info, shadow_pte, PDE32_4MB_T_ADDR(*large_guest_pde) + PD32_4MB_PAGE_OFFSET(fault_addr)))) {
+    addr_t guest_fault_pa = PDE32_4MB_T_ADDR(*large_guest_pde) + PD32_4MB_PAGE_OFFSET(fault_addr);
+
+    // The read only mapping is dropped, and the access refaults onto the page's own memory
+    PrintDebug("Write to read only demand page %p (large page)\n", (void *)guest_fault_pa);
+    return alloc_demand_mem(info, guest_fault_pa);
+
+  } else if (shadow_pte_access == PT_WRITE_ERROR) {
+    // The page is a guest page table, or is write protected for the dirty log
+    addr_t guest_fault_pa = PDE32_4MB_T_ADDR(*large_guest_pde) + PD32_4MB_PAGE_OFFSET(fault_addr);
+
+    if (shadow_pte->vmm_info == PT32_GUEST_PT) {
+      PrintDebug("Write operation on Guest PAge Table Page (large page)\n");
+      unsync_guest_frame(&(info->shdw_pg_state), guest_fault_pa);
+      shadow_pte->vmm_info = 0;
+    }
+
+    if (v3_mark_page_dirty(info, guest_fault_pa) == -1) {
+      return -1;
+    }
 
-    struct shadow_page_state * state = &(info->shdw_pg_state);
-    PrintDebug("Write operation on Guest PAge Table Page (large page)\n");
-    state->cached_cr3 = 0;
     shadow_pte->writable = 1;
+    v3_flush_guest_tlb_page(info, fault_addr);
 
   } else {
     PrintError("Error in large page fault handler...\n");
@@ -383,12 +1620,15 @@ static int handle_large_pagefault32(struct guest_info * info,
 
 
 static int handle_shadow_pagefault32(struct guest_info * info, addr_t fault_addr, pf_error_t error_code) {
+  struct shadow_page_state * state = &(info->shdw_pg_state);
   pde32_t * guest_pd = NULL;
   pde32_t * shadow_pd = (pde32_t *)CR3_TO_PDE32(info->shdw_pg_state.shadow_cr3);
+  struct shadow_table * shadow_pd_table = find_shadow_table(state->shadow_tables, (addr_t)shadow_pd);
   addr_t guest_cr3 = (addr_t) V3_PAddr( CR3_TO_PDE32(info->shdw_pg_state.guest_cr3) );
   pt_access_status_t guest_pde_access;
   pt_access_status_t shadow_pde_access;
   pde32_t * guest_pde = NULL;
+  pde32_t old_guest_pde;
   pde32_t * shadow_pde = (pde32_t *)&(shadow_pd[PDE32_INDEX(fault_addr)]);
 
   PrintDebug("Shadow page fault handler: %p\n", (void*) fault_addr );
@@ -399,6 +1639,18 @@ static int handle_shadow_pagefault32(struct guest_info * info, addr_t fault_addr
   } 
 
   guest_pde = (pde32_t *)&(guest_pd[PDE32_INDEX(fault_addr)]);
+  old_guest_pde = *guest_pde;
+
+  if (shadow_pd_table == NULL) {
+    PrintError("Untracked shadow page directory %p\n", (void *)shadow_pd);
+    return -1;
+  }
+
+  // Pick up any guest PDE changes before looking at the shadow PDE
+  if (sync_shadow_table(info, shadow_pd_table) == -1) {
+    PrintError("Could not sync shadow page directory\n");
+    return -1;
+  }
 
 
   // Check the guest page permissions
@@ -416,9 +1668,26 @@ static int handle_shadow_pagefault32(struct guest_info * info, addr_t fault_addr
   }
 
   
-  if (shadow_pde_access == PT_ENTRY_NOT_PRESENT) 
+  if ((shadow_pde_access == PT_ENTRY_NOT_PRESENT) && 
+      (guest_pde->large_page == 1) && 
+      (can_map_large_page(info, PDE32_4MB_T_ADDR(*(pde32_4MB_t *)guest_pde)) == 1))
     {
-      pte32_t * shadow_pt =  (pte32_t *)v3_create_new_shadow_pt32();
+      if (map_large_shadow_pde(info, shadow_pd_table, PDE32_INDEX(fault_addr), (pde32_4MB_t *)guest_pde) == -1) {
+	PrintError("Could not map 4MB shadow page\n");
+	return -1;
+      }
+    }
+  else if (shadow_pde_access == PT_ENTRY_NOT_PRESENT) 
+    {
+      struct shadow_table * shadow_pt_table = get_pt_for_pde(state, guest_pde);
+      pte32_t * shadow_pt = NULL;
+
+      if (shadow_pt_table == NULL) {
+	PrintError("Could not allocate shadow page table\n");
+	return -1;
+      }
+
+      shadow_pt = (pte32_t *)(shadow_pt_table->page);
 
       shadow_pde->present = 1;
       shadow_pde->user_page = guest_pde->user_page;
@@ -444,6 +1713,12 @@ static int handle_shadow_pagefault32(struct guest_info * info, addr_t fault_addr
 	shadow_pde->writable = 0;
       }
     }
+  else if ((shadow_pde_access == PT_ACCESS_OK) && (shadow_pde->large_page == 1))
+    {
+      // Inconsistent state...
+      PrintDebug("Inconsistent state for 4MB shadow page... Guest re-entry should flush tlb\n");
+      return 0;
+    }
   else if (shadow_pde_access == PT_ACCESS_OK) 
     {
       //
@@ -483,7 +1758,8 @@ static int handle_shadow_pagefault32(struct guest_info * info, addr_t fault_addr
       PrintDebug("Large page write error... Setting dirty bit and returning\n");
       ((pde32_4MB_t *)guest_pde)->dirty = 1;
       shadow_pde->writable = guest_pde->writable;
-      return 0;
+
+      return v3_mark_page_dirty(info, guest_cr3);
       
     } 
   else if (shadow_pde_access == PT_USER_ERROR) 
@@ -512,12 +1788,30 @@ static int handle_shadow_pagefault32(struct guest_info * info, addr_t fault_addr
       return 0; 
     }
 
+  // The accessed and dirty bits we set in the guest page directory are writes the dirty log has to see
+  if ((*(uint_t *)guest_pde != *(uint_t *)&old_guest_pde) && 
+      (v3_mark_page_dirty(info, guest_cr3) == -1)) {
+    return -1;
+  }
+
   PrintDebug("Returning end of PDE function (rip=%p)\n", (void *)(addr_t)(info->rip));
   return 0;
 }
 
 
 
+// The accessed and dirty bits we set in the guest page table are writes the dirty log has to see
+static int mark_guest_pt_dirty(struct guest_info * info, struct shadow_table * table, 
+			       pte32_t * guest_pte, pte32_t old_guest_pte) {
+  if ((table->has_source == 0) || 
+      ((guest_pte->accessed == old_guest_pte.accessed) && (guest_pte->dirty == old_guest_pte.dirty))) {
+    return 0;
+  }
+
+  return v3_mark_page_dirty(info, table->guest_pa);
+}
+
+
 /* 
  * We assume the the guest pte pointer has already been translated to a host virtual address
  */
@@ -527,12 +1821,33 @@ static int handle_shadow_pte32_fault(struct guest_info * info,
 				     pte32_t * shadow_pt, 
 				     pte32_t * guest_pt) {
 
+  struct shadow_page_state * state = &(info->shdw_pg_state);
+  struct shadow_table * table = find_shadow_table(state->shadow_tables, (addr_t)shadow_pt);
   pt_access_status_t guest_pte_access;
   pt_access_status_t shadow_pte_access;
   pte32_t * guest_pte = (pte32_t *)&(guest_pt[PTE32_INDEX(fault_addr)]);;
   pte32_t * shadow_pte = (pte32_t *)&(shadow_pt[PTE32_INDEX(fault_addr)]);
+  pte32_t old_guest_pte = *guest_pte;
 
 
+  if (table == NULL) {
+    PrintError("Untracked shadow page table %p\n", (void *)shadow_pt);
+    return -1;
+  }
+
+  if (table->unsynced) {
+    // Only the faulting entry has to match the guest, the rest waits for the next CR3 load
+    if ((shadow_pte->present == 1) && 
+	(shadow_pte_in_sync(shadow_pte, guest_pte, table->maps[PTE32_INDEX(fault_addr)]) == 0)) {
+      PrintDebug("Dropping stale shadow PTE\n");
+      zap_shadow_pte(state, table, PTE32_INDEX(fault_addr));
+      v3_flush_guest_tlb_page(info, fault_addr);
+    }
+  } else if (attach_shadow_table(info, table) == -1) {
+    PrintError("Could not attach shadow page table\n");
+    return -1;
+  }
+
   // Check the guest page permissions
   guest_pte_access = can_access_pte32(guest_pt, fault_addr, error_code);
 
@@ -578,11 +1893,37 @@ static int handle_shadow_pte32_fault(struct guest_info * info,
       return 0;
     }
 
+    if (host_page_type == HOST_REGION_UNALLOCATED) {
+      if (error_code.write == 0) {
+	guest_pte->accessed = 1;
+
+	if (mark_guest_pt_dirty(info, table, guest_pte, old_guest_pte) == -1) {
+	  return -1;
+	}
+
+	return map_readonly_page(info, table, PTE32_INDEX(fault_addr), guest_pa, guest_pte->user_page);
+      }
+
+      if (alloc_demand_mem(info, guest_pa) == -1) {
+	return -1;
+      }
+
+      host_page_type = HOST_REGION_PHYSICAL_MEMORY;
+    }
+
     // else...
 
     if (host_page_type == HOST_REGION_PHYSICAL_MEMORY) {
-      struct shadow_page_state * state = &(info->shdw_pg_state);
       addr_t shadow_pa = get_shadow_addr(info, guest_pa);
+
+      if ((error_code.write == 1) && (is_guest_pt_frame(state, guest_pa))) {
+	PrintDebug("Immediate Write operation on Guest PAge Table Page\n");
+	unsync_guest_frame(state, guest_pa);
+      }
+
+      if (map_shadow_pte(state, table, PTE32_INDEX(fault_addr), guest_pa) == -1) {
+	return -1;
+      }
       
       shadow_pte->page_base_addr = PT32_BASE_ADDR(shadow_pa);
       
@@ -597,10 +1938,12 @@ static int handle_shadow_pte32_fault(struct guest_info * info,
       
       guest_pte->accessed = 1;
       
-      if (find_pte_map(state->cached_ptes, PT32_PAGE_ADDR(guest_pa)) != NULL) {
+      if (is_guest_pt_frame(state, guest_pa)) {
 	// Check if the entry is a page table...
 	PrintDebug("Marking page as Guest Page Table %d\n", shadow_pte->writable);
 	shadow_pte->vmm_info = PT32_GUEST_PT;
+      } else {
+	shadow_pte->vmm_info = 0;
       }
 
       if (guest_pte->dirty == 1) {
@@ -608,18 +1951,26 @@ static int handle_shadow_pte32_fault(struct guest_info * info,
       } else if ((guest_pte->dirty == 0) && (error_code.write == 1)) {
 	shadow_pte->writable = guest_pte->writable;
 	guest_pte->dirty = 1;
-	
-	if (shadow_pte->vmm_info == PT32_GUEST_PT) {
-	  // Well that was quick...
-	  struct shadow_page_state * state = &(info->shdw_pg_state);
-	  PrintDebug("Immediate Write operation on Guest PAge Table Page\n");
-	  state->cached_cr3 = 0;
-	}
-
       } else if ((guest_pte->dirty == 0) && (error_code.write == 0)) {  // was =
 	shadow_pte->writable = 0;
       }
 
+      if (shadow_pte->vmm_info == PT32_GUEST_PT) {
+	// Keep it read only so we see the first write
+	shadow_pte->writable = 0;
+      }
+
+      // Pages that are clean in the dirty log stay read only until their first write
+      if (error_code.write == 1) {
+	if (v3_mark_page_dirty(info, guest_pa) == -1) {
+	  return -1;
+	}
+      } else if (v3_dirty_log_writable(info, guest_pa) == 0) {
+	shadow_pte->writable = 0;
+      }
+
+      prefetch_shadow_ptes(info, table, guest_pt, PTE32_INDEX(fault_addr));
+
 
 
     } else {
@@ -630,18 +1981,36 @@ static int handle_shadow_pte32_fault(struct guest_info * info,
       }
     }
 
-  } else if ((shadow_pte_access == PT_WRITE_ERROR) &&
-	     (guest_pte->dirty == 0)) {
+  } else if ((shadow_pte_access == PT_WRITE_ERROR) && 
+	     (maps_readonly_page(info, shadow_pte, PTE32_T_ADDR(*guest_pte)))) {
+
+    // The read only mapping is dropped, and the access refaults onto the page's own memory
+    PrintDebug("Write to read only demand page %p\n", (void *)PTE32_T_ADDR(*guest_pte));
+    return alloc_demand_mem(info, PTE32_T_ADDR(*guest_pte));
 
+  } else if (shadow_pte_access == PT_WRITE_ERROR) {
+    // The guest allows the write: the guest dirty bit is clear, the page is a guest page table, 
+    // or it is write protected for the dirty log
     PrintDebug("Shadow PTE Write Error\n");
+
+    if (v3_mark_page_dirty(info, PTE32_T_ADDR(*guest_pte)) == -1) {
+      return -1;
+    }
+
     guest_pte->dirty = 1;
     shadow_pte->writable = guest_pte->writable;
 
+    if (mark_guest_pt_dirty(info, table, guest_pte, old_guest_pte) == -1) {
+      return -1;
+    }
+
     if (shadow_pte->vmm_info == PT32_GUEST_PT) {
-      struct shadow_page_state * state = &(info->shdw_pg_state);
       PrintDebug("Write operation on Guest PAge Table Page\n");
-      state->cached_cr3 = 0;
+      unsync_guest_frame(state, PTE32_T_ADDR(*guest_pte));
+      shadow_pte->vmm_info = 0;
     }
+
+    v3_flush_guest_tlb_page(info, fault_addr);
     
     return 0;
 
@@ -653,6 +2022,10 @@ static int handle_shadow_pte32_fault(struct guest_info * info,
     return -1;
   }
 
+  if (mark_guest_pt_dirty(info, table, guest_pte, old_guest_pte) == -1) {
+    return -1;
+  }
+
   PrintDebug("Returning end of function\n");
   return 0;
 }
@@ -679,7 +2052,7 @@ int v3_handle_shadow_invlpg(struct guest_info * info)
 	uchar_t instr[15];
 	int index = 0;
 
-	int ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(info->segments.cs)), 15, instr);
+	int ret = read_guest_va_memory(info, get_addr_linear(info, info->rip, &(v3_get_segments(info)->cs)), 15, instr);
 	if (ret != 15) {
 	  PrintError("Could not read instruction 0x%p (ret=%d)\n",  (void *)(addr_t)(info->rip), ret);
 		return -1;
@@ -732,20 +2105,37 @@ int v3_handle_shadow_invlpg(struct guest_info * info)
 
 	guest_pde = (pde32_t *)&(guest_pd[PDE32_INDEX(first_operand)]);
 
+	struct shadow_page_state * state = &(info->shdw_pg_state);
+
 	if (guest_pde->large_page == 1) {
-		shadow_pde->present = 0;
+		struct shadow_table * shadow_pd_table = find_shadow_table(state->shadow_tables, (addr_t)shadow_pd);
+
+		if (shadow_pd_table != NULL) {
+			zap_shadow_pde(state, shadow_pd_table, PDE32_INDEX(first_operand));
+		}
+
 		PrintDebug("Invalidating Large Page\n");
+
+		// The large page is shadowed with 4KB entries, so drop everything
+		v3_flush_guest_tlb(info);
 	} else
 	if (shadow_pde->present == 1) {
-		pte32_t * shadow_pt = (pte32_t *)(addr_t)PDE32_T_ADDR((*shadow_pde));
-		pte32_t * shadow_pte = (pte32_t *) V3_VAddr( (void*) &shadow_pt[PTE32_INDEX(first_operand)] );
+		pte32_t * shadow_pt = (pte32_t *)V3_VAddr((void *)(addr_t)PDE32_T_ADDR((*shadow_pde)));
+		pte32_t * shadow_pte = (pte32_t *)&(shadow_pt[PTE32_INDEX(first_operand)]);
+		struct shadow_table * shadow_pt_table = find_shadow_table(state->shadow_tables, (addr_t)shadow_pt);
 
 #ifdef DEBUG_SHADOW_PAGING
 		PrintDebug("Setting not present\n");
 		PrintPTE32(first_operand, shadow_pte );
 #endif
 
-		shadow_pte->present = 0;
+		if (shadow_pt_table != NULL) {
+			zap_shadow_pte(state, shadow_pt_table, PTE32_INDEX(first_operand));
+		} else {
+			shadow_pte->present = 0;
+		}
+
+		v3_flush_guest_tlb_page(info, first_operand);
 	}
 
 	info->rip += index;
@@ -745,36 +745,36 @@ static int xed_reg_to_v3_reg(struct guest_info * info, xed_reg_enum_t xed_reg, a
     return CTRL_REGISTER;
 
   case XED_REG_FLAGS:
-    *v3_reg = (addr_t)&(info->ctrl_regs.rflags);
+    *v3_reg = (addr_t)&(v3_mod_ctrl_regs(info)->rflags);
     *reg_len = 2;
     return CTRL_REGISTER;
   case XED_REG_EFLAGS:
-    *v3_reg = (addr_t)&(info->ctrl_regs.rflags);
+    *v3_reg = (addr_t)&(v3_mod_ctrl_regs(info)->rflags);
     *reg_len = 4;
     return CTRL_REGISTER;
   case XED_REG_RFLAGS:
-    *v3_reg = (addr_t)&(info->ctrl_regs.rflags);
+    *v3_reg = (addr_t)&(v3_mod_ctrl_regs(info)->rflags);
     *reg_len = 8;
     return CTRL_REGISTER;
 
   case XED_REG_CR0:
-    *v3_reg = (addr_t)&(info->ctrl_regs.cr0);
+    *v3_reg = (addr_t)&(v3_mod_ctrl_regs(info)->cr0);
     *reg_len = 4;
     return CTRL_REGISTER;
   case XED_REG_CR2:
-    *v3_reg = (addr_t)&(info->ctrl_regs.cr2);
+    *v3_reg = (addr_t)&(v3_mod_ctrl_regs(info)->cr2);
     *reg_len = 4;
     return CTRL_REGISTER;
   case XED_REG_CR3:
-    *v3_reg = (addr_t)&(info->ctrl_regs.cr3);
+    *v3_reg = (addr_t)&(v3_mod_ctrl_regs(info)->cr3);
     *reg_len = 4;
     return CTRL_REGISTER;
   case XED_REG_CR4:
-    *v3_reg = (addr_t)&(info->ctrl_regs.cr4);
+    *v3_reg = (addr_t)&(v3_mod_ctrl_regs(info)->cr4);
     *reg_len = 4;
     return CTRL_REGISTER;
   case XED_REG_CR8:
-    *v3_reg = (addr_t)&(info->ctrl_regs.cr8);
+    *v3_reg = (addr_t)&(v3_mod_ctrl_regs(info)->cr8);
     *reg_len = 4;
     return CTRL_REGISTER;
 
@@ -798,22 +798,22 @@ static int xed_reg_to_v3_reg(struct guest_info * info, xed_reg_enum_t xed_reg, a
      * SEGMENT REGS
      */
   case XED_REG_CS:
-    *v3_reg = (addr_t)&(info->segments.cs);
+    *v3_reg = (addr_t)&(v3_mod_segments(info)->cs);
     return SEGMENT_REGISTER;
   case XED_REG_DS:
-    *v3_reg = (addr_t)&(info->segments.ds);
+    *v3_reg = (addr_t)&(v3_mod_segments(info)->ds);
     return SEGMENT_REGISTER;
   case XED_REG_ES:
-    *v3_reg = (addr_t)&(info->segments.es);
+    *v3_reg = (addr_t)&(v3_mod_segments(info)->es);
     return SEGMENT_REGISTER;
   case XED_REG_SS:
-    *v3_reg = (addr_t)&(info->segments.ss);
+    *v3_reg = (addr_t)&(v3_mod_segments(info)->ss);
     return SEGMENT_REGISTER;
   case XED_REG_FS:
-    *v3_reg = (addr_t)&(info->segments.fs);
+    *v3_reg = (addr_t)&(v3_mod_segments(info)->fs);
     return SEGMENT_REGISTER;
   case XED_REG_GS:
-    *v3_reg = (addr_t)&(info->segments.gs);
+    *v3_reg = (addr_t)&(v3_mod_segments(info)->gs);
     return SEGMENT_REGISTER;
 
 